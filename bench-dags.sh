@@ -0,0 +1,139 @@
+#! /bin/sh
+
+# UCLA CS 111 Lab 1 - Compare plain and time travel execution on
+# generated scripts whose dependency graphs have a known shape.
+#
+# Usage: bench-dags.sh [sleep|cpu [DURATION]]
+#
+# Every tree runs node.sh, which sleeps for DURATION seconds (or spins
+# for DURATION thousand loop iterations) and logs its id, so trees run
+# twice show up as duplicates.  The files a tree reads are passed as
+# words and the file it writes is its output, which is all timetrash
+# needs to see the edges.  The speedup bound is work / span from
+# timetrash --analyze.
+
+mode=${1-sleep}
+duration=${2-0.05}
+timetrash=$(pwd)/timetrash
+
+tmp=$0-$$.tmp
+mkdir "$tmp" || exit
+cd "$tmp" || exit
+
+cat >node.sh <<'EOF'
+id=$1 mode=$2 duration=$3
+if [ "$mode" = cpu ]; then
+  i=0 n=$((duration * 1000))
+  while [ $i -lt $n ]; do i=$((i + 1)); done
+else
+  sleep "$duration"
+fi
+echo "$id" >>runs.log
+EOF
+
+# node ID [INPUT...] - a tree that reads the INPUTs and writes nID
+node() {
+  id=$1
+  shift
+  echo "sh node.sh $id $mode $duration $* > n$id"
+  echo
+}
+
+fanout() {
+  node 0
+  i=1
+  while [ $i -le $1 ]; do node $i n0; i=$((i + 1)); done
+}
+
+chain() {
+  node 0
+  i=1
+  while [ $i -lt $1 ]; do node $i n$((i - 1)); i=$((i + 1)); done
+}
+
+diamond() {
+  node 0
+  inputs=
+  i=1
+  while [ $i -le $1 ]; do
+    node $i n0
+    inputs="$inputs n$i"
+    i=$((i + 1))
+  done
+  node $i $inputs
+}
+
+# random WIDTH DEPTH SEED - DEPTH levels of WIDTH trees, each reading
+# one to three trees of earlier levels
+random() {
+  awk -v width=$1 -v depth=$2 -v seed=$3 -v mode=$mode -v duration=$duration '
+    BEGIN {
+      srand(seed)
+      for (level = 0; level < depth; level++)
+        for (j = 0; j < width; j++) {
+          id = level * width + j
+          inputs = ""
+          if (level > 0)
+            for (k = 1 + int(rand() * 3); k > 0; k--)
+              inputs = inputs " n" int(rand() * level * width)
+          printf "sh node.sh %d %s %s%s > n%d\n\n", id, mode, duration, inputs, id
+        }
+    }'
+}
+
+# scratch COUNT FILES - COUNT trees writing FILES scratch files in turn,
+# so they are only ordered by write-after-write conflicts
+scratch() {
+  i=0
+  while [ $i -lt $1 ]; do
+    echo "sh node.sh $i $mode $duration > scratch$((i % $2))"
+    echo
+    i=$((i + 1))
+  done
+}
+
+now() {
+  date +%s.%N
+}
+
+# run NAME TREES FLAGS - runs script.sh both ways and prints a row
+run() {
+  name=$1 trees=$2 flags=$3
+  bound=$("$timetrash" $flags --analyze script.sh | sed -n 's/^speedup bound: //p')
+  edges=$("$timetrash" $flags --analyze script.sh | sed -n 's/^dependencies: //p')
+  for how in plain tt; do
+    rm -f n[0-9]* scratch* runs.log .scratch*
+    if [ $how = plain ]; then
+      opts=-s
+    else
+      opts="-s -t $flags"
+    fi
+    start=$(now)
+    "$timetrash" $opts script.sh 2>stats || {
+      cat stats
+      exit 1
+    }
+    end=$(now)
+    eval "${how}_time=\$(awk \"BEGIN { print \$end - \$start }\")"
+    eval "${how}_forks=\$(sed -n 's/^forks=//p' stats)"
+    eval "${how}_dups=\$((\$(wc -l <runs.log) - trees))"
+  done
+  printf '%-22s %5d %5d %8.3f %8.3f %7.2f %7.2f %6d %6d %5d\n' \
+    "$name" "$trees" "$edges" "$plain_time" "$tt_time" \
+    "$(awk "BEGIN { print $plain_time / $tt_time }")" "$bound" \
+    "$plain_forks" "$tt_forks" "$tt_dups"
+}
+
+echo "# node: $mode $duration; times in seconds"
+printf '%-22s %5s %5s %8s %8s %7s %7s %6s %6s %5s\n' \
+  shape trees edges plain-s tt-s speedup bound forks tt-fork dups
+
+fanout 16 >script.sh; run "fanout 16" 17
+chain 16 >script.sh; run "chain 16" 16
+diamond 16 >script.sh; run "diamond 16" 18
+random 6 4 1 >script.sh; run "random 6x4" 24
+random 12 2 2 >script.sh; run "random 12x2" 24
+scratch 16 2 >script.sh; run "scratch 16/2" 16
+run "scratch 16/2 -r" 16 -r
+
+cd .. && rm -fr "$tmp"
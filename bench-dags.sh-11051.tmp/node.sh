@@ -0,0 +1,8 @@
+id=$1 mode=$2 duration=$3
+if [ "$mode" = cpu ]; then
+  i=0 n=$((duration * 1000))
+  while [ $i -lt $n ]; do i=$((i + 1)); done
+else
+  sleep "$duration"
+fi
+echo "$id" >>runs.log
@@ -0,0 +1,36 @@
+sh node.sh 0 cpu 20  > n0
+
+sh node.sh 1 cpu 20 n0 > n1
+
+sh node.sh 2 cpu 20 n0 > n2
+
+sh node.sh 3 cpu 20 n0 > n3
+
+sh node.sh 4 cpu 20 n0 > n4
+
+sh node.sh 5 cpu 20 n0 > n5
+
+sh node.sh 6 cpu 20 n0 > n6
+
+sh node.sh 7 cpu 20 n0 > n7
+
+sh node.sh 8 cpu 20 n0 > n8
+
+sh node.sh 9 cpu 20 n0 > n9
+
+sh node.sh 10 cpu 20 n0 > n10
+
+sh node.sh 11 cpu 20 n0 > n11
+
+sh node.sh 12 cpu 20 n0 > n12
+
+sh node.sh 13 cpu 20 n0 > n13
+
+sh node.sh 14 cpu 20 n0 > n14
+
+sh node.sh 15 cpu 20 n0 > n15
+
+sh node.sh 16 cpu 20 n0 > n16
+
+sh node.sh 17 cpu 20 n1 n2 n3 n4 n5 n6 n7 n8 n9 n10 n11 n12 n13 n14 n15 n16 > n17
+
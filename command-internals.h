@@ -18,6 +18,10 @@ struct command
   // Exit status, or -1 if not known (e.g., because it has not exited yet).
   int status;
 
+  // Process running the command after execute_command_async, or 0 once
+  // it has been waited for or if it was never started that way.
+  int pid;
+
   // I/O redirections, or 0 if none.
   char *input;
   char *output;
@@ -34,3 +38,41 @@ struct command
     struct command *subshell_command;
   } u;
 };
+
+// A node of a flat_script: the same command as the struct command at
+// the same index, with its links as indices.
+struct flat_node
+{
+  enum command_type type;
+
+  // One past the last node of this node's subtree, which takes up the
+  // indices from this node's to END.
+  int end;
+
+  // Children of the binary types; a subshell's command is child[0].
+  int child[2];
+
+  // Ids of the redirections in files, or -1 if none.
+  int input;
+  int output;
+
+  // For SIMPLE_COMMAND: numWords words from words[word].
+  int word;
+  int numWords;
+};
+
+// The trees of a script laid out in pre-order, by flatten_stream.
+struct flat_script
+{
+  int size;
+  struct flat_node *nodes;
+  struct command *commands;  // commands[I] is nodes[I] as a struct command
+  char **words;              // Every word vector, each NULL-terminated
+  char *strings;             // Every word and file name
+  char **files;              // Each redirection file name once, by id
+  int numFiles;
+};
+
+// The flat script holding C, with C's index in *INDEX, or NULL if C
+// was not flattened.
+struct flat_script *flat_script_of (struct command *c, int *index);
@@ -1,4 +1,7 @@
 #include <stdbool.h> // for boolean type
+#include <stddef.h>  // for size_t
+#include <stdio.h>   // for FILE
+#include <sys/resource.h> // for struct rusage
 
 #define NEW_TREE_COMMAND 77
 #define NEWLINE_COMMAND 11
@@ -11,7 +14,39 @@
 /////////////////////////////////////////////////
 ///////////////  Globals           //////////////
 /////////////////////////////////////////////////
-extern int num_trees;
+// Options of the time travel scheduler.  Each thread has its own, set
+// before it runs a graph.
+
+// Time travel journal: every finished tree is appended to JOURNAL_FILE,
+// and with RESUME_RUN the trees it lists for the same SCRIPT_HASH are
+// not run again
+extern __thread char const* journal_file;
+extern __thread bool resume_run;
+extern __thread unsigned long long script_hash;
+
+// Most graph nodes the time travel scheduler runs at once, 0 for no limit
+extern __thread int max_jobs;
+
+// With KEEP_ORDER the time travel scheduler captures each tree's
+// output and writes it out in script order, holding at most about
+// KEEP_ORDER_LIMIT bytes for trees that finished early
+extern __thread bool keep_order;
+extern __thread size_t keep_order_limit;
+
+// With PIPE_TEMPS the time travel scheduler hands a scratch file from
+// its writer to its reader through a pipe or memfd instead of the file
+// system; with KEEP_TEMPS the file is written as well
+extern __thread bool pipe_temps;
+extern __thread bool keep_temps;
+
+// With PLACEMENT the time travel scheduler pins each tree it forks to
+// CPUs sharing a cache, next to the tree whose output it reads
+extern __thread bool placement;
+
+// With MEMORY_BUDGET_KB above 0 the time travel scheduler only starts a
+// tree while its expected peak memory, with that of the trees running,
+// fits in that many kilobytes
+extern __thread long long memory_budget_kb;
 
 /////////////////////////////////////////////////
 ///////////////  Token Definition  //////////////
@@ -36,15 +71,6 @@ typedef struct token token;
 typedef struct token_list* token_list_t; 
 typedef struct token_list token_list;
 
-// Add token to linked list
-void add_token(token* to_add, token_list_t* head);
-
-// Free memory allocated to linked list
-void free_token_list(token_list_t head);
-
-// For debugging purposes
-void print_token_list(token_list_t token_list);
-
 /////////////////////////////////////////////////
 //////////  Command Stream Definition  //////////
 /////////////////////////////////////////////////
@@ -56,8 +82,8 @@ typedef struct command_stream *command_stream_t;
 typedef struct node* node_t;
 typedef struct node node;
 
-// Constructor
-void initialize_stream(command_stream_t m_command_stream);
+// Allocates an empty stream
+command_stream_t new_command_stream(void);
 
 // Add command to command stream
 void add_command(command_t to_add_command, command_stream_t m_command_stream);
@@ -65,13 +91,12 @@ void add_command(command_t to_add_command, command_stream_t m_command_stream);
 // Set cur pointer back to head
 void reset_traverse(command_stream_t cStream);
 
-command_t traverse(command_stream_t cStream);
-
-// For debugging
-void print_stream(command_stream_t cStream);
+// Free the list of a stream whose commands have been passed on, and
+// with FREE_TOKENS the commands in it that are not simple commands
+void free_stream(command_stream_t m_command_stream, bool free_tokens);
 
-// Free memory allocated to stream
-void free_stream(command_stream_t m_command_stream);
+// Free a tree the parser built, with its words and file names
+void free_command(command_t c);
 
 /////////////////////////////////////////////////
 ///////////////  Read / Write List  /////////////
@@ -86,77 +111,420 @@ typedef struct graph_node* graph_node_t;
 void dump_graph_node(graph_node_t gnode);
 
 void print_dependencies(graph_node_t gnode);
-void execute_commands(command_graph_t cg);
+// Runs the trees of CG, as many at once as it allows.  Returns false,
+// with a message on stderr, if the journal or a kept scratch file
+// cannot be written or no worker is left to run on.
+bool execute_commands(command_graph_t cg);
+int graph_node_status(command_graph_t cg, int index);
 void createDependencies(command_graph_t cg);
+
+// Frees CG, leaving the commands it was built from alone
+void free_command_graph(command_graph_t cg);
+
+// Gives every writer of a renameable file a private version so that only
+// RAW dependencies remain for it.  Call before createDependencies.
+void createOutputVersions(command_graph_t cg);
+
+// Finds files that one tree writes and one later tree reads, and only
+// by redirection, and passes them between the two without the file
+// system.  Call after createDependencies.
+void eliminateTempFiles(command_graph_t cg);
+
+// Prints the work, span and critical path of CG without running it.
+// Trees are weighed by their times in the journal DURATIONS_FILE if
+// given, and by one each otherwise.  DOT_FILE, if given, gets the graph
+// with every edge labeled by the files that cause it.  Returns false,
+// with a message on stderr, if either file cannot be used.
+bool analyze_graph(command_graph_t cg, char const* durations_file,
+		   char const* dot_file);
+
+// Orders in which ready trees can be started
+enum sched_policy {
+  POLICY_FIFO,           // In the order they became ready, as -t does
+  POLICY_CRITICAL_PATH,  // Heaviest chain to the end of the script first
+  POLICY_LONGEST_FIRST,  // Heaviest tree first
+  NUM_POLICIES
+};
+extern char const* const policy_names[];
+
+// Prints the makespan and utilization a simulated -t run of CG would
+// have with each of the NUMJOBS job limits in JOBS and every policy.
+// Trees are weighed as by analyze_graph.  Returns false if the journal
+// cannot be read.
+bool simulate_graph(command_graph_t cg, char const* durations_file,
+		    int* jobs, int numJobs);
+
+// Order in which -t starts ready trees, by their expected times from
+// the runtime history
+extern __thread enum sched_policy sched_policy;
 void dump_command_graph(command_graph_t cgraph);
 
 /////////////////////////////////////////////////
-///////////////  Stack Definition  //////////////
+/////////////  Flattened Trees  /////////////////
 /////////////////////////////////////////////////
 
-typedef struct st_node st_node;
-typedef struct st_node* st_node_t;
+// Copies the trees of S into one contiguous pre-order layout and
+// returns a stream of the copies.  Frees S and its trees.
+command_stream_t flatten_stream(command_stream_t s);
 
-typedef struct stack stack;
-typedef struct stack* stack2_t;
+// Frees a stream returned by flatten_stream, with its trees
+void free_flat_stream(command_stream_t s);
 
-// Constructor
-stack2_t init_stack();
+/////////////////////////////////////////////////
+/////////////  Command Serialization  ///////////
+/////////////////////////////////////////////////
 
-// Add command onto stack
-void push(command_t to_add, stack2_t stack);
+// Flattens a command tree into a malloc'd buffer of *LEN bytes
+char* serialize_command(command_t c, size_t* len);
 
-// Remove and return top command of stack
-command_t pop(stack2_t stack);
+// Rebuilds a tree written by serialize_command, or returns NULL if the
+// buffer is malformed
+command_t deserialize_command(char const* buf, size_t len);
 
-// Return top command on stack
-command_t peek(stack2_t stack);
+// Same, for a tree shipped together with its read and write lists.
+// The lists deserialize_job hands back, NULL if the job is malformed,
+// are freed with free_job_list.
+char* serialize_job(command_t c, char** read_list, char** write_list, size_t* len);
+command_t deserialize_job(char const* buf, size_t len,
+			  char*** read_list, char*** write_list);
+void free_job_list(char** list);
 
-// Check if stack is empty
-bool isEmpty(stack2_t stack);
+// Messages exchanged with worker processes: a fixed header followed by
+// LEN bytes of payload
+enum message_type
+{
+  MSG_RUN,   // payload is a serialized job to run as INDEX
+  MSG_DONE,  // job INDEX exited with STATUS
+  MSG_HELLO, // sent by timetrash-worker on connect; STATUS is its slot count
+  MSG_AUTH,  // sent to timetrash-worker first; payload is the shared key
+};
 
-// Free all memory allocated to stack
-void free_stack(stack2_t stack);
+struct message
+{
+  int type;
+  int index;
+  int status;
+  unsigned len;
+};
 
-// Print out contents of stack
-void print_stack(stack2_t stack);
+#define MAX_MESSAGE_SIZE (64 << 20)
 
-// Testing Data Structure
-void test_stack();
+bool send_message(int fd, int type, int index, int status,
+		  char const* payload, size_t len);
+
+// Reads one message; the payload, if any, is malloc'd into *PAYLOAD.
+// Returns false on EOF or error.
+bool recv_message(int fd, struct message* m, char** payload);
 
 /////////////////////////////////////////////////
-/////////////  Additional Functions  ////////////
+///////////////  Worker Pool  ///////////////////
 /////////////////////////////////////////////////
 
-// Checks if passed in character matches characters allowed by the spec
-bool is_valid_char(char character);
+struct worker_pool;
 
-// Reads input file into a buffer while parsing out the comments
-char* read_file_into_buffer(int (*get_next_byte) (void *), void *get_next_byte_argument);
+// Starts a pool for this thread to launch trees through, with SIZE
+// helper processes forked to launch them on our behalf.  Call this
+// early, before the script is parsed, so that the helpers are small.
+struct worker_pool* start_worker_pool(int size);
 
-// Creates a linked list of tokens given an input buffer
-token_list_t convert_to_tokens(char* buffer);
+// Has this thread launch trees through POOL, or itself if NULL
+void use_worker_pool(struct worker_pool* pool);
 
-// Checks passed in token_list to verify that token ordering is syntactically valid
-void check_token_list(token_list_t token_list);
+// Adds the timetrash-worker daemons listed in SPEC (HOST:PORT,...) to
+// this thread's pool, proving to each that we know the key in KEY_FILE.
+// Returns false, with a message on stderr, if one cannot be added.
+bool connect_workers(char const* spec, char const* key_file);
 
-// Returns true if the type is an operator
-bool is_operator(int type);
+// The key in FILE, without its trailing newlines, malloc'd with its
+// length in *LEN.  Returns NULL, with a message on stderr, if FILE
+// cannot be read or holds no key.
+char* read_worker_key(char const* file, size_t* len);
 
-// Returns the precendence of a passed in operator
-int get_precedence(int type);
+// Waits up to a few seconds for the coordinator on FD to send the KEY
+// of LEN bytes.  Returns false if it sends anything else.
+bool check_worker_key(int fd, char const* key, size_t len);
 
-// Initializes an empty command
-command_t form_basic_command(int type);
+bool worker_pool_active(void);
+
+bool pool_has_free_slot(void);
+
+// Returns false if no endpoint has a free slot
+bool pool_submit(int index, command_t c, char** read_list, char** write_list);
+
+// Status reported by pool_wait for a tree whose endpoint was lost
+#define POOL_LOST (-1)
+// Status, with an index of -1, once no endpoint is left
+#define POOL_FAILED (-2)
 
-// Takes token list and creates a command stream with no depth
-command_stream_t make_basic_stream(token_list_t tList);
+// USAGE, if not NULL, gets what the tree used
+int pool_wait(int* status, struct rusage* usage);
 
-// Handles different newline cases
-command_stream_t solve_newlines(command_stream_t nlStream); 
+// Runs C on an endpoint and waits for it.  Returns false if no endpoint
+// is left to run it on.
+bool pool_execute(command_t c);
 
-// Takes a simple command stream and turns it into a forest of command trees
-command_stream_t make_advanced_stream(command_stream_t basic_stream);
+// Stops this thread's pool and frees it
+void stop_worker_pool(void);
+
+// Runs jobs arriving on FD until it is closed (the endpoint side)
+void serve_jobs(int fd);
+
+/////////////////////////////////////////////////
+///////////////  Script Loading  ////////////////
+/////////////////////////////////////////////////
+
+struct script
+{
+  char const* name;
+  FILE* file; // Already open stream to parse instead of NAME, or NULL
+  command_stream_t stream;
+  int num_trees;
+  unsigned long long hash; // Of the script's bytes
+};
+
+// Parses one script in this thread.  Returns false, with a message on
+// stderr, if it cannot be read or has a syntax error.
+bool parse_script(struct script* s);
+
+// Parses every script, several at a time on threads when there is more
+// than one.  Returns false if any failed.
+bool load_scripts(struct script* scripts, int n);
+
+// Runs the trees of the N SCRIPTS the way -t does, but with at most
+// WINDOW of them in memory, parsing the next as one finishes.  Sets
+// STATUS[I] to the exit status of the last tree of script I.  A script
+// that does not parse ends the reading, and gets status 1 once the
+// trees before its error have finished; false is returned then.
+bool execute_window(struct script* scripts, int n, int window, int* status);
+
+// Reads a script one tree at a time, parsing each only when it is asked
+// for, so that only the current tree is ever in memory.  Returns NULL,
+// with a message on stderr, if the script cannot be opened.
+struct tree_reader;
+struct tree_reader* open_tree_reader(struct script* s);
+
+// The next tree, or NULL at the end of the script or at a syntax error.
+// Free it with free_command.
+command_t read_tree(struct tree_reader* r);
+
+// Returns false if the script had a syntax error
+bool close_tree_reader(struct tree_reader* r);
+
+// One stream holding the trees of all N scripts in order, and a hash
+// covering all of them
+command_stream_t combine_scripts(struct script* scripts, int n,
+				 unsigned long long* hash);
+
+/////////////////////////////////////////////////
+///////////////  Service Mode  //////////////////
+/////////////////////////////////////////////////
+
+// Runs scripts for clients of the Unix domain socket SOCKET_PATH until
+// killed
+int serve(char const* socket_path, int time_travel, int rename_outputs);
+
+// Has the server at SOCKET_PATH run SCRIPT with our stdio; returns its
+// exit status
+int run_remote(char const* socket_path, char const* script);
+
+/////////////////////////////////////////////////
+///////////////  Tracing  ///////////////////////
+/////////////////////////////////////////////////
+
+// Trace-event JSON of a -t run, for chrome://tracing or Perfetto.
+// Everything below does nothing unless trace_open was called.
+void trace_open(char const* file);
+void trace_close(void);
+bool tracing(void);
+
+// Microseconds since trace_open
+double trace_now(void);
+
+void trace_slot_name(int slot);
+void trace_node(int index, char const* name, int slot, double spawn,
+		double exec, double exit, int status, char const* args);
+void trace_flow(int from, int fromSlot, double fromTs, int to, int toSlot, double toTs);
+void trace_instant(char const* name, int tree);
+// Same, with ARGS as extra JSON members for the event's args
+void trace_instant_args(char const* name, int tree, char const* args);
+void trace_counter(char const* name, int value);
+
+/////////////////////////////////////////////////
+///////////////  CPU Placement  /////////////////
+/////////////////////////////////////////////////
+
+// Reads the cache layout, the first time, and forgets where the nodes
+// of the last run were placed.  SIZE is the number of graph nodes.
+void start_placement(int size);
+void stop_placement(void);
+
+// Picks CPUs for node NODE near those node NEAR ran on, if NEAR is not
+// -1, and returns their domain.  With TOGETHER, NEAR is the other end of
+// a pipe and the node goes with it even if the domain is busy.  *REASON
+// names the rule that decided.
+int place_node(int node, int near, bool together, char const** reason);
+
+// The CPUs of DOMAIN as a list such as "0-3,8"
+char const* domain_cpus(int domain);
+
+// In the child about to run NODE: keeps it on its CPUs
+void pin_node(int node);
+
+// NODE has finished, and leaves its CPUs to others
+void unplace_node(int node);
+
+/////////////////////////////////////////////////
+///////////////  Resource Accounting  ///////////
+/////////////////////////////////////////////////
+
+// Sets up a record for every command in S, shared with processes forked
+// from now on.  Nothing is accounted before this is called.
+void start_accounting(command_stream_t s);
+
+// Whether start_accounting has been called
+bool accounting(void);
+
+// Monotonic seconds, or 0 when not accounting
+double accounting_now(void);
+
+// Stores what wait4 said about C, which was started at START
+void account_command(command_t c, struct rusage const* ru, double start);
+
+// Adds C, as read from the stream, as the root of tree number TREE.
+// Call this before the tree runs.
+void accounting_add_tree(int tree, command_t c);
+
+// Brackets a tree run in this process, to charge it with whatever its
+// children used
+void accounting_start_tree(int tree, command_t c);
+void accounting_end_tree(command_t c);
+
+void rusage_add(struct rusage* sum, struct rusage const* ru);
+
+// Prints the TOP biggest commands and trees and the totals to stderr
+void report_accounting(int top);
+
+// Drops the records, so that nothing is accounted until start_accounting
+void stop_accounting(void);
+
+/////////////////////////////////////////////////
+///////////////  Runtime History  ///////////////
+/////////////////////////////////////////////////
+
+// Reads the history FILE and looks up every tree of S in it.  Call
+// before createOutputVersions, which changes the trees' text.  Returns
+// false, with a message on stderr, if FILE exists but cannot be read.
+bool load_history(char const* file, command_stream_t s);
+bool history_loaded(void);
+
+// Expected seconds for tree number TREE, or -1 if it was never seen
+double history_expected(int tree);
+
+// Records that tree number TREE took SECONDS this run
+void history_observe(int tree, double seconds);
+
+// Expected peak resident set of tree number TREE in kilobytes, or -1 if
+// it was never measured
+long history_expected_kb(int tree);
+
+// Records the peak resident set of tree number TREE this run
+void history_observe_kb(int tree, long kb);
+
+// Folds this run's times into the history file
+void save_history(void);
+
+// Prints predicted against actual times, worst TOP trees first
+void report_history(int top);
+
+// Forgets the history, after save_history, so that the next run of this
+// thread only uses one it loads itself
+void close_history(void);
+
+/////////////////////////////////////////////////
+///////////////  Memory Expectations  ///////////
+/////////////////////////////////////////////////
+
+// MemAvailable from /proc/meminfo in kilobytes, or 0 if unknown
+long long available_memory_kb(void);
+
+// Kilobytes in a size such as 512M, rounded up, or -1 if S is not one
+long long parse_size_kb(char const* s);
+
+// Reads the memory hints FILE and looks up every tree of S in it.  Call
+// before createOutputVersions, as for load_history.  Returns false,
+// with a message on stderr, if FILE cannot be read or has a bad line.
+bool load_memory_hints(char const* file, command_stream_t s);
+
+// Peak kilobytes tree number TREE is expected to need: its hint, or else
+// its peak in the runtime history, or else 0
+long long expected_peak_kb(int tree);
+
+// Drops the hints, so that only the history is used
+void forget_memory_hints(void);
+
+/////////////////////////////////////////////////
+///////////////  Statistics  ////////////////////
+/////////////////////////////////////////////////
+
+enum stat_counter {
+  STAT_BYTES_READ,
+  STAT_TOKENS,
+  STAT_TREES,
+  STAT_GRAPH_NODES,
+  STAT_GRAPH_EDGES,
+  STAT_FORKS,
+  STAT_EXECS,
+  STAT_PIPES,
+  STAT_REDIRECTIONS,
+  STAT_WAITS,
+  STAT_WAKEUPS,     // Scheduler returns from a blocking wait
+  STAT_PARSE_NS,
+  STAT_GRAPH_NS,
+  STAT_EXECUTE_NS,
+  NUM_STATS
+};
+
+extern __thread unsigned long long* stat_counters;
+
+#define STAT_ADD(counter, n) \
+  __atomic_fetch_add(&stat_counters[counter], (n), __ATOMIC_RELAXED)
+#define STAT_INC(counter) STAT_ADD(counter, 1)
+#define STAT_DEC(counter) \
+  __atomic_fetch_sub(&stat_counters[counter], 1, __ATOMIC_RELAXED)
+
+// Shares the counters with processes forked from now on, and returns
+// them; call it before anything forks
+unsigned long long* start_stats(void);
+
+// Points this thread at COUNTERS from start_stats, or at the private
+// ones if NULL
+void use_stats(unsigned long long* counters);
+
+// Unmaps COUNTERS, which this thread stops using
+void stop_stats(unsigned long long* counters);
+
+// Monotonic nanoseconds, for the phase times
+unsigned long long stat_clock(void);
+
+// Writes every counter to stderr as NAME=VALUE
+void print_stats(void);
+
+/////////////////////////////////////////////////
+///////////////  Stack Definition  //////////////
+/////////////////////////////////////////////////
+
+typedef struct st_node st_node;
+typedef struct st_node* st_node_t;
+
+typedef struct stack stack;
+typedef struct stack* stack2_t;
+
+/////////////////////////////////////////////////
+/////////////  Additional Functions  ////////////
+/////////////////////////////////////////////////
+
+// Initializes an empty command
+command_t form_basic_command(int type);
 
 /////////////////////////////////////////////////
 ////////////////  Given Functions  //////////////
@@ -165,20 +533,53 @@ command_stream_t make_advanced_stream(command_stream_t basic_stream);
 /* Create a command stream from LABEL, GETBYTE, and ARG.  A reader of
    the command stream will invoke GETBYTE (ARG) to get the next byte.
    GETBYTE will return the next input byte, or a negative number
-   (setting errno) on failure.  */
+   (setting errno) on failure.  Return NULL, with a message on stderr,
+   if the input has a syntax error or no command.  Threads may parse
+   at the same time.  */
 command_stream_t make_command_stream (int (*getbyte) (void *), void *arg);
 
-/* Read a command from STREAM; return it, or NULL on EOF.  If there is
-   an error, report the error and exit instead of returning.  */
+/* Number the lines of the next input this thread parses from LINE, in
+   error messages.  */
+void set_parse_line (int line);
+
+/* Read a command from STREAM; return it, or NULL on EOF.  */
 command_t read_command_stream (command_stream_t stream);
 
 /* Print a command to stdout, for debugging.  */
 void print_command (command_t);
 
+/* Print a command the way -p does, headed by "# NUMBER".  Output is
+   buffered until print_flush, which must be called before anything
+   else writes to stdout.  */
+void print_numbered_command (int number, command_t);
+void print_flush (void);
+
+/* Write a command on one line into BUF, cutting it short to fit in
+   SIZE bytes.  */
+void command_text (command_t, char *buf, size_t size);
+
+// Creates a job server with TOKENS slots shared by all processes
+// forked afterwards; every running graph node holds one slot
+void start_jobserver(int tokens);
+bool acquireJobToken(bool wait);
+void releaseJobToken(void);
+
+// Resolves the command names in C through PATH ahead of time, so that
+// later executions skip the search
+void warm_path_cache(command_t c);
+
 /* Execute a command.  Use "time travel" if the integer flag is
    nonzero.  */
 void execute_command (command_t, int);
 
+/* Start executing a command in a process of its own and return at
+   once.  command_status waits for it.  May run alongside time travel,
+   whose scheduler only reaps the children it forked.  */
+void execute_command_async (command_t, int);
+
 /* Return the exit status of a command, which must have previously been executed.
    Wait for the command, if it is not already finished.  */
 int command_status (command_t);
+
+/* Same, but return -1 at once if the command is still running.  */
+int command_poll (command_t);
@@ -1,14 +1,25 @@
 // UCLA CS 111 Lab 1 command execution
 
+#define _GNU_SOURCE // for memfd_create
+
 #include "command.h"
 #include "command-internals.h"
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/pidfd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <stdio.h>
 #include <error.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h> //for strcmp function
+#include <time.h>
 #include "alloc.h"
 
 
@@ -35,6 +46,10 @@ struct graph_node {
   
   int i;
 
+  int waiting; // Dependencies still in the window (windowed execution only)
+
+  struct temp_file* temp; // Scratch file it writes or reads without the file system (NULL if none)
+
   int stage; // which stage of execution the node is in (initialize to 0 in create_graph_nodes)
   
 };
@@ -60,6 +75,73 @@ struct command_graph {
   //    which commands should be executed at stage 1. staged_commands[1] => stage 2,
   //    ... staged_commands[num_stages-1] => final stage.
   int* stageSize;
+
+  struct renamed_file* renamed; // Files whose writers get private versions (NULL unless renaming)
+
+  int numRenamed;
+
+  struct temp_file* temps; // Scratch files passed from writer to reader directly (NULL unless eliminating)
+
+  int numTemps;
+};
+
+// Output renaming
+// -------------------------------------------------------------------
+// Works like register renaming: every tree that writes a renamed file
+// writes into its own temp file in the same directory, readers are
+// pointed at the version written by the latest earlier writer, and the
+// versions are renamed over the real file in program order.  Only RAW
+// edges are needed for such files.  A file written behind && or || is
+// not renamed, since its readers could not tell whether to expect the
+// version.
+
+struct file_version {
+  graph_node_t writer; // Tree that produces this version
+  
+  char* temp; // Private file the writer redirects into
+  
+  graph_node_t* readers; // Trees that read this version
+  
+  int numReaders;
+};
+
+struct renamed_file {
+  char* name; // Real file name
+  
+  struct file_version* versions; // In program order
+  
+  int numVersions;
+  
+  graph_node_t* baseReaders; // Trees reading the file as it was before the script ran
+  
+  int numBaseReaders;
+  
+  int retired; // Number of versions already renamed into place
+};
+
+// Scratch files
+// -------------------------------------------------------------------
+// A file written by one tree and then read by one later tree, and by
+// nothing else, need not go through the file system.  If the reader
+// streams its input the two are started together, joined by a pipe,
+// like the two sides of a pipeline; otherwise the writer fills a memfd
+// that the reader opens once the writer is done.  Both are reached as
+// /dev/fd/N, so only the redirections change.
+
+struct temp_file {
+  char* name; // As the redirections name it
+  
+  graph_node_t writer;
+  
+  graph_node_t reader;
+  
+  bool piped; // Writer and reader run together; otherwise a memfd
+  
+  int fd[2]; // The scheduler's read and write ends, -1 when closed
+  
+  char path[2][32]; // /dev/fd names of the ends
+  
+  int helper; // Pid of the process copying the pipe, if any
 };
 
 
@@ -68,7 +150,14 @@ command_graph_t create_graph_nodes(command_stream_t cstream)
   int ii; //iterator
   
   command_graph_t cgraph = (command_graph_t) checked_malloc(sizeof(struct command_graph));
-  cgraph->size = num_trees;
+  cgraph->size = 0;
+  while (read_command_stream(cstream))
+    cgraph->size++;
+  reset_traverse(cstream);
+  cgraph->renamed = NULL;
+  cgraph->numRenamed = 0;
+  cgraph->temps = NULL;
+  cgraph->numTemps = 0;
   cgraph->nodes = (graph_node_t*) checked_malloc(sizeof(graph_node_t) * (cgraph->size+ 1));
   cgraph->nodes[cgraph->size] = NULL;
   
@@ -82,6 +171,9 @@ command_graph_t create_graph_nodes(command_stream_t cstream)
     
     //do dependencies in another function, NULL for now
     gnode->dependencies = NULL;
+    gnode->depSize = 0;
+    gnode->dependOnMe = NULL;
+    gnode->depMeSize = 0;
     
     //read_list field
     gnode->read_list = createReadList(gnode->cmd);
@@ -92,10 +184,13 @@ command_graph_t create_graph_nodes(command_stream_t cstream)
     //stage field
     gnode->stage = 0;
 
+    gnode->temp = NULL;
+
     gnode->i = ii;
     
     //insert node into graph
     cgraph->nodes[ii] = gnode;
+    STAT_INC(STAT_GRAPH_NODES);
     
   }
   
@@ -112,6 +207,43 @@ command_graph_t create_graph_nodes(command_stream_t cstream)
   return cgraph;
 }
 
+// Frees CG and its nodes, but not the commands, which belong to the
+// stream the graph was built from
+static void redirectFile(command_t c, char* name, char* temp, bool output);
+
+void free_command_graph(command_graph_t cg)
+{
+  // Points the trees back at the real files, so they can be run again
+  int i = 0;
+  for (; i < cg->numRenamed; i++) {
+    struct renamed_file* f = &cg->renamed[i];
+    int v = 0;
+    for (; v < f->numVersions; v++) {
+      struct file_version* version = &f->versions[v];
+      redirectFile(version->writer->cmd, version->temp, f->name, true);
+      int r = 0;
+      for (; r < version->numReaders; r++)
+        redirectFile(version->readers[r]->cmd, version->temp, f->name, false);
+      free(version->temp);
+      free(version->readers);
+    }
+    free(f->versions);
+    free(f->baseReaders);
+  }
+  for (i = 0; i < cg->size; i++) {
+    graph_node_t n = cg->nodes[i];
+    free(n->read_list);
+    free(n->write_list);
+    free(n->dependencies);
+    free(n->dependOnMe);
+    free(n);
+  }
+  free(cg->renamed);
+  free(cg->temps);
+  free(cg->nodes);
+  free(cg);
+}
+
 void dump_command_graph(command_graph_t cgraph){
   int ii;
   for(ii=0; ii!=cgraph->size; ii++){
@@ -170,228 +302,2323 @@ void print_dependencies(graph_node_t gnode){
    static function definitions, etc.  */
 
 
-bool isFinished(bool* f, int size)
+static bool isFinished(bool* f, int size)
+{
+  int i = 0;
+  for (; i < size; i++) {
+    if (!f[i])
+      return false;
+  }
+  return true;
+}
+
+// State of the run in progress.  Every thread has its own, so threads
+// can each run a graph at the same time.
+static __thread bool* finished;
+static __thread int* pids;
+static __thread double* launchedAt;
+static __thread int numNodes;
+static __thread command_graph_t comg;
+
+static void retireVersions(command_graph_t cg);
+static void fillMissingVersions(command_graph_t cg, graph_node_t n);
+static void execute_tail(command_t c, int time_travel);
+static void watchNode(int i);
+static double* nodePriorities(command_graph_t cg);
+static unsigned hashName(char const* name);
+static bool isMatch(char** a, char** b);
+
+// Journal
+// -------------------------------------------------------------------
+// One line per finished tree: "INDEX STATUS HASH SECONDS".  Lines for
+// a different script hash are ignored, so a stale journal is harmless.
+// SECONDS, the tree's wall time, is missing from older journals.
+
+__thread char const* journal_file = NULL;
+__thread bool resume_run = false;
+__thread unsigned long long script_hash = 0;
+static __thread FILE* journal = NULL;
+
+static double monotonicSeconds(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Reads one journal line; SECONDS is -1 if the line has none
+static bool readJournalLine(FILE* f, int* index, int* status,
+                            unsigned long long* hash, double* seconds)
+{
+  char line[256];
+  while (fgets(line, sizeof line, f)) {
+    *seconds = -1;
+    if (sscanf(line, "%d %d %llx %lf", index, status, hash, seconds) >= 3)
+      return true;
+  }
+  return false;
+}
+
+// Marks every tree recorded in the journal as finished.  Returns the
+// number of trees marked, or -1 if the journal cannot be read.
+static int loadJournal(command_graph_t cg)
+{
+  FILE* f = fopen(journal_file, "r");
+  if (f == NULL) {
+    if (errno == ENOENT)
+      return 0;
+    error(0, errno, "%s: cannot open journal", journal_file);
+    return -1;
+  }
+  int numLoaded = 0;
+  int numStale = 0;
+  int index, status;
+  unsigned long long hash;
+  double seconds;
+  while (readJournalLine(f, &index, &status, &hash, &seconds)) {
+    if (hash != script_hash || index < 0 || index >= cg->size) {
+      numStale++;
+      continue;
+    }
+    if (finished[index])
+      continue;
+    finished[index] = true;
+    cg->nodes[index]->cmd->status = status;
+    numLoaded++;
+  }
+  fclose(f);
+  if (numStale)
+    error(0, 0, "%s: ignored %d entries for another script", journal_file, numStale);
+  return numLoaded;
+}
+
+static void journalNode(graph_node_t n, double seconds)
+{
+  if (journal == NULL)
+    return;
+  fprintf(journal, "%d %d %016llx %.6f\n", n->i, n->cmd->status, script_hash,
+          seconds);
+  fflush(journal);
+}
+
+// Wall time of each tree in the journal FILE, or -1 where unknown.
+// NULL if FILE cannot be read.
+static double* loadDurations(command_graph_t cg, char const* file)
+{
+  FILE* f = fopen(file, "r");
+  if (f == NULL) {
+    error(0, errno, "%s: cannot open journal", file);
+    return NULL;
+  }
+  double* durations = checked_malloc(cg->size * sizeof(double));
+  int i = 0;
+  for (; i < cg->size; i++)
+    durations[i] = -1;
+  int index, status;
+  unsigned long long hash;
+  double seconds;
+  while (readJournalLine(f, &index, &status, &hash, &seconds)) {
+    if (hash == script_hash && index >= 0 && index < cg->size && seconds >= 0)
+      durations[index] = seconds;
+  }
+  fclose(f);
+  return durations;
+}
+
+static __thread bool* queued;
+static __thread graph_node_t* readyQueue; // Ready nodes waiting for a free slot, in program order
+static __thread int readySize;
+
+static bool isReady(graph_node_t n)
+{
+  if (finished[n->i] || pids[n->i] != 0 || queued[n->i])
+    return false;
+  int i = 0;
+  for (; i < n->depSize; i++) {
+    if (!finished[n->dependencies[i]->i])
+      return false;
+  }
+  // Nor may a piped scratch file's writer, until its reader could
+  if (n->temp && n->temp->piped && n->temp->writer == n)
+    return isReady(n->temp->reader);
+  return true;
+}
+
+// Tracing
+// -------------------------------------------------------------------
+// With --trace every node gets the lowest numbered slot free when it
+// starts, so the timeline shows one track per job slot.  Children
+// stamp the time they start running into execTime, which is shared.
+
+static __thread double* spawnTime;
+static __thread double* execTime;
+static __thread double* exitTime;
+static __thread int* nodeSlot;
+static __thread int* gatedBy;    // The dependency whose exit made the node ready, or -1
+static __thread int gatingNode;  // The node just reaped, while its dependents are queued
+static __thread bool* slotBusy;
+static __thread int numSlots;    // Slots named in the trace so far
+
+static void startTrace(command_graph_t cg)
+{
+  spawnTime = checked_malloc(cg->size * sizeof(double));
+  exitTime = checked_malloc(cg->size * sizeof(double));
+  nodeSlot = checked_malloc(cg->size * sizeof(int));
+  gatedBy = checked_malloc(cg->size * sizeof(int));
+  slotBusy = checked_malloc((cg->size + 1) * sizeof(bool));
+  execTime = mmap(NULL, (cg->size + 1) * sizeof(double), PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (execTime == MAP_FAILED)
+    error(1, errno, "mmap");
+  int i = 0;
+  for (; i < cg->size; i++)
+    gatedBy[i] = -1;
+  for (i = 0; i <= cg->size; i++)
+    slotBusy[i] = false;
+  gatingNode = -1;
+  numSlots = 0;
+}
+
+static void stopTrace(command_graph_t cg)
+{
+  munmap(execTime, (cg->size + 1) * sizeof(double));
+  free(spawnTime);
+  free(exitTime);
+  free(nodeSlot);
+  free(gatedBy);
+  free(slotBusy);
+}
+
+static int takeSlot(void)
+{
+  int slot = 1;
+  while (slotBusy[slot])
+    slot++;
+  slotBusy[slot] = true;
+  if (slot > numSlots)
+    trace_slot_name(numSlots = slot);
+  return slot;
+}
+
+// First word run by C, to name its slice
+static char* firstWord(command_t c)
+{
+  while (c->type != SIMPLE_COMMAND) {
+    if (c->type == SUBSHELL_COMMAND)
+      c = c->u.subshell_command;
+    else
+      c = c->u.command[0];
+  }
+  return c->u.word[0];
+}
+
+static void traceReaped(graph_node_t n)
+{
+  int i = n->i;
+  exitTime[i] = trace_now();
+  char name[64];
+  snprintf(name, sizeof name, "tree %d: %s", i, firstWord(n->cmd));
+  char args[64];
+  snprintf(args, sizeof args, "\"dependencies\":%d", n->depSize);
+  trace_node(i, name, nodeSlot[i], spawnTime[i], execTime[i], exitTime[i],
+             n->cmd->status, args);
+  int from = gatedBy[i];
+  if (from >= 0)
+    trace_flow(from, nodeSlot[from], exitTime[from], i, nodeSlot[i], spawnTime[i]);
+  slotBusy[nodeSlot[i]] = false;
+}
+
+// Output Order
+// -------------------------------------------------------------------
+// With --keep-order every node's stdout and stderr go to memory files,
+// and the scheduler copies them to its own in script order: a node's
+// output as soon as that of every earlier node has been copied.  Nodes
+// that finish early hold their output until then.  Once that held
+// output passes keep_order_limit bytes, or too many nodes hold
+// captures, only the node whose output is due next may start, so the
+// rest wait for the backlog to drain instead of adding to it.
+
+__thread bool keep_order = false;
+__thread size_t keep_order_limit = 64 << 20;
+
+#define MAX_CAPTURES 256  // Nodes holding captures, two descriptors each
+
+static __thread int* outFd;
+static __thread int* errFd;
+static __thread int nextOutput;    // First node whose output has not been copied out
+static __thread size_t heldBytes;  // Captured by finished nodes still waiting their turn
+static __thread int numCaptures;
+
+static void startKeepOrder(command_graph_t cg)
+{
+  outFd = checked_malloc(cg->size * sizeof(int));
+  errFd = checked_malloc(cg->size * sizeof(int));
+  int i = 0;
+  for (; i < cg->size; i++)
+    outFd[i] = errFd[i] = -1;
+  nextOutput = 0;
+  heldBytes = 0;
+  numCaptures = 0;
+}
+
+// Called before forking N
+static void captureOutput(graph_node_t n)
+{
+  outFd[n->i] = memfd_create("stdout", MFD_CLOEXEC);
+  errFd[n->i] = memfd_create("stderr", MFD_CLOEXEC);
+  if (outFd[n->i] < 0 || errFd[n->i] < 0)
+    error(1, errno, "memfd_create");
+  numCaptures++;
+}
+
+static size_t captureSize(int fd)
+{
+  struct stat st;
+  if (fstat(fd, &st) != 0)
+    error(1, errno, "fstat");
+  return st.st_size;
+}
+
+static bool writeAll(int fd, char const* p, size_t n)
+{
+  while (n > 0) {
+    ssize_t w = write(fd, p, n);
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w < 0)
+      return false;
+    p += w;
+    n -= w;
+  }
+  return true;
+}
+
+// Copies the capture FD to TO and closes it.  The node's writes moved
+// the shared offset, so it is read from the start with pread.
+static void copyCapture(int fd, int to)
+{
+  char buf[1 << 16];
+  off_t off = 0;
+  ssize_t n;
+  while ((n = pread(fd, buf, sizeof buf, off)) > 0) {
+    off += n;
+    if (!writeAll(to, buf, n))
+      error(1, errno, "write");
+  }
+  close(fd);
+}
+
+// Copies out, in order, the output of every finished node that is due
+static void flushOutputs(void)
+{
+  while (nextOutput < numNodes && finished[nextOutput]) {
+    int i = nextOutput++;
+    if (outFd[i] < 0)
+      continue;  // Finished in an earlier run
+    heldBytes -= captureSize(outFd[i]) + captureSize(errFd[i]);
+    copyCapture(outFd[i], STDOUT_FILENO);
+    copyCapture(errFd[i], STDERR_FILENO);
+    outFd[i] = errFd[i] = -1;
+    numCaptures--;
+  }
+}
+
+// Called once node I has been reaped
+static void outputDone(int i)
+{
+  heldBytes += captureSize(outFd[i]) + captureSize(errFd[i]);
+  flushOutputs();
+}
+
+static bool mayLaunch(graph_node_t n)
+{
+  return !keep_order || n->i == nextOutput
+    || (heldBytes <= keep_order_limit && numCaptures < MAX_CAPTURES);
+}
+
+// Moves the node whose output is due next to position FROM of the
+// ready queue, if it is queued
+static bool pickNextOutput(int from)
+{
+  int r = from;
+  for (; r < readySize; r++) {
+    if (readyQueue[r]->i == nextOutput) {
+      graph_node_t n = readyQueue[r];
+      readyQueue[r] = readyQueue[from];
+      readyQueue[from] = n;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Scratch Files
+// -------------------------------------------------------------------
+// The pipe or memfd of a scratch file is opened just before its writer
+// is forked, and every other child closes the scheduler's ends, so the
+// reader sees end of file as soon as the writer is done.  A reader of
+// a pipe that exits early leaves a child draining it, so the writer
+// neither blocks nor dies of SIGPIPE.  With keep_temps the file is
+// written too: by a child copying the pipe into both the reader and the
+// file, or from the memfd once the writer is done.
+
+__thread bool pipe_temps = false;
+__thread bool keep_temps = false;
+
+// In a child of the scheduler: closes the ends of every scratch file
+// but the one N uses
+static void closeTemps(graph_node_t n)
+{
+  int i = 0;
+  for (; i < comg->numTemps; i++) {
+    struct temp_file* f = &comg->temps[i];
+    int end = 0;
+    for (; end < 2; end++) {
+      graph_node_t user = end ? f->writer : f->reader;
+      if (f->fd[end] >= 0 && user != n)
+        close(f->fd[end]);
+    }
+  }
+}
+
+static void closeEnd(struct temp_file* f, int end)
+{
+  close(f->fd[end]);
+  f->fd[end] = -1;
+}
+
+// Set when a scratch file could not be kept.  Its readers still get
+// it, but the run fails.
+static __thread bool keepFailed;
+
+// Opens the file --keep-temps writes F to, or returns -1 if it cannot
+static int openKept(struct temp_file* f)
+{
+  int fd = open(f->name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (fd < 0) {
+    error(0, errno, "%s: cannot keep scratch file", f->name);
+    keepFailed = true;
+  }
+  return fd;
+}
+
+// Forks a child that copies FROM to TO and, unless it is -1, to FILE
+// until FROM is at end of file.  Once TO has no reader left the rest
+// goes to FILE alone.  Returns its pid; the caller closes the three.
+static int startCopier(int from, int to, int file)
+{
+  STAT_INC(STAT_FORKS);
+  int pid = fork();
+  if (pid < 0)
+    error(1, errno, "fork");
+  if (pid > 0)
+    return pid;
+  closeTemps(NULL);
+  signal(SIGPIPE, SIG_IGN);
+  char buf[1 << 16];
+  ssize_t n;
+  while ((n = read(from, buf, sizeof buf)) != 0) {
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      _exit(1);
+    if (to >= 0 && !writeAll(to, buf, n))
+      to = -1;
+    if (file >= 0 && !writeAll(file, buf, n)) {
+      error(0, errno, "write");
+      _exit(1);
+    }
+  }
+  _exit(0);
+}
+
+// Called before forking N: opens the scratch file N writes
+static void openTemp(graph_node_t n)
+{
+  struct temp_file* f = n->temp;
+  if (f == NULL || f->writer != n)
+    return;
+  if (!f->piped) {
+    f->fd[0] = memfd_create("scratch", MFD_CLOEXEC);
+    if (f->fd[0] < 0)
+      error(1, errno, "memfd_create");
+    f->fd[1] = fcntl(f->fd[0], F_DUPFD_CLOEXEC, 0);
+  }
+  else if (!keep_temps) {
+    if (pipe2(f->fd, O_CLOEXEC) != 0)
+      error(1, errno, "pipe");
+    STAT_INC(STAT_PIPES);
+  }
+  else {
+    int in[2], out[2];
+    if (pipe2(in, O_CLOEXEC) != 0 || pipe2(out, O_CLOEXEC) != 0)
+      error(1, errno, "pipe");
+    STAT_ADD(STAT_PIPES, 2);
+    int file = openKept(f);
+    f->fd[0] = out[0];
+    f->fd[1] = in[1];
+    f->helper = startCopier(in[0], out[1], file);
+    close(in[0]);
+    close(out[1]);
+    if (file >= 0)
+      close(file);
+  }
+  int end = 0;
+  for (; end < 2; end++)
+    snprintf(f->path[end], sizeof f->path[end], "/dev/fd/%d", f->fd[end]);
+}
+
+// In N's child: closes the ends N does not use and points N's
+// redirection at its own
+static void useTemp(graph_node_t n)
+{
+  closeTemps(n);
+  struct temp_file* f = n->temp;
+  if (f != NULL) {
+    bool writes = f->writer == n;
+    redirectFile(n->cmd, f->name, f->path[writes], writes);
+  }
+}
+
+// Called once N has been forked
+static void tempLaunched(graph_node_t n)
+{
+  struct temp_file* f = n->temp;
+  if (f == NULL)
+    return;
+  if (f->writer == n)
+    closeEnd(f, 1);
+  else if (!f->piped || keep_temps)
+    closeEnd(f, 0);
+}
+
+// Called once N has been reaped
+static void tempDone(graph_node_t n)
+{
+  struct temp_file* f = n->temp;
+  if (f == NULL)
+    return;
+  if (!f->piped) {
+    if (f->writer == n && keep_temps) {
+      int file = openKept(f);
+      if (file >= 0) {
+        copyCapture(fcntl(f->fd[0], F_DUPFD_CLOEXEC, 0), file);
+        close(file);
+      }
+    }
+  }
+  else if (!keep_temps) {
+    if (f->reader == n) {
+      int from = f->fd[0];
+      f->fd[0] = -1;
+      if (pids[f->writer->i] != 0)
+        f->helper = startCopier(from, -1, -1);
+      close(from);
+    }
+  }
+  else if (finished[f->writer->i] && finished[f->reader->i]) {
+    waitpid(f->helper, NULL, 0);  // Until the file is complete
+    f->helper = 0;
+  }
+}
+
+// Reaps the children left draining pipes, whose writers are all done
+// by the end of the run
+static void reapCopiers(command_graph_t cg)
+{
+  int i = 0;
+  for (; i < cg->numTemps; i++) {
+    if (cg->temps[i].helper > 0)
+      waitpid(cg->temps[i].helper, NULL, 0);
+    cg->temps[i].helper = 0;
+  }
+}
+
+// Whether N is one end of a pipe whose other end is still running.
+// The two take one job slot between them, like a pipeline.
+static bool sharesJob(graph_node_t n)
+{
+  struct temp_file* f = n->temp;
+  if (f == NULL || !f->piped)
+    return false;
+  graph_node_t other = f->writer == n ? f->reader : f->writer;
+  return pids[other->i] != 0;
+}
+
+// CPU Placement
+// -------------------------------------------------------------------
+// With --placement a node is placed as it launches, near its producer:
+// the dependency whose exit made it ready if it reads that one's
+// output, and otherwise its last dependency it reads from.  The reader
+// of a piped scratch file goes with its writer, like the stages of a
+// pipeline.
+
+static __thread int* producer;  // Of each queued node, -1 if none
+
+static int findProducer(graph_node_t n)
+{
+  if (gatingNode >= 0 && isMatch(n->read_list, comg->nodes[gatingNode]->write_list))
+    return gatingNode;
+  int i = n->depSize - 1;
+  for (; i >= 0; i--) {
+    if (isMatch(n->read_list, n->dependencies[i]->write_list))
+      return n->dependencies[i]->i;
+  }
+  return -1;
+}
+
+static void placeNode(graph_node_t n)
+{
+  struct temp_file* f = n->temp;
+  bool together = f && f->piped && f->reader == n;
+  int near = together ? f->writer->i : producer[n->i];
+  char const* reason;
+  int d = place_node(n->i, near, together, &reason);
+  if (tracing()) {
+    char args[128];
+    snprintf(args, sizeof args, "\"cpus\":\"%s\",\"near\":%d,\"reason\":\"%s\"",
+             domain_cpus(d), near, reason);
+    trace_instant_args("place", n->i, args);
+  }
+}
+
+// Starts node N in a child process, or on a worker if there are any.
+// Returns false if no worker had room for it.
+static bool launch_node(graph_node_t n)
+{
+  launchedAt[n->i] = monotonicSeconds();
+  if (worker_pool_active()) {
+    if (!pool_submit(n->i, n->cmd, n->read_list, n->write_list))
+      return false;
+    pids[n->i] = -1;
+  }
+  else {
+    if (placement)
+      placeNode(n);
+    if (tracing()) {
+      fflush(NULL); // Or the child's exit writes the trace buffer again
+      spawnTime[n->i] = execTime[n->i] = trace_now();
+    }
+    if (keep_order)
+      captureOutput(n);
+    openTemp(n);
+    STAT_INC(STAT_FORKS);
+    int pid = fork();
+    if (pid < 0)
+      error(1, errno, "fork");
+    if (pid == 0) {
+      if (tracing())
+        execTime[n->i] = trace_now();
+      if (keep_order) {
+        dup2(outFd[n->i], STDOUT_FILENO);
+        dup2(errFd[n->i], STDERR_FILENO);
+      }
+      if (placement)
+        pin_node(n->i);
+      useTemp(n);
+      execute_tail(n->cmd, false);
+    }
+    pids[n->i] = pid;
+    watchNode(n->i);
+    tempLaunched(n);
+  }
+  if (tracing()) {
+    if (worker_pool_active())
+      spawnTime[n->i] = execTime[n->i] = trace_now();
+    nodeSlot[n->i] = takeSlot();
+    trace_instant("launch", n->i);
+  }
+  // The reader of a piped scratch file starts with its writer
+  if (n->temp && n->temp->piped && n->temp->writer == n)
+    return launch_node(n->temp->reader);
+  return true;
+}
+
+// Reaping
+// -------------------------------------------------------------------
+// The scheduler waits for the nodes it forked through their pidfds,
+// never with wait4(-1), which would also reap the children of other
+// threads and of the program embedding us.  Once a pidfd is readable
+// wait4 on that pid collects the status and usage without blocking.
+
+static __thread int* pidFds;  // Of each forked node still running
+static __thread int* forked;  // Those nodes
+static __thread int numForked;
+static __thread struct pollfd* pollFds;
+
+static void startReaping(int size)
+{
+  pidFds = checked_malloc(size * sizeof(int));
+  forked = checked_malloc(size * sizeof(int));
+  pollFds = checked_malloc(size * sizeof(struct pollfd));
+  numForked = 0;
+}
+
+static void stopReaping(void)
+{
+  free(pidFds);
+  free(forked);
+  free(pollFds);
+}
+
+// Called once node I has been forked
+static void watchNode(int i)
+{
+  pidFds[i] = pidfd_open(pids[i], 0);
+  if (pidFds[i] < 0)
+    error(1, errno, "pidfd_open");
+  forked[numForked++] = i;
+}
+
+// Waits for a forked node to exit and returns its index
+static int reapForked(int* exitStatus, struct rusage* ru)
+{
+  for (;;) {
+    int k = 0;
+    for (; k < numForked; k++) {
+      pollFds[k].fd = pidFds[forked[k]];
+      pollFds[k].events = POLLIN;
+      pollFds[k].revents = 0;
+    }
+    if (poll(pollFds, numForked, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      error(1, errno, "poll");
+    }
+    STAT_INC(STAT_WAKEUPS);
+    for (k = 0; k < numForked; k++) {
+      if (!pollFds[k].revents)
+        continue;
+      int i = forked[k];
+      int status;
+      int pid = wait4(pids[i], &status, WNOHANG, ru);
+      if (pid < 0)
+        error(1, errno, "wait4");
+      if (pid == 0)
+        continue;
+      STAT_INC(STAT_WAITS);
+      close(pidFds[i]);
+      forked[k] = forked[--numForked];
+      *exitStatus = WEXITSTATUS(status);
+      return i;
+    }
+  }
+}
+
+// Waits for any launched node to finish and returns its index.  A
+// status of POOL_LOST means the node has to be launched again, and
+// POOL_FAILED that nothing is left to launch it on.
+static int reap_node(int* exitStatus)
+{
+  struct rusage ru;
+  int nodeID;
+  if (worker_pool_active()) {
+    nodeID = pool_wait(exitStatus, &ru);
+    if (*exitStatus == POOL_LOST || *exitStatus == POOL_FAILED)
+      return nodeID;
+  }
+  else
+    nodeID = reapForked(exitStatus, &ru);
+  account_command(comg->nodes[nodeID]->cmd, &ru, launchedAt[nodeID]);
+  history_observe_kb(nodeID, ru.ru_maxrss);
+  return nodeID;
+}
+
+__thread int max_jobs = 0;
+static __thread int numRunning;
+
+__thread enum sched_policy sched_policy = POLICY_FIFO;
+static __thread double* priority = NULL;  // Of each node under sched_policy, if not fifo
+
+static bool canLaunch(void)
+{
+  if (max_jobs > 0 && numRunning >= max_jobs)
+    return false;
+  return !worker_pool_active() || pool_has_free_slot();
+}
+
+// Memory Admission
+// -------------------------------------------------------------------
+// With a memory budget a ready node only launches while its expected
+// peak, added to that of every node running, fits.  If the node next
+// in line does not fit, the next ready one that does goes first, so
+// small nodes pack in around a large one instead of all of them
+// overcommitting memory.  A node larger than the whole budget still
+// runs, alone.
+
+static __thread long long* expectedKb;  // Of each node
+static __thread long long memoryInUse;  // Expected of the nodes running
+
+// For the writer of a piped scratch file, with the reader that starts
+// with it
+static long long memoryNeeded(graph_node_t n)
+{
+  long long kb = expectedKb[n->i];
+  if (n->temp && n->temp->piped && n->temp->writer == n)
+    kb += expectedKb[n->temp->reader->i];
+  return kb;
+}
+
+static bool fitsMemory(graph_node_t n)
+{
+  return numRunning == 0 || memoryInUse + memoryNeeded(n) <= memory_budget_kb;
+}
+
+// Moves a queued node that fits and may launch to position FROM, the
+// one with the highest priority if there is a policy.  Returns false if
+// there is none.
+static bool pickFitting(int from)
+{
+  int best = -1;
+  int r = from;
+  for (; r < readySize; r++) {
+    graph_node_t n = readyQueue[r];
+    if (!fitsMemory(n) || !mayLaunch(n))
+      continue;
+    if (best < 0 || (priority && priority[n->i] > priority[readyQueue[best]->i]))
+      best = r;
+    if (!priority)
+      break;
+  }
+  if (best < 0)
+    return false;
+  graph_node_t n = readyQueue[best];
+  readyQueue[best] = readyQueue[from];
+  readyQueue[from] = n;
+  return true;
+}
+
+static void traceMemory(void)
+{
+  if (tracing())
+    trace_counter("memory_mb", memoryInUse >> 10);
+}
+
+// Job Server
+// -------------------------------------------------------------------
+// A pipe holding one byte per job slot, shared by every process forked
+// after start_jobserver, like make's jobserver.  A node may only run
+// while its scheduler holds a byte.
+
+static __thread int jobserver[2] = { -1, -1 };
+
+void start_jobserver(int tokens)
+{
+  if (pipe2(jobserver, O_CLOEXEC) != 0)
+    error(1, errno, "pipe");
+  fcntl(jobserver[0], F_SETFL, O_NONBLOCK);
+  while (tokens-- > 0)
+    if (write(jobserver[1], "+", 1) != 1)
+      error(1, errno, "jobserver");
+}
+
+// Takes a slot, waiting for one only if WAIT is set
+bool acquireJobToken(bool wait)
+{
+  if (jobserver[0] < 0)
+    return true;
+  for (;;) {
+    char token;
+    if (read(jobserver[0], &token, 1) == 1)
+      return true;
+    if (errno != EAGAIN && errno != EINTR)
+      error(1, errno, "jobserver");
+    if (!wait)
+      return false;
+    struct pollfd pfd;
+    pfd.fd = jobserver[0];
+    pfd.events = POLLIN;
+    poll(&pfd, 1, -1);
+    STAT_INC(STAT_WAKEUPS);
+  }
+}
+
+void releaseJobToken(void)
+{
+  if (jobserver[0] >= 0 && write(jobserver[1], "+", 1) != 1)
+    error(1, errno, "jobserver");
+}
+
+static void enqueueReady(graph_node_t n)
+{
+  queued[n->i] = true;
+  readyQueue[readySize++] = n;
+  if (placement)
+    producer[n->i] = findProducer(n);
+  if (tracing()) {
+    if (gatingNode >= 0)
+      gatedBy[n->i] = gatingNode;
+    trace_instant("ready", n->i);
+  }
+}
+
+// With a policy other than fifo, moves the queued node with the
+// highest priority to position FROM
+static void pickNext(int from)
+{
+  int best = from;
+  int r = from + 1;
+  for (; r < readySize; r++) {
+    if (priority[readyQueue[r]->i] > priority[readyQueue[best]->i])
+      best = r;
+  }
+  graph_node_t n = readyQueue[best];
+  readyQueue[best] = readyQueue[from];
+  readyQueue[from] = n;
+}
+
+// Launches queued nodes, oldest first or in policy order, while there
+// is room
+static void launchReady(void)
+{
+  int launched = 0;
+  while (launched < readySize && canLaunch()) {
+    // With nothing of ours running there is nothing else to wait for
+    if (!acquireJobToken(numRunning == 0))
+      break;
+    if (priority)
+      pickNext(launched);
+    if (!mayLaunch(readyQueue[launched]) && !pickNextOutput(launched)) {
+      releaseJobToken();
+      break;
+    }
+    if (memory_budget_kb && !fitsMemory(readyQueue[launched]) && !pickFitting(launched)) {
+      releaseJobToken();
+      trace_instant("hold", readyQueue[launched]->i);
+      break;
+    }
+    if (!launch_node(readyQueue[launched])) {
+      releaseJobToken();
+      break;
+    }
+    if (memory_budget_kb) {
+      memoryInUse += memoryNeeded(readyQueue[launched]);
+      traceMemory();
+    }
+    queued[readyQueue[launched]->i] = false;
+    numRunning++;
+    launched++;
+  }
+  readySize -= launched;
+  memmove(readyQueue, readyQueue + launched, readySize * sizeof(graph_node_t));
+  if (tracing() && launched) {
+    trace_counter("running", numRunning);
+    trace_counter("ready", readySize);
+  }
+}
+
+// Queues every node in NODES whose dependencies have all finished and
+// that is not already queued or running, then launches what fits.
+// Returns the number queued.
+static int execute_nodes(graph_node_t* nodes, int size)
+{
+  int numQueued = 0;
+  int i = 0;
+  for (; i < size; i++) {
+    graph_node_t n = nodes[i];
+    if (n->temp && n->temp->piped && n->temp->reader == n)
+      n = n->temp->writer;  // Queued in its place
+    if (!isReady(n))
+      continue;
+
+    numQueued++;
+    enqueueReady(n);
+  }
+  launchReady();
+  return numQueued;
+}
+
+int graph_node_status(command_graph_t cg, int index)
+{
+  return command_status(cg->nodes[index]->cmd);
+}
+
+bool execute_commands(command_graph_t cg)
+{
+  comg = cg;
+  numNodes = cg->size;
+  finished = checked_malloc(cg->size * sizeof(bool));
+  pids = checked_malloc(cg->size * sizeof(int));
+  queued = checked_malloc(cg->size * sizeof(bool));
+  readyQueue = checked_malloc(cg->size * sizeof(graph_node_t));
+  launchedAt = checked_malloc(cg->size * sizeof(double));
+  startReaping(cg->size);
+  readySize = 0;
+  numRunning = 0;
+  int i = 0;
+  for (; i < cg->size; i++) {
+    finished[i] = false;
+    pids[i] = 0;
+    queued[i] = false;
+    accounting_add_tree(i, cg->nodes[i]->cmd);
+  }
+
+  if (tracing())
+    startTrace(cg);
+  if (sched_policy != POLICY_FIFO)
+    priority = nodePriorities(cg);
+  if (keep_order)
+    startKeepOrder(cg);
+  if (placement) {
+    start_placement(cg->size);
+    producer = checked_malloc(cg->size * sizeof(int));
+  }
+  if (memory_budget_kb) {
+    expectedKb = checked_malloc(cg->size * sizeof(long long));
+    for (i = 0; i < cg->size; i++)
+      expectedKb[i] = expected_peak_kb(i);
+    memoryInUse = 0;
+  }
+
+  bool ok = true;
+  keepFailed = false;
+  int numFinished = 0;
+  if (journal_file) {
+    if (resume_run)
+      numFinished = loadJournal(cg);
+    if (numFinished >= 0)
+      journal = fopen(journal_file, resume_run ? "a" : "w");
+    if (journal == NULL) {
+      if (numFinished >= 0)
+        error(0, errno, "%s: cannot open journal", journal_file);
+      ok = false;
+    }
+    else
+      retireVersions(cg);
+  }
+  if (keep_order)
+    flushOutputs();
+
+  // Each node is queued exactly once: when it is first seen ready,
+  // either at the start or when its last dependency is reaped.
+  if (ok)
+    execute_nodes(cg->nodes, cg->size);
+  while (ok && numFinished < cg->size) {
+    int status;
+    int nodeID = reap_node(&status);
+    if (status == POOL_FAILED) {
+      ok = false;
+      break;
+    }
+    pids[nodeID] = 0;
+    if (!sharesJob(cg->nodes[nodeID])) {
+      numRunning--;
+      releaseJobToken();
+    }
+    if (memory_budget_kb) {
+      memoryInUse -= expectedKb[nodeID];
+      traceMemory();
+    }
+    if (status == POOL_LOST) {
+      if (tracing()) {
+        slotBusy[nodeSlot[nodeID]] = false;
+        trace_instant("lost", nodeID);
+      }
+      enqueueReady(cg->nodes[nodeID]);
+      launchReady();
+      continue;
+    }
+    finished[nodeID] = true;
+    numFinished++;
+    cg->nodes[nodeID]->cmd->status = status;
+    tempDone(cg->nodes[nodeID]);
+    if (placement)
+      unplace_node(nodeID);
+    if (tracing()) {
+      traceReaped(cg->nodes[nodeID]);
+      trace_instant("reap", nodeID);
+      trace_counter("running", numRunning);
+    }
+    if (keep_order)
+      outputDone(nodeID);
+    double seconds = monotonicSeconds() - launchedAt[nodeID];
+    journalNode(cg->nodes[nodeID], seconds);
+    history_observe(nodeID, seconds);
+    fillMissingVersions(cg, cg->nodes[nodeID]);
+    retireVersions(cg);
+    gatingNode = nodeID;
+    execute_nodes(cg->nodes[nodeID]->dependOnMe, cg->nodes[nodeID]->depMeSize);
+    gatingNode = -1;
+  }
+  retireVersions(cg);
+  reapCopiers(cg);
+  if (tracing())
+    stopTrace(cg);
+  if (journal) {
+    fclose(journal);
+    journal = NULL;
+  }
+  // Nothing survives the run, so the same process can run another graph
+  free(finished);
+  free(pids);
+  free(queued);
+  free(readyQueue);
+  free(launchedAt);
+  stopReaping();
+  free(priority);
+  priority = NULL;
+  if (keep_order) {
+    free(outFd);
+    free(errFd);
+  }
+  if (placement) {
+    stop_placement();
+    free(producer);
+  }
+  if (memory_budget_kb)
+    free(expectedKb);
+  return ok && !keepFailed;
+}
+
+/*void execute_commands(command_graph_t cg)
+{
+  bool* finished;
+  int* pids;
+  finished = malloc(cg->size * sizeof(bool));
+  pids = malloc(cg->size * sizeof(int));
+  int i = 0;
+
+  while (!isFinished(finished, cg->size)) {
+    i = 0;
+    while (i < cg->size) {
+      if (!finished[i]) {
+	if (pids[i] == 0) {
+	  if (cg->nodes[i]->dependencies[0] == NULL) {
+	    int pid = fork();
+	    pids[i] = pid;
+	    if (pid == 0) {
+	      execute_command(cg->nodes[i]->cmd, false);
+	      exit(0);
+	    }
+	    else {
+	      int status;
+	      if (waitpid(pid, &status, WNOHANG)) {
+		pids[i] = -1;
+		finished[i] = true;
+	      }
+	    }
+	  }
+	  else {
+	    int i2 = 0;
+	    for (; i2 < cg->nodes[i]->depSize; i2++) {
+	      int status;
+	      if (waitpid(pids[i], &status, WNOHANG)) {
+		pids[i] = -1;
+		finished[i] = true;
+	      }   
+	      }
+	  }
+	}
+	else {
+	  int status;
+	  if (waitpid(pids[i], &status, WNOHANG)) {
+	    pids[i] = -1;
+	    finished[i] = true;
+	  }
+	}
+      }
+      i++;
+    }
+  }
+  }*/
+
+static void createStagedCommands(command_graph_t cg)
+{
+  cg->staged_commands = malloc(50 * sizeof(graph_node_t*));
+  cg->stageSize = malloc(50 * sizeof(int));
+  cg->staged_commands[0][0] = cg->nodes[0];
+  cg->nodes[0]->stage = 1;
+  cg->stageSize[0]++;
+
+  int i = 1;
+  while (cg->nodes[i] != NULL) {
+    if (cg->nodes[i]->dependencies[0] == NULL){
+      cg->staged_commands[0][cg->stageSize[0]++] = cg->nodes[i];
+      cg->nodes[i]->stage = 1;
+    }
+    else {
+      int i2 = 0;
+      int maxStage = 0;
+      for (; cg->nodes[i]->dependencies[i2] != NULL; i2++) {
+	if (cg->nodes[i]->dependencies[i2]->stage > maxStage)
+	  maxStage = cg->nodes[i]->dependencies[i2]->stage;
+      }
+      cg->staged_commands[maxStage][cg->stageSize[maxStage]++] = cg->nodes[i];
+      cg->nodes[i]->stage = maxStage + 1;
+    }
+    i++;
+  }
+}
+
+static bool isMatch(char** a, char** b)
+{
+  int i = 0;
+  while (a[i] != NULL) {
+    int i2 = 0;
+    while (b[i2] != NULL) {
+      if (strcmp(a[i], b[i2]) == 0)
+	return true;
+      i2++;
+    }
+    i++;
+  }
+  return false;
+}
+
+static bool hasName(char** list, char* name)
+{
+  int i = 0;
+  for (; list[i] != NULL; i++) {
+    if (strcmp(list[i], name) == 0)
+      return true;
+  }
+  return false;
+}
+
+static struct renamed_file* findRenamed(command_graph_t cg, char* name)
+{
+  int i = 0;
+  for (; i < cg->numRenamed; i++) {
+    if (strcmp(cg->renamed[i].name, name) == 0)
+      return &cg->renamed[i];
+  }
+  return NULL;
+}
+
+// Same as isMatch, but ignores renamed files: those only need the RAW
+// edges added from their version lists.
+static bool isMatchUnrenamed(command_graph_t cg, char** a, char** b)
+{
+  int i = 0;
+  while (a[i] != NULL) {
+    if (findRenamed(cg, a[i]) == NULL && hasName(b, a[i]))
+      return true;
+    i++;
+  }
+  return false;
+}
+
+static bool isAlreadyContained(graph_node_t* nodes, int size, graph_node_t n)
+{
+  int i = 0;
+  for (; i < size; i++) {
+    if (nodes[i] == n)
+      return true;
+  }
+  return false;
+}
+
+// Makes room for one more element in an array that currently holds SIZE
+// elements.  Capacity doubles whenever SIZE reaches a power of two.
+static void* growArray(void* arr, int size, size_t elemSize)
+{
+  if (size == 0)
+    return checked_malloc(elemSize);
+  if ((size & (size - 1)) == 0)
+    return checked_realloc(arr, 2 * size * elemSize);
+  return arr;
+}
+
+static void addDependency(graph_node_t n, graph_node_t dep)
+{
+  if (!isAlreadyContained(n->dependencies, n->depSize, dep)) {
+    n->dependencies = growArray(n->dependencies, n->depSize, sizeof(graph_node_t));
+    n->dependencies[n->depSize++] = dep;
+    STAT_INC(STAT_GRAPH_EDGES);
+  }
+  if (!isAlreadyContained(dep->dependOnMe, dep->depMeSize, n)) {
+    dep->dependOnMe = growArray(dep->dependOnMe, dep->depMeSize, sizeof(graph_node_t));
+    dep->dependOnMe[dep->depMeSize++] = n;
+  }
+}
+
+void createDependencies(command_graph_t cg)
+{
+  int i = 0;
+  int i2;
+  while (cg->nodes[i] != NULL) {
+    i2 = 0;
+    while (i2 != i) {
+      //RAW || WAR || WAW
+      if (isMatchUnrenamed(cg, cg->nodes[i]->read_list, cg->nodes[i2]->write_list) ||
+	  isMatchUnrenamed(cg, cg->nodes[i]->write_list, cg->nodes[i2]->read_list) ||
+	  isMatchUnrenamed(cg, cg->nodes[i]->write_list, cg->nodes[i2]->write_list))
+	addDependency(cg->nodes[i], cg->nodes[i2]);
+      i2++;
+    }
+    i++;
+  }
+
+  //RAW edges for renamed files: each reader waits for the writer of its version
+  for (i = 0; i < cg->numRenamed; i++) {
+    struct renamed_file* f = &cg->renamed[i];
+    int v = 0;
+    for (; v < f->numVersions; v++) {
+      int r = 0;
+      for (; r < f->versions[v].numReaders; r++)
+	addDependency(f->versions[v].readers[r], f->versions[v].writer);
+    }
+  }
+}
+
+// Windowed Execution
+// ===================================================================
+// With --window=N, -t holds at most N trees, running or waiting, and
+// parses the next tree only once one of them has finished.  Instead of
+// comparing every pair of trees, each file remembers what last used it:
+// a new tree waits for the last writer of every file it reads or
+// writes, and for the readers since then of every file it writes, if
+// they are still in the window.  That orders the trees just as the
+// full graph does.  A finished tree is freed with its node, and files
+// no tree in the window uses any more are dropped, so memory follows
+// the window and not the length of the script.
+
+struct window_ref {
+  int slot;           // Of the node in the window
+  unsigned long seq;  // Of the tree, to tell apart the slot's occupants
+};
+
+struct file_frontier {
+  char* name;
+  bool written;
+  struct window_ref writer;    // Last tree to write the file
+  struct window_ref* readers; // Trees that read it since
+  int numReaders;
+  int cap;
+};
+
+static __thread unsigned long* slotSeq;
+static __thread bool* slotLive;
+static __thread int* slotScript;  // Script each slot's tree came from
+static __thread struct file_frontier** frontier;
+static __thread int frontierSize;  // A power of two
+static __thread int frontierUsed;
+
+static bool refLive(struct window_ref r)
+{
+  return slotLive[r.slot] && slotSeq[r.slot] == r.seq;
+}
+
+static bool frontierLive(struct file_frontier* f)
+{
+  if (f->written && refLive(f->writer))
+    return true;
+  int i = 0;
+  for (; i < f->numReaders; i++) {
+    if (refLive(f->readers[i]))
+      return true;
+  }
+  return false;
+}
+
+static struct file_frontier** frontierSlot(char const* name)
+{
+  int i = hashName(name) & (frontierSize - 1);
+  while (frontier[i] && strcmp(frontier[i]->name, name) != 0)
+    i = (i + 1) & (frontierSize - 1);
+  return &frontier[i];
+}
+
+// Drops files no tree in the window uses, and grows the table if it is
+// still more than half full
+static void sweepFrontier(void)
+{
+  struct file_frontier** old = frontier;
+  int oldSize = frontierSize;
+  int live = 0;
+  int i = 0;
+  for (; i < oldSize; i++)
+    live += old[i] && frontierLive(old[i]);
+  frontierSize = 16;
+  while (frontierSize < 4 * (live + 1))
+    frontierSize *= 2;
+  frontier = checked_malloc(frontierSize * sizeof(struct file_frontier*));
+  memset(frontier, 0, frontierSize * sizeof(struct file_frontier*));
+  frontierUsed = 0;
+  for (i = 0; i < oldSize; i++) {
+    if (old[i] == NULL)
+      continue;
+    if (frontierLive(old[i])) {
+      *frontierSlot(old[i]->name) = old[i];
+      frontierUsed++;
+    }
+    else {
+      free(old[i]->name);
+      free(old[i]->readers);
+      free(old[i]);
+    }
+  }
+  free(old);
+}
+
+static struct file_frontier* findFrontier(char const* name)
+{
+  struct file_frontier** f = frontierSlot(name);
+  if (*f)
+    return *f;
+  if (2 * (frontierUsed + 1) > frontierSize) {
+    sweepFrontier();
+    f = frontierSlot(name);
+  }
+  *f = checked_malloc(sizeof(struct file_frontier));
+  (*f)->name = strdup(name);
+  (*f)->written = false;
+  (*f)->readers = NULL;
+  (*f)->numReaders = 0;
+  (*f)->cap = 0;
+  frontierUsed++;
+  return *f;
+}
+
+// Makes N wait for the tree REF, if it is still in the window
+static void waitFor(graph_node_t n, struct window_ref ref)
+{
+  if (!refLive(ref) || ref.slot == n->i)
+    return;
+  graph_node_t dep = comg->nodes[ref.slot];
+  if (isAlreadyContained(dep->dependOnMe, dep->depMeSize, n))
+    return;
+  dep->dependOnMe = growArray(dep->dependOnMe, dep->depMeSize, sizeof(graph_node_t));
+  dep->dependOnMe[dep->depMeSize++] = n;
+  n->waiting++;
+  STAT_INC(STAT_GRAPH_EDGES);
+}
+
+static void addFrontierReader(struct file_frontier* f, struct window_ref ref)
+{
+  // Readers that have left the window no longer matter
+  int kept = 0;
+  int i = 0;
+  for (; i < f->numReaders; i++) {
+    if (refLive(f->readers[i]) && f->readers[i].slot != ref.slot)
+      f->readers[kept++] = f->readers[i];
+  }
+  f->numReaders = kept;
+  if (f->numReaders == f->cap) {
+    f->cap = f->cap ? 2 * f->cap : 4;
+    f->readers = checked_realloc(f->readers, f->cap * sizeof(struct window_ref));
+  }
+  f->readers[f->numReaders++] = ref;
+}
+
+// Takes tree C into free window slot SLOT and links it to the trees it
+// has to wait for
+static graph_node_t admitTree(command_t c, int slot, unsigned long seq)
+{
+  graph_node_t n = checked_malloc(sizeof(struct graph_node));
+  n->cmd = c;
+  n->dependencies = NULL;
+  n->depSize = 0;
+  n->dependOnMe = NULL;
+  n->depMeSize = 0;
+  n->waiting = 0;
+  n->read_list = createReadList(c);
+  n->write_list = createWriteList(c);
+  n->stage = 0;
+  n->temp = NULL;
+  n->i = slot;
+  comg->nodes[slot] = n;
+  slotSeq[slot] = seq;
+  slotLive[slot] = true;
+  STAT_INC(STAT_GRAPH_NODES);
+
+  struct window_ref self;
+  self.slot = slot;
+  self.seq = seq;
+  char** name;
+  for (name = n->read_list; *name; name++) {
+    struct file_frontier* f = findFrontier(*name);
+    if (f->written)
+      waitFor(n, f->writer);
+    addFrontierReader(f, self);
+  }
+  for (name = n->write_list; *name; name++) {
+    struct file_frontier* f = findFrontier(*name);
+    if (f->written)
+      waitFor(n, f->writer);
+    int i = 0;
+    for (; i < f->numReaders; i++)
+      waitFor(n, f->readers[i]);
+    f->written = true;
+    f->writer = self;
+    f->numReaders = 0;
+  }
+  return n;
+}
+
+static void releaseNode(graph_node_t n)
+{
+  slotLive[n->i] = false;
+  comg->nodes[n->i] = NULL;
+  free_command(n->cmd);
+  free(n->read_list);
+  free(n->write_list);
+  free(n->dependOnMe);
+  free(n);
+}
+
+bool execute_window(struct script* scripts, int numScripts, int window,
+                    int* scriptStatus)
+{
+  comg = checked_malloc(sizeof(struct command_graph));
+  comg->size = window;
+  comg->nodes = checked_malloc((window + 1) * sizeof(graph_node_t));
+  comg->renamed = NULL;
+  comg->numRenamed = 0;
+  comg->temps = NULL;
+  comg->numTemps = 0;
+  numNodes = window;
+  finished = checked_malloc(window * sizeof(bool));
+  pids = checked_malloc(window * sizeof(int));
+  queued = checked_malloc(window * sizeof(bool));
+  readyQueue = checked_malloc(window * sizeof(graph_node_t));
+  launchedAt = checked_malloc(window * sizeof(double));
+  startReaping(window);
+  slotSeq = checked_malloc(window * sizeof(unsigned long));
+  slotLive = checked_malloc(window * sizeof(bool));
+  slotScript = checked_malloc(window * sizeof(int));
+  int* freeSlots = checked_malloc(window * sizeof(int));
+  int numFree = window;
+  int i = 0;
+  for (; i < window; i++) {
+    comg->nodes[i] = NULL;
+    finished[i] = false;
+    pids[i] = 0;
+    queued[i] = false;
+    slotLive[i] = false;
+    freeSlots[i] = window - 1 - i;
+  }
+  comg->nodes[window] = NULL;
+  frontierSize = 16;
+  frontierUsed = 0;
+  frontier = checked_malloc(frontierSize * sizeof(struct file_frontier*));
+  memset(frontier, 0, frontierSize * sizeof(struct file_frontier*));
+  readySize = 0;
+  numRunning = 0;
+
+  // Latest tree of each script to finish, whose status is the script's
+  unsigned long* lastSeq = checked_malloc(numScripts * sizeof(unsigned long));
+  for (i = 0; i < numScripts; i++)
+    lastSeq[i] = 0;
+
+  // A script that cannot be read or has a syntax error stops the
+  // reading, and the trees already in the window finish
+  int failed = -1;
+  int script = 0;
+  struct tree_reader* reader = numScripts ? open_tree_reader(&scripts[0]) : NULL;
+  if (numScripts && reader == NULL)
+    failed = 0;
+  unsigned long seq = 0;
+  while (reader || numFree < window) {
+    // Fill the window
+    while (reader && numFree > 0) {
+      command_t c = read_tree(reader);
+      if (c == NULL) {
+        if (!close_tree_reader(reader)) {
+          failed = script;
+          reader = NULL;
+          break;
+        }
+        reader = ++script < numScripts ? open_tree_reader(&scripts[script]) : NULL;
+        if (script < numScripts && reader == NULL)
+          failed = script;
+        continue;
+      }
+      int slot = freeSlots[--numFree];
+      slotScript[slot] = script;
+      graph_node_t n = admitTree(c, slot, ++seq);
+      if (n->waiting == 0)
+        enqueueReady(n);
+    }
+    launchReady();
+    if (numFree == window)
+      continue;
+
+    int status;
+    int slot = reap_node(&status);
+    pids[slot] = 0;
+    numRunning--;
+    releaseJobToken();
+    if (status == POOL_LOST) {
+      enqueueReady(comg->nodes[slot]);
+      continue;
+    }
+    graph_node_t n = comg->nodes[slot];
+    n->cmd->status = status;
+    if (slotSeq[slot] > lastSeq[slotScript[slot]]) {
+      lastSeq[slotScript[slot]] = slotSeq[slot];
+      scriptStatus[slotScript[slot]] = status;
+    }
+    for (i = 0; i < n->depMeSize; i++) {
+      if (--n->dependOnMe[i]->waiting == 0)
+        enqueueReady(n->dependOnMe[i]);
+    }
+    releaseNode(n);
+    freeSlots[numFree++] = slot;
+  }
+  if (failed >= 0)
+    scriptStatus[failed] = 1;
+  free(lastSeq);
+  free(freeSlots);
+  int f = 0;
+  for (; f < frontierSize; f++) {
+    if (frontier[f]) {
+      free(frontier[f]->name);
+      free(frontier[f]->readers);
+      free(frontier[f]);
+    }
+  }
+  free(frontier);
+  free(slotSeq);
+  free(slotLive);
+  free(slotScript);
+  free(finished);
+  free(pids);
+  free(queued);
+  free(readyQueue);
+  free(launchedAt);
+  stopReaping();
+  free(comg->nodes);
+  free(comg);
+  comg = NULL;
+  return failed < 0;
+}
+
+// Graph Analysis
+// ===================================================================
+// Work is the total weight of the trees and span the weight of the
+// heaviest chain of dependencies, so work / span bounds the speedup of
+// -t with any number of jobs.  Dependencies always point to earlier
+// trees, so program order is a topological order.
+
+// Appends "KIND NAME" to LABEL for every name in A that conflicts with
+// one in B
+static int addConflicts(command_graph_t cg, char* label, size_t size, char const* kind,
+                        char** a, char** b, bool renamedToo)
+{
+  int count = 0;
+  int i = 0;
+  for (; a[i] != NULL; i++) {
+    if (!hasName(b, a[i]) || (!renamedToo && findRenamed(cg, a[i]) != NULL))
+      continue;
+    size_t len = strlen(label);
+    snprintf(label + len, size - len, "%s%s %s", len ? "\\n" : "", kind, a[i]);
+    count++;
+  }
+  return count;
+}
+
+// Why N waits for DEP: each conflicting file and whether N reads what
+// DEP writes (RAW), writes what it reads (WAR) or writes it too (WAW)
+static void edgeLabel(command_graph_t cg, graph_node_t n, graph_node_t dep,
+                      char* label, size_t size)
+{
+  label[0] = '\0';
+  addConflicts(cg, label, size, "RAW", n->read_list, dep->write_list, true);
+  addConflicts(cg, label, size, "WAR", n->write_list, dep->read_list, false);
+  addConflicts(cg, label, size, "WAW", n->write_list, dep->write_list, false);
+}
+
+// Returns false, with a message on stderr, if FILE cannot be written
+static bool writeDot(command_graph_t cg, char const* file, double* weight,
+                     bool* critical, graph_node_t* via)
+{
+  FILE* f = fopen(file, "w");
+  if (f == NULL) {
+    error(0, errno, "%s: cannot open", file);
+    return false;
+  }
+  fprintf(f, "digraph timetrash {\n  node [shape=box, fontname=monospace];\n");
+  int i = 0;
+  for (; i < cg->size; i++) {
+    char text[64];
+    command_text(cg->nodes[i]->cmd, text, sizeof text);
+    fprintf(f, "  n%d [label=\"%d: ", i, i);
+    char* p = text;
+    for (; *p; p++)
+      fprintf(f, *p == '"' || *p == '\\' ? "\\%c" : "%c", *p);
+    fprintf(f, "\\n%.3f\"%s];\n", weight[i], critical[i] ? ", color=red" : "");
+  }
+  for (i = 0; i < cg->size; i++) {
+    graph_node_t n = cg->nodes[i];
+    int d = 0;
+    for (; d < n->depSize; d++) {
+      char label[256];
+      edgeLabel(cg, n, n->dependencies[d], label, sizeof label);
+      bool hot = critical[i] && via[i] == n->dependencies[d];
+      fprintf(f, "  n%d -> n%d [label=\"%s\"%s];\n", n->dependencies[d]->i, i,
+              label, hot ? ", color=red" : "");
+    }
+  }
+  fprintf(f, "}\n");
+  if (fclose(f) != 0) {
+    error(0, errno, "%s: cannot write", file);
+    return false;
+  }
+  return true;
+}
+
+// Each tree's time from the journal DURATIONS_FILE, or else from the
+// runtime history, or one for every tree if there is neither.  Trees
+// with no recorded time weigh the mean of those with one.  Sets
+// *NUMKNOWN to the number with a recorded time.  NULL if the journal
+// cannot be read.
+static double* nodeWeights(command_graph_t cg, char const* durations_file, int* numKnown)
+{
+  double* weight = checked_malloc(cg->size * sizeof(double));
+  int i = 0;
+  double known = 0;
+  *numKnown = 0;
+  for (; i < cg->size; i++)
+    weight[i] = 1;
+  if (durations_file || history_loaded()) {
+    double* durations;
+    if (durations_file) {
+      durations = loadDurations(cg, durations_file);
+      if (durations == NULL) {
+        free(weight);
+        return NULL;
+      }
+    }
+    else {
+      durations = checked_malloc(cg->size * sizeof(double));
+      for (i = 0; i < cg->size; i++)
+        durations[i] = history_expected(i);
+    }
+    for (i = 0; i < cg->size; i++) {
+      if (durations[i] >= 0) {
+        known += durations[i];
+        (*numKnown)++;
+      }
+    }
+    for (i = 0; i < cg->size; i++)
+      weight[i] = durations[i] >= 0 ? durations[i] : *numKnown ? known / *numKnown : 1;
+    free(durations);
+  }
+  return weight;
+}
+
+bool analyze_graph(command_graph_t cg, char const* durations_file,
+                   char const* dot_file)
+{
+  int numKnown;
+  double* weight = nodeWeights(cg, durations_file, &numKnown);
+  if (weight == NULL)
+    return false;
+  double* finish = checked_malloc(cg->size * sizeof(double));
+  int* level = checked_malloc(cg->size * sizeof(int));
+  int* levelWidth = checked_malloc((cg->size + 1) * sizeof(int));
+  graph_node_t* via = checked_malloc(cg->size * sizeof(graph_node_t));
+  bool* critical = checked_malloc(cg->size * sizeof(bool));
+  int i;
+
+  int numEdges = 0;
+  double work = 0;
+  double span = 0;
+  int last = -1;
+  for (i = 0; i <= cg->size; i++)
+    levelWidth[i] = 0;
+  for (i = 0; i < cg->size; i++) {
+    graph_node_t n = cg->nodes[i];
+    double start = 0;
+    level[i] = 0;
+    via[i] = NULL;
+    critical[i] = false;
+    int d = 0;
+    for (; d < n->depSize; d++) {
+      int dep = n->dependencies[d]->i;
+      if (via[i] == NULL || finish[dep] > start) {
+        start = finish[dep];
+        via[i] = n->dependencies[d];
+      }
+      if (level[dep] + 1 > level[i])
+        level[i] = level[dep] + 1;
+    }
+    numEdges += n->depSize;
+    finish[i] = start + weight[i];
+    work += weight[i];
+    levelWidth[level[i]]++;
+    if (last < 0 || finish[i] > span) {
+      span = finish[i];
+      last = i;
+    }
+  }
+
+  int numLevels = 0;
+  int widest = 0;
+  for (i = 0; i < cg->size; i++) {
+    if (level[i] + 1 > numLevels)
+      numLevels = level[i] + 1;
+    if (levelWidth[level[i]] > levelWidth[widest])
+      widest = level[i];
+  }
+
+  printf("trees: %d\n", cg->size);
+  printf("dependencies: %d\n", numEdges);
+  printf("levels: %d, widest is level %d with %d trees\n",
+         numLevels, widest, cg->size ? levelWidth[widest] : 0);
+  char const* unit = durations_file || history_loaded() ? "s" : " trees";
+  printf("work: %.3f%s\n", work, unit);
+  printf("span: %.3f%s\n", span, unit);
+  printf("speedup bound: %.2f\n", span > 0 ? work / span : 1.0);
+  if (durations_file || history_loaded())
+    printf("recorded times: %d of %d trees\n", numKnown, cg->size);
+
+  // Walk the critical path back from its end
+  printf("critical path:\n");
+  graph_node_t* path = checked_malloc(cg->size * sizeof(graph_node_t));
+  int pathSize = 0;
+  graph_node_t n = last >= 0 ? cg->nodes[last] : NULL;
+  for (; n != NULL; n = via[n->i]) {
+    critical[n->i] = true;
+    path[pathSize++] = n;
+  }
+  while (pathSize-- > 0) {
+    n = path[pathSize];
+    char text[64];
+    command_text(n->cmd, text, sizeof text);
+    printf("  %5d %10.3f  %s\n", n->i, weight[n->i], text);
+    if (pathSize > 0) {
+      char label[256];
+      edgeLabel(cg, path[pathSize - 1], n, label, sizeof label);
+      char* p;
+      while ((p = strstr(label, "\\n")) != NULL) {
+        p[0] = ',';
+        memmove(p + 1, p + 2, strlen(p + 2) + 1);
+      }
+      printf("        waits on %s\n", label);
+    }
+  }
+  free(path);
+
+  bool ok = !dot_file || writeDot(cg, dot_file, weight, critical, via);
+
+  free(weight);
+  free(finish);
+  free(level);
+  free(levelWidth);
+  free(via);
+  free(critical);
+  return ok;
+}
+
+// Schedule Simulation
+// ===================================================================
+// Replays the -t scheduler over the graph with each tree taking its
+// weight in time and nothing forked.  Events are tree completions; at
+// each one the finished tree's dependents may become ready, and ready
+// trees are started, in policy order, while fewer than JOBS run.
+
+char const* const policy_names[] = { "fifo", "critical", "longest" };
+
+// Weight of the heaviest chain from each tree to the end of the script
+static double* bottomLevels(command_graph_t cg, double* weight)
+{
+  double* bottom = checked_malloc(cg->size * sizeof(double));
+  int i = cg->size - 1;
+  for (; i >= 0; i--) {
+    graph_node_t n = cg->nodes[i];
+    double longest = 0;
+    int d = 0;
+    for (; d < n->depMeSize; d++) {
+      if (bottom[n->dependOnMe[d]->i] > longest)
+        longest = bottom[n->dependOnMe[d]->i];
+    }
+    bottom[i] = weight[i] + longest;
+  }
+  return bottom;
+}
+
+// What the scheduler orders ready nodes by under sched_policy
+static double* nodePriorities(command_graph_t cg)
+{
+  int numKnown;
+  double* weight = nodeWeights(cg, NULL, &numKnown);
+  if (sched_policy == POLICY_LONGEST_FIRST)
+    return weight;
+  double* bottom = bottomLevels(cg, weight);
+  free(weight);
+  return bottom;
+}
+
+// Position in READY of the tree POLICY starts next
+static int pickReady(int* ready, int numReady, enum sched_policy policy,
+                     double* weight, double* bottom)
+{
+  int best = 0;
+  int r = 1;
+  for (; r < numReady && policy != POLICY_FIFO; r++) {
+    double* key = policy == POLICY_CRITICAL_PATH ? bottom : weight;
+    if (key[ready[r]] > key[ready[best]])
+      best = r;
+  }
+  return best;
+}
+
+static double simulateSchedule(command_graph_t cg, double* weight, double* bottom,
+                               int jobs, enum sched_policy policy)
+{
+  int* waitingOn = checked_malloc(cg->size * sizeof(int));
+  int* ready = checked_malloc(cg->size * sizeof(int));
+  int* running = checked_malloc(cg->size * sizeof(int));
+  double* endsAt = checked_malloc(cg->size * sizeof(double));
+  int numReady = 0;
+  int numRunning = 0;
+  int i = 0;
+  for (; i < cg->size; i++) {
+    waitingOn[i] = cg->nodes[i]->depSize;
+    if (waitingOn[i] == 0)
+      ready[numReady++] = i;
+  }
+
+  double now = 0;
+  for (;;) {
+    while (numReady > 0 && numRunning < jobs) {
+      int r = pickReady(ready, numReady, policy, weight, bottom);
+      int n = ready[r];
+      memmove(ready + r, ready + r + 1, (--numReady - r) * sizeof(int));
+      endsAt[n] = now + weight[n];
+      running[numRunning++] = n;
+    }
+    if (numRunning == 0)
+      break;
+
+    // Finish the first tree to end, oldest first on ties
+    int first = 0;
+    for (i = 1; i < numRunning; i++) {
+      if (endsAt[running[i]] < endsAt[running[first]])
+        first = i;
+    }
+    int done = running[first];
+    running[first] = running[--numRunning];
+    now = endsAt[done];
+    graph_node_t n = cg->nodes[done];
+    int d = 0;
+    for (; d < n->depMeSize; d++) {
+      if (--waitingOn[n->dependOnMe[d]->i] == 0)
+        ready[numReady++] = n->dependOnMe[d]->i;
+    }
+  }
+
+  free(waitingOn);
+  free(ready);
+  free(running);
+  free(endsAt);
+  return now;
+}
+
+bool simulate_graph(command_graph_t cg, char const* durations_file,
+                    int* jobs, int numJobs)
+{
+  int numKnown;
+  double* weight = nodeWeights(cg, durations_file, &numKnown);
+  if (weight == NULL)
+    return false;
+  double* bottom = bottomLevels(cg, weight);
+  double work = 0;
+  double span = 0;
+  int i = 0;
+  for (; i < cg->size; i++) {
+    work += weight[i];
+    if (cg->nodes[i]->depSize == 0 && bottom[i] > span)
+      span = bottom[i];
+  }
+
+  char const* unit = durations_file || history_loaded() ? "s" : " trees";
+  printf("trees: %d\n", cg->size);
+  if (durations_file || history_loaded())
+    printf("recorded times: %d of %d trees\n", numKnown, cg->size);
+  printf("work: %.3f%s\n", work, unit);
+  printf("span: %.3f%s\n", span, unit);
+  printf("%6s %-9s %12s %8s %11s\n", "jobs", "policy", "makespan", "speedup",
+         "utilization");
+  int j = 0;
+  for (; j < numJobs; j++) {
+    int p = 0;
+    for (; p < NUM_POLICIES; p++) {
+      double makespan = simulateSchedule(cg, weight, bottom, jobs[j], p);
+      printf("%6d %-9s %12.3f %8.2f %10.1f%%\n", jobs[j], policy_names[p], makespan,
+             makespan > 0 ? work / makespan : 1.0,
+             makespan > 0 ? 100 * work / (makespan * jobs[j]) : 100.0);
+    }
+  }
+  free(weight);
+  free(bottom);
+  return true;
+}
+
+// Output Renaming Implementation
+// ===================================================================
+
+static bool usesAsWord(command_t c, char* name)
+{
+  switch(c->type) {
+  case SIMPLE_COMMAND:
+    return hasName(c->u.word, name);
+  case SUBSHELL_COMMAND:
+    return usesAsWord(c->u.subshell_command, name);
+  default:
+    return usesAsWord(c->u.command[0], name) || usesAsWord(c->u.command[1], name);
+  }
+}
+
+// Whether C writes NAME in a command that only runs depending on the
+// status of another, on the right of && or ||.  CONDITIONAL is whether
+// C itself is such a command.
+static bool writesConditionally(command_t c, char* name, bool conditional)
+{
+  if (conditional && c->output != NULL && strcmp(c->output, name) == 0)
+    return true;
+  switch(c->type) {
+  case SIMPLE_COMMAND:
+    return false;
+  case SUBSHELL_COMMAND:
+    return writesConditionally(c->u.subshell_command, name, conditional);
+  case AND_COMMAND:
+  case OR_COMMAND:
+    return writesConditionally(c->u.command[0], name, conditional)
+      || writesConditionally(c->u.command[1], name, true);
+  default:
+    return writesConditionally(c->u.command[0], name, conditional)
+      || writesConditionally(c->u.command[1], name, conditional);
+  }
+}
+
+static void redirectFile(command_t c, char* name, char* temp, bool output)
+{
+  char** target = output ? &c->output : &c->input;
+  if (*target != NULL && strcmp(*target, name) == 0)
+    *target = temp;
+  switch(c->type) {
+  case SIMPLE_COMMAND:
+    break;
+  case SUBSHELL_COMMAND:
+    redirectFile(c->u.subshell_command, name, temp, output);
+    break;
+  default:
+    redirectFile(c->u.command[0], name, temp, output);
+    redirectFile(c->u.command[1], name, temp, output);
+    break;
+  }
+}
+
+// A file can only be renamed if every access to it is a redirection
+// (a word might be an argument the command opens itself, or not a file
+// at all), every write to it happens whenever its tree runs, and no
+// single tree both reads and writes it.
+static bool isRenameable(command_graph_t cg, char* name)
+{
+  int i = 0;
+  for (; i < cg->size; i++) {
+    graph_node_t n = cg->nodes[i];
+    if (usesAsWord(n->cmd, name) || writesConditionally(n->cmd, name, false))
+      return false;
+    if (hasName(n->read_list, name) && hasName(n->write_list, name))
+      return false;
+  }
+  return true;
+}
+
+// Private file for the version of NAME written by tree TREE, placed in
+// the same directory so the final rename is atomic.  The name depends
+// only on the script, so a resumed run finds the versions written
+// before the crash.
+static char* versionName(char* name, int tree)
+{
+  char* slash = strrchr(name, '/');
+  int dirLen = slash ? slash - name + 1 : 0;
+  char* temp = checked_malloc(strlen(name) + 64);
+  sprintf(temp, "%.*s.%s.tt%08llx.%d", dirLen, name, name + dirLen,
+	  script_hash & 0xffffffffULL, tree);
+  return temp;
+}
+
+void createOutputVersions(command_graph_t cg)
+{
+  int i, i2;
+  for (i = 0; i < cg->size; i++) {
+    char** wl = cg->nodes[i]->write_list;
+    for (i2 = 0; wl[i2] != NULL; i2++) {
+      if (findRenamed(cg, wl[i2]) != NULL || !isRenameable(cg, wl[i2]))
+	continue;
+      cg->renamed = growArray(cg->renamed, cg->numRenamed, sizeof(struct renamed_file));
+      struct renamed_file* f = &cg->renamed[cg->numRenamed++];
+      f->name = wl[i2];
+      f->versions = NULL;
+      f->numVersions = 0;
+      f->baseReaders = NULL;
+      f->numBaseReaders = 0;
+      f->retired = 0;
+    }
+  }
+
+  // Walk the trees in program order, handing out versions to writers
+  // and pointing readers at the latest one
+  for (i = 0; i < cg->size; i++) {
+    graph_node_t n = cg->nodes[i];
+    for (i2 = 0; i2 < cg->numRenamed; i2++) {
+      struct renamed_file* f = &cg->renamed[i2];
+      if (hasName(n->read_list, f->name)) {
+	if (f->numVersions == 0) {
+	  f->baseReaders = growArray(f->baseReaders, f->numBaseReaders, sizeof(graph_node_t));
+	  f->baseReaders[f->numBaseReaders++] = n;
+	}
+	else {
+	  struct file_version* v = &f->versions[f->numVersions - 1];
+	  v->readers = growArray(v->readers, v->numReaders, sizeof(graph_node_t));
+	  v->readers[v->numReaders++] = n;
+	  redirectFile(n->cmd, f->name, v->temp, false);
+	}
+      }
+      if (hasName(n->write_list, f->name)) {
+	f->versions = growArray(f->versions, f->numVersions, sizeof(struct file_version));
+	struct file_version* v = &f->versions[f->numVersions++];
+	v->writer = n;
+	v->temp = versionName(f->name, n->i);
+	v->readers = NULL;
+	v->numReaders = 0;
+	redirectFile(n->cmd, f->name, v->temp, true);
+      }
+    }
+  }
+}
+
+// A writer that failed before opening its output, say on a missing
+// input, leaves no version.  Its readers get the version before it
+// instead, as a serial run would have left the file, by linking that
+// one or the real file in its place.
+static void fillMissingVersions(command_graph_t cg, graph_node_t n)
 {
   int i = 0;
-  for (; i < size; i++) {
-    if (!f[i])
-      return false;
+  for (; i < cg->numRenamed; i++) {
+    struct renamed_file* f = &cg->renamed[i];
+    int k = f->retired;
+    for (; k < f->numVersions; k++) {
+      struct file_version* v = &f->versions[k];
+      if (v->writer != n || access(v->temp, F_OK) == 0)
+        continue;
+      char* from = f->name;
+      if (k > f->retired) {
+        struct file_version* prev = &f->versions[k - 1];
+        if (!finished[prev->writer->i]) {
+          error(0, 0, "%s: not written, and the version before it is not ready", v->temp);
+          continue;
+        }
+        from = prev->temp;
+      }
+      if (link(from, v->temp) != 0 && errno != ENOENT)
+        error(0, errno, "%s: cannot link to %s", from, v->temp);
+    }
   }
-  return true;
 }
 
-bool* finished;
-int* pids;
-int numNodes;
-command_graph_t comg;
-
-int getNodeID(int pid)
+static bool allNodesFinished(graph_node_t* nodes, int size)
 {
   int i = 0;
-  for (; i < numNodes; i++) {
-    if (pids[i] == pid)
-      return i;
+  for (; i < size; i++) {
+    if (!finished[nodes[i]->i])
+      return false;
   }
-  return -1;
+  return true;
 }
 
-void execute_nodes(graph_node_t* nodes, int size)
+// Renames finished versions over their real files, oldest first.  A
+// version is retired once its writer and readers are done and everyone
+// reading the previous version is done too, so no reader ever sees a
+// file change underneath it.
+static void retireVersions(command_graph_t cg)
 {
-  int numExecuted = 0;
   int i = 0;
-  for (; i < size; i++) {
-    //check if all dependencies finished
-    int i2 = 0;
-    bool allFinished = true;
-    for (; i2 < nodes[i]->depSize; i2++) {
-      if (!finished[nodes[i]->dependencies[i2]->i]) {
-	allFinished = false;
+  for (; i < cg->numRenamed; i++) {
+    struct renamed_file* f = &cg->renamed[i];
+    while (f->retired < f->numVersions) {
+      struct file_version* v = &f->versions[f->retired];
+      if (!finished[v->writer->i] || !allNodesFinished(v->readers, v->numReaders))
 	break;
+      if (f->retired == 0 && !allNodesFinished(f->baseReaders, f->numBaseReaders))
+	break;
+      if (f->retired > 0) {
+	struct file_version* prev = &f->versions[f->retired - 1];
+	if (!allNodesFinished(prev->readers, prev->numReaders))
+	  break;
       }
+      // A version is only missing if the file it stands for was never
+      // there either.  One linked to the file or the version before it
+      // is the same file as the one it replaces, which rename leaves be.
+      if (rename(v->temp, f->name) != 0 && errno != ENOENT)
+	error(0, errno, "%s: cannot rename to %s", v->temp, f->name);
+      unlink(v->temp);
+      f->retired++;
     }
-
-    if (allFinished) {
-      numExecuted++;
-      int pid = fork();
-      if (pid == 0) {
-	execute_command(nodes[i]->cmd, false);
-	exit(0);
-      }
-      else {
-	pids[nodes[i]->i] = pid;
-      }
-    }
-  }
-  for (i = 0; i < numExecuted; i++) {
-    int status;
-    int pid = waitpid(-1, &status, 0);
-    int nodeID = getNodeID(pid);
-    pids[nodeID] = 0; //may be helpful
-    finished[nodeID] = true;
-    execute_nodes(comg->nodes[nodeID]->dependOnMe, comg->nodes[nodeID]->depMeSize);
-    
   }
-  
 }
 
-void execute_commands(command_graph_t cg)
+// Scratch File Elimination Implementation
+// ===================================================================
+
+// Commands known to read their input once, front to back, which a pipe
+// serves as well as a file
+static char const* const streamingCommands[] = {
+  "awk", "base64", "bzip2", "cat", "cut", "grep", "gzip", "head", "md5sum",
+  "od", "paste", "sed", "sha1sum", "sha256sum", "sort", "tail", "tee", "tr",
+  "uniq", "wc", "xargs", "xz", NULL
+};
+
+// Whether the command in C whose input is redirected from NAME streams it
+static bool streamsInput(command_t c, char* name)
 {
-  comg = cg;
-  numNodes = cg->size;
-  finished = malloc(cg->size * sizeof(bool));
-  pids = malloc(cg->size * sizeof(int));
-  int i = 0;
-  graph_node_t* noDepNodes = malloc(sizeof(graph_node_t) * 50);
-  int size;
-  for (; i < cg->size; i++) {
-    if (cg->nodes[i]->dependencies[0] == NULL) {
-      noDepNodes[size++] = cg->nodes[i];
+  if (c->input != NULL && strcmp(c->input, name) == 0) {
+    if (c->type != SIMPLE_COMMAND)
+      return false;
+    char* slash = strrchr(c->u.word[0], '/');
+    char const* base = slash ? slash + 1 : c->u.word[0];
+    int i = 0;
+    for (; streamingCommands[i] != NULL; i++) {
+      if (strcmp(base, streamingCommands[i]) == 0)
+        return true;
     }
+    return false;
+  }
+  switch(c->type) {
+  case SIMPLE_COMMAND:
+    return false;
+  case SUBSHELL_COMMAND:
+    return streamsInput(c->u.subshell_command, name);
+  default:
+    return streamsInput(c->u.command[0], name) || streamsInput(c->u.command[1], name);
   }
-  execute_nodes(noDepNodes, size);
 }
 
-/*void execute_commands(command_graph_t cg)
+static int countName(char** list, char* name)
 {
-  bool* finished;
-  int* pids;
-  finished = malloc(cg->size * sizeof(bool));
-  pids = malloc(cg->size * sizeof(int));
-  int i = 0;
+  int count = 0;
+  for (; *list != NULL; list++)
+    count += strcmp(*list, name) == 0;
+  return count;
+}
 
-  while (!isFinished(finished, cg->size)) {
-    i = 0;
-    while (i < cg->size) {
-      if (!finished[i]) {
-	if (pids[i] == 0) {
-	  if (cg->nodes[i]->dependencies[0] == NULL) {
-	    int pid = fork();
-	    pids[i] = pid;
-	    if (pid == 0) {
-	      execute_command(cg->nodes[i]->cmd, false);
-	      exit(0);
-	    }
-	    else {
-	      int status;
-	      if (waitpid(pid, &status, WNOHANG)) {
-		pids[i] = -1;
-		finished[i] = true;
-	      }
-	    }
-	  }
-	  else {
-	    int i2 = 0;
-	    for (; i2 < cg->nodes[i]->depSize; i2++) {
-	      int status;
-	      if (waitpid(pids[i], &status, WNOHANG)) {
-		pids[i] = -1;
-		finished[i] = true;
-	      }   
-	      }
-	  }
-	}
-	else {
-	  int status;
-	  if (waitpid(pids[i], &status, WNOHANG)) {
-	    pids[i] = -1;
-	    finished[i] = true;
-	  }
-	}
-      }
-      i++;
-    }
+// Whether A and B have a name other than NAME in common
+static bool sharesOther(char** a, char** b, char* name)
+{
+  for (; *a != NULL; a++) {
+    if (strcmp(*a, name) != 0 && hasName(b, *a))
+      return true;
   }
-  }*/
+  return false;
+}
 
-void createStagedCommands(command_graph_t cg)
+// Whether R depends on W through some other tree
+static bool dependsThrough(command_graph_t cg, graph_node_t w, graph_node_t r)
 {
-  cg->staged_commands = malloc(50 * sizeof(graph_node_t*));
-  cg->stageSize = malloc(50 * sizeof(int));
-  cg->staged_commands[0][0] = cg->nodes[0];
-  cg->nodes[0]->stage = 1;
-  cg->stageSize[0]++;
-
-  int i = 1;
-  while (cg->nodes[i] != NULL) {
-    if (cg->nodes[i]->dependencies[0] == NULL){
-      cg->staged_commands[0][cg->stageSize[0]++] = cg->nodes[i];
-      cg->nodes[i]->stage = 1;
-    }
-    else {
-      int i2 = 0;
-      int maxStage = 0;
-      for (; cg->nodes[i]->dependencies[i2] != NULL; i2++) {
-	if (cg->nodes[i]->dependencies[i2]->stage > maxStage)
-	  maxStage = cg->nodes[i]->dependencies[i2]->stage;
+  bool* seen = checked_malloc(cg->size * sizeof(bool));
+  memset(seen, 0, cg->size * sizeof(bool));
+  graph_node_t* stack = checked_malloc(cg->size * sizeof(graph_node_t));
+  int top = 0;
+  bool found = false;
+  graph_node_t n = r;
+  for (;;) {
+    int i = 0;
+    for (; i < n->depSize; i++) {
+      graph_node_t d = n->dependencies[i];
+      if (n == r && d == w)
+        continue;
+      if (d == w)
+        found = true;
+      // Dependencies point backwards, so nothing before W leads to it
+      if (d->i > w->i && !seen[d->i]) {
+        seen[d->i] = true;
+        stack[top++] = d;
       }
-      cg->staged_commands[maxStage][cg->stageSize[maxStage]++] = cg->nodes[i];
-      cg->nodes[i]->stage = maxStage + 1;
     }
-    i++;
+    if (found || top == 0)
+      break;
+    n = stack[--top];
   }
+  free(seen);
+  free(stack);
+  return found;
 }
 
-bool isMatch(char** a, char** b)
+// Returns whether N was in NODES
+static bool removeNode(graph_node_t* nodes, int* size, graph_node_t n)
 {
   int i = 0;
-  while (a[i] != NULL) {
-    int i2 = 0;
-    while (b[i2] != NULL) {
-      if (strcmp(a[i], b[i2]) == 0)
-	return true;
-      i2++;
+  for (; i < *size; i++) {
+    if (nodes[i] == n) {
+      memmove(nodes + i, nodes + i + 1, (*size - i - 1) * sizeof(graph_node_t));
+      (*size)--;
+      return true;
     }
-    i++;
   }
   return false;
 }
 
-bool isAlreadyContained(graph_node_t* nodes, int size, graph_node_t n)
+// The tree after W that reads NAME, if W writes it once, whenever it
+// runs, and that tree reads it once, both by redirection, and no other
+// tree uses it.  A write behind && or || might not happen, and then the
+// reader has to find the file missing, not empty.
+static graph_node_t tempReader(command_graph_t cg, graph_node_t w, char* name)
 {
+  if (countName(w->write_list, name) != 1 || hasName(w->read_list, name)
+      || writesConditionally(w->cmd, name, false))
+    return NULL;
+  graph_node_t reader = NULL;
   int i = 0;
-  for (; i < size; i++) {
-    if (nodes[i] == n)
-      return true;
+  for (; i < cg->size; i++) {
+    graph_node_t n = cg->nodes[i];
+    if (n == w)
+      continue;
+    if (usesAsWord(n->cmd, name) || hasName(n->write_list, name))
+      return NULL;
+    if (hasName(n->read_list, name)) {
+      if (reader != NULL || n->i < w->i || countName(n->read_list, name) != 1)
+        return NULL;
+      reader = n;
+    }
   }
-  return false;
+  return reader;
 }
 
-void createDependencies(command_graph_t cg)
+// A scratch file is one with a single writer and a single later reader,
+// and the pass trusts that nothing outside the script reads it.  The
+// reader loses its edge to the writer if the pipe is the only thing
+// between them; a tree can take part in one scratch file at most.
+void eliminateTempFiles(command_graph_t cg)
 {
-  int i = 0;
-  int i2;
-  while (cg->nodes[i] != NULL) {
-    i2 = 0;
-    cg->nodes[i]->dependencies = malloc(sizeof(graph_node_t) * 50);
-    cg->nodes[i]->dependOnMe = malloc(sizeof(graph_node_t) * 50);
-    while (i2 != i) {
-      //RAW || WAR || WAW
-      if (isMatch(cg->nodes[i]->read_list, cg->nodes[i2]->write_list) ||
-	  isMatch(cg->nodes[i]->write_list, cg->nodes[i2]->read_list) ||
-	  isMatch(cg->nodes[i]->write_list, cg->nodes[i2]->write_list)) {
-	if (!isAlreadyContained(cg->nodes[i]->dependencies, cg->nodes[i]->depSize, cg->nodes[i2]))
-	  cg->nodes[i]->dependencies[cg->nodes[i]->depSize++] = cg->nodes[i2];
-	if (!isAlreadyContained(cg->nodes[i2]->dependOnMe, cg->nodes[i2]->depMeSize, cg->nodes[i]))
-	  cg->nodes[i2]->dependOnMe[cg->nodes[i2]->depMeSize++] = cg->nodes[i];
+  cg->temps = checked_malloc((cg->size / 2 + 1) * sizeof(struct temp_file));
+  int i, i2;
+  for (i = 0; i < cg->size; i++) {
+    graph_node_t w = cg->nodes[i];
+    char** wl = w->write_list;
+    for (i2 = 0; wl[i2] != NULL && w->temp == NULL; i2++) {
+      graph_node_t r = tempReader(cg, w, wl[i2]);
+      if (r == NULL || r->temp != NULL)
+        continue;
+      struct temp_file* f = &cg->temps[cg->numTemps++];
+      struct renamed_file* rf = findRenamed(cg, wl[i2]);
+      f->name = rf ? rf->versions[0].temp : wl[i2];
+      f->writer = w;
+      f->reader = r;
+      f->piped = streamsInput(r->cmd, f->name)
+        && !sharesOther(r->read_list, w->write_list, wl[i2])
+        && !sharesOther(r->write_list, w->read_list, wl[i2])
+        && !sharesOther(r->write_list, w->write_list, wl[i2])
+        && !dependsThrough(cg, w, r);
+      f->fd[0] = f->fd[1] = -1;
+      f->helper = 0;
+      if (f->piped) {
+        if (removeNode(r->dependencies, &r->depSize, w))
+          STAT_DEC(STAT_GRAPH_EDGES);
+        removeNode(w->dependOnMe, &w->depMeSize, r);
       }
-      i2++;
+      w->temp = r->temp = f;
     }
-    //debug
-    /*if (DEBUG) {
-      int ii = 0;
-      fprintf(stderr, "dependencies: ");
-      for (; ii < cg->nodes[i]->depSize; ii++) {
-	fprintf(stderr, "%s ", cg->nodes[i]->dependencies[ii]->cmd->u.word[0]);
-      }
-      }*/
-    i++;
   }
 }
 
-void execute_command_nf (command_t c, int time_travel);
 char** createReadList(command_t c);
 
-void appendRL(char** rl, char** rl2)
+static char** appendRL(char** rl, char** rl2)
 {
   int i = 0;
   while (rl[i] != NULL) {
@@ -399,29 +2626,77 @@ void appendRL(char** rl, char** rl2)
   }
   int i2 = 0;
   while (rl2[i2] != NULL) {
-    rl[i + i2] = rl2[i2];
     i2++;
   }
+  rl = checked_realloc(rl, (i + i2 + 1) * sizeof(char*));
+  memcpy(rl + i, rl2, (i2 + 1) * sizeof(char*));
+  return rl;
+}
+
+// Starts a list holding just FIRST, or an empty list if FIRST is NULL
+static char** newList(char* first)
+{
+  char** list = checked_malloc(2 * sizeof(char*));
+  list[0] = first;
+  list[1] = NULL;
+  return list;
+}
+
+static char** appendSubList(char** rl, char** sub)
+{
+  rl = appendRL(rl, sub);
+  free(sub);
+  return rl;
+}
+
+// The files every node of a flattened tree reads (or, with OUTPUTS,
+// writes), found by scanning its range of the node array in pre-order,
+// which gives them in the same order as walking the tree
+static char** flatFileList(struct flat_script* fs, int root, bool outputs)
+{
+  struct flat_node* n = &fs->nodes[root];
+  struct flat_node* end = &fs->nodes[n->end];
+  int size = 0;
+  for (; n < end; n++) {
+    size += (outputs ? n->output : n->input) >= 0;
+    if (!outputs && n->type == SIMPLE_COMMAND)
+      size += n->numWords;
+  }
+  char** list = checked_malloc((size + 1) * sizeof(char*));
+  int i = 0;
+  for (n = &fs->nodes[root]; n < end; n++) {
+    int file = outputs ? n->output : n->input;
+    if (file >= 0)
+      list[i++] = fs->files[file];
+    if (!outputs && n->type == SIMPLE_COMMAND) {
+      memcpy(list + i, fs->words + n->word, n->numWords * sizeof(char*));
+      i += n->numWords;
+    }
+  }
+  list[i] = NULL;
+  return list;
 }
 
 char** createReadList(command_t c)
 {
-  char** readList = malloc(50*sizeof(char*));
+  int root;
+  struct flat_script* fs = flat_script_of(c, &root);
+  if (fs)
+    return flatFileList(fs, root, false);
+  char** readList = newList(c->input);
   switch(c->type) {
   case PIPE_COMMAND:
   case OR_COMMAND:
   case SEQUENCE_COMMAND:
   case AND_COMMAND:
-    appendRL(readList, createReadList(c->u.command[0]));
-    appendRL(readList, createReadList(c->u.command[1]));
+    readList = appendSubList(readList, createReadList(c->u.command[0]));
+    readList = appendSubList(readList, createReadList(c->u.command[1]));
     break;
   case SUBSHELL_COMMAND:
-    readList[0] = c->input;
-    appendRL(readList, createReadList(c->u.subshell_command));
+    readList = appendSubList(readList, createReadList(c->u.subshell_command));
     break;
   case SIMPLE_COMMAND: 
-    readList[0] = c->input;
-    appendRL(readList, c->u.word);
+    readList = appendRL(readList, c->u.word);
     break;
   }
   return readList;
@@ -429,40 +2704,217 @@ char** createReadList(command_t c)
 
 char** createWriteList(command_t c)
 {
-  char** writeList = malloc(50*sizeof(char*));
+  int root;
+  struct flat_script* fs = flat_script_of(c, &root);
+  if (fs)
+    return flatFileList(fs, root, true);
+  char** writeList = newList(c->output);
   switch(c->type) {
   case PIPE_COMMAND:
   case OR_COMMAND:
   case SEQUENCE_COMMAND:
   case AND_COMMAND:
-    appendRL(writeList, createWriteList(c->u.command[0]));
-    appendRL(writeList, createWriteList(c->u.command[1]));
+    writeList = appendSubList(writeList, createWriteList(c->u.command[0]));
+    writeList = appendSubList(writeList, createWriteList(c->u.command[1]));
     break;
   case SUBSHELL_COMMAND:
-    writeList[0] = c->output;
-    appendRL(writeList, createWriteList(c->u.subshell_command));
+    writeList = appendSubList(writeList, createWriteList(c->u.subshell_command));
     break;
   case SIMPLE_COMMAND: 
-    writeList[0] = c->output;
     break;
   }
   return writeList;
 }
 
 
+// Asynchronous Execution
+// -------------------------------------------------------------------
+// execute_command_async forks one process that runs the whole command
+// in tail position, so a simple command costs one fork as it does with
+// execute_command, and records it in the command.  The process is
+// reaped by command_status or command_poll.
+
+void
+execute_command_async (command_t c, int time_travel)
+{
+  c->status = -1;
+  fflush(NULL); // Or the child's exit writes the caller's buffers again
+  STAT_INC(STAT_FORKS);
+  int pid = fork();
+  if (pid < 0)
+    error(1, errno, "fork");
+  if (pid == 0)
+    execute_tail(c, time_travel);
+  c->pid = pid;
+}
+
+// Reaps the process running C, waiting for it only if WAIT is set
+static void reapCommand(command_t c, bool wait)
+{
+  int status;
+  int pid;
+  do
+    pid = waitpid(c->pid, &status, wait ? 0 : WNOHANG);
+  while (pid < 0 && errno == EINTR);
+  if (pid == 0)
+    return;
+  if (pid < 0)
+    error(1, errno, "waitpid");
+  STAT_INC(STAT_WAITS);
+  c->status = WEXITSTATUS(status);
+  c->pid = 0;
+}
+
 int
 command_status (command_t c)
 {
+  if (c->pid > 0)
+    reapCommand(c, true);
   return c->status;
 }
 
+int
+command_poll (command_t c)
+{
+  if (c->pid > 0)
+    reapCommand(c, false);
+  return c->status;
+}
+
+// PATH Lookup Cache
+// -------------------------------------------------------------------
+// Maps command names to the executable execvp would pick.  Filled by
+// warm_path_cache, typically in a long-lived process whose children
+// inherit it; execute falls back to execvp for anything not cached.
+
+struct path_entry {
+  char* name;
+  char* path;
+};
+
+static __thread struct path_entry* pathCache;
+static __thread int pathCacheSize; // Always a power of two
+static __thread int pathCacheUsed;
+
+static unsigned hashName(char const* name)
+{
+  unsigned h = 2166136261u;
+  for (; *name; name++)
+    h = (h ^ (unsigned char) *name) * 16777619u;
+  return h;
+}
+
+static struct path_entry* findPathEntry(char const* name)
+{
+  if (pathCacheSize == 0)
+    return NULL;
+  unsigned i = hashName(name) & (pathCacheSize - 1);
+  while (pathCache[i].name != NULL) {
+    if (strcmp(pathCache[i].name, name) == 0)
+      return &pathCache[i];
+    i = (i + 1) & (pathCacheSize - 1);
+  }
+  return &pathCache[i];
+}
+
+static char const* cached_command_path(char const* name)
+{
+  struct path_entry* e = findPathEntry(name);
+  return e && e->name ? e->path : NULL;
+}
+
+static void addPathEntry(char const* name, char* path)
+{
+  if (2 * (pathCacheUsed + 1) > pathCacheSize) {
+    struct path_entry* old = pathCache;
+    int oldSize = pathCacheSize;
+    pathCacheSize = oldSize ? 2 * oldSize : 64;
+    pathCache = checked_malloc(pathCacheSize * sizeof(struct path_entry));
+    memset(pathCache, 0, pathCacheSize * sizeof(struct path_entry));
+    int i = 0;
+    for (; i < oldSize; i++) {
+      if (old[i].name != NULL)
+	*findPathEntry(old[i].name) = old[i];
+    }
+    free(old);
+  }
+  struct path_entry* e = findPathEntry(name);
+  e->name = strdup(name);
+  e->path = path;
+  pathCacheUsed++;
+}
+
+// Searches PATH for NAME the way execvp does.  Returns a malloc'd path,
+// or NULL if NAME contains a slash or is not found.
+static char* searchPath(char const* name)
+{
+  if (strchr(name, '/') != NULL)
+    return NULL;
+  char const* path = getenv("PATH");
+  if (path == NULL)
+    path = "/bin:/usr/bin";
+  while (*path) {
+    char const* colon = strchr(path, ':');
+    int dirLen = colon ? colon - path : (int) strlen(path);
+    char* candidate = checked_malloc(dirLen + strlen(name) + 3);
+    sprintf(candidate, "%.*s/%s", dirLen, dirLen ? path : ".", name);
+    if (access(candidate, X_OK) == 0)
+      return candidate;
+    free(candidate);
+    if (!colon)
+      break;
+    path = colon + 1;
+  }
+  return NULL;
+}
+
+static void warmName(char const* name)
+{
+  if (cached_command_path(name) != NULL)
+    return;
+  char* path = searchPath(name);
+  if (path != NULL)
+    addPathEntry(name, path);
+}
+
+void warm_path_cache(command_t c)
+{
+  switch(c->type) {
+  case SIMPLE_COMMAND:
+    warmName(c->u.word[0]);
+    if (!strcmp(c->u.word[0], "exec") && c->u.word[1] != NULL)
+      warmName(c->u.word[1]);
+    break;
+  case SUBSHELL_COMMAND:
+    warm_path_cache(c->u.subshell_command);
+    break;
+  default:
+    warm_path_cache(c->u.command[0]);
+    warm_path_cache(c->u.command[1]);
+    break;
+  }
+}
+
+// execvp, but trying the cached path first
+static void execCached(char** argv)
+{
+  char const* path = cached_command_path(argv[0]);
+  STAT_INC(STAT_EXECS);
+  if (path != NULL)
+    execv(path, argv);
+  execvp(argv[0], argv);
+}
+
 //Execute simple command
-void execute (command_t c) {
+static void execute (command_t c) {
   int child_status;
+  double start = accounting_now();
+  STAT_INC(STAT_FORKS);
   int pid = fork();
 
    
   if (pid == 0) {
+    STAT_ADD(STAT_REDIRECTIONS, (c->input != NULL) + (c->output != NULL));
    if (c->input != NULL)
       freopen(c->input, "r", stdin);
     if (c->output != NULL)
@@ -470,53 +2922,65 @@ void execute (command_t c) {
     //printf("command: %s %s\n", c->u.word[0], c->u.word[1]);  
    
    if(!strcmp(c->u.word[0], "exec"))
-     execvp(c->u.word[1], c->u.word+1);
+     execCached(c->u.word+1);
    
-    execvp(c->u.word[0], c->u.word);
-    fclose(stdin);
-    fclose(stdout);
+    execCached(c->u.word);
+    error(127, errno, "%s", c->u.word[0]);
   }
   else {
-    int return_pid = waitpid(pid, &child_status, 0);
+    struct rusage ru;
+    int return_pid = wait4(pid, &child_status, 0, &ru);
+    STAT_INC(STAT_WAITS);
     c->status = WEXITSTATUS(child_status);
+    account_command(c, &ru, start);
   }
 }
 
-void execute_nf (command_t c) {
+static void execute_nf (command_t c) {
+  STAT_ADD(STAT_REDIRECTIONS, (c->input != NULL) + (c->output != NULL));
   if (c->input != NULL)
     freopen(c->input, "r", stdin);
   if (c->output != NULL)
     freopen(c->output, "w", stdout);    
-  execvp(c->u.word[0], c->u.word);
-  fclose(stdin);
-  fclose(stdout);
+  if(!strcmp(c->u.word[0], "exec"))
+    execCached(c->u.word+1);
+  execCached(c->u.word);
+  error(127, errno, "%s", c->u.word[0]);
 }
 
-void execute_pipe (command_t c, int time_travel) {
+static void execute_pipe (command_t c, int time_travel) {
   int child_status;
   int first_pid, second_pid, return_pid;
   int mypipe[2];
-  pipe(mypipe);
+  struct rusage ru;
+  double start = accounting_now();
+  pipe2(mypipe, O_CLOEXEC);  // Or children of other threads keep it open
+  STAT_INC(STAT_PIPES);
+  STAT_INC(STAT_FORKS);
   first_pid = fork();
   if (first_pid == 0) {
     close(mypipe[0]);
     dup2(mypipe[1], 1);
     close(mypipe[1]);
-    execute_command_nf(c->u.command[0], time_travel);
+    execute_tail(c->u.command[0], time_travel);
   }
   else {
+    STAT_INC(STAT_FORKS);
     second_pid = fork();
     if (second_pid == 0) {
       close(mypipe[1]);
       dup2(mypipe[0], 0);
       close(mypipe[0]);
-      execute_command_nf(c->u.command[1], time_travel);
+      execute_tail(c->u.command[1], time_travel);
     }
     else {
       close(mypipe[0]);
       close(mypipe[1]);
-      return_pid = waitpid(first_pid, &child_status, 0);
-      return_pid = waitpid(second_pid, &child_status, 0);
+      return_pid = wait4(first_pid, &child_status, 0, &ru);
+      account_command(c->u.command[0], &ru, start);
+      return_pid = wait4(second_pid, &child_status, 0, &ru);
+      STAT_ADD(STAT_WAITS, 2);
+      account_command(c->u.command[1], &ru, start);
       c->status = WEXITSTATUS(child_status);
     }
   } 
@@ -556,6 +3020,8 @@ execute_command (command_t c, int time_travel)
   int pid;
   int child_status;
   int return_pid;
+  struct rusage ru;
+  double start;
   switch(c->type) {
   case PIPE_COMMAND:
     execute_pipe(c, time_travel);
@@ -589,19 +3055,22 @@ execute_command (command_t c, int time_travel)
     c->status = 0;
     break;
   case SUBSHELL_COMMAND:
-    pid = fork();
-    if (pid == 0) {
-      if (c->input != NULL)
-	freopen(c->input, "r", stdin);
-      if (c->output != NULL)
-	freopen(c->output, "w", stdout);
-      execute_command(c->u.subshell_command, time_travel);    
+    // Only redirections need a process of its own
+    if (c->input == NULL && c->output == NULL) {
+      execute_command(c->u.subshell_command, time_travel);
       c->status = c->u.subshell_command->status;
-      exit(c->status);
+      break;
     }
+    start = accounting_now();
+    STAT_INC(STAT_FORKS);
+    pid = fork();
+    if (pid == 0)
+      execute_tail(c, time_travel);
     else {
-      return_pid = waitpid(pid, &child_status, 0);
+      return_pid = wait4(pid, &child_status, 0, &ru);
+      STAT_INC(STAT_WAITS);
       c->status = WEXITSTATUS(child_status);
+      account_command(c, &ru, start);
   
       //exit(0);
     }
@@ -610,65 +3079,42 @@ execute_command (command_t c, int time_travel)
   //error (1, 0, "command execution not yet implemented");
 }
 
-void
-execute_command_nf (command_t c, int time_travel)
+// Tail Position
+// -------------------------------------------------------------------
+// A command is in tail position when the process running it exits
+// with its status as soon as it is done: the child forked for a tree,
+// for a subshell or for a side of a pipe.  There the command takes the
+// process over instead of forking again: a simple command is exec'd in
+// place, a subshell applies its redirections to the process itself,
+// and && and || hand the position on to their right side.  A sequence
+// keeps it, since its status is always 0.  Never returns.
+static void
+execute_tail (command_t c, int time_travel)
 {
-  /* FIXME: Replace this with your implementation.  You may need to
-     add auxiliary functions and otherwise modify the source code.
-     You can also use external functions defined in the GNU C Library.  */
-  int pid;
-  int child_status;
-  int return_pid;
-  switch(c->type) {
-  case PIPE_COMMAND:
-    execute_pipe(c, time_travel);
-    break;
-  case SIMPLE_COMMAND:
-    execute_nf(c);
-    break;
-  case AND_COMMAND:
-    execute_command(c->u.command[0], time_travel);
-    if (c->u.command[0]->status == 0) {
-      execute_command(c->u.command[1], time_travel);
-      c->status = c->u.command[1]->status;
-    }
-    else {
-      c->status = c->u.command[0]->status;
-    }
-    break;
-  case OR_COMMAND:
-    execute_command(c->u.command[0], time_travel);
-    if (c->u.command[0]->status == 0)
-      c->status = 0;
-    else {
-      execute_command(c->u.command[1], time_travel);
-      c->status = c->u.command[1]->status;
-    }
-      
-    break;
-  case SEQUENCE_COMMAND:
-    execute_command(c->u.command[0], time_travel);
-    execute_command(c->u.command[1], time_travel);
-    c->status = 0;
-    break;
-  case SUBSHELL_COMMAND:
-    //pid = fork();
-    //if (pid == 0) {
+  for (;;) {
+    if (c->type == SIMPLE_COMMAND && !accounting())
+      execute_nf(c);
+    else if (c->type == SUBSHELL_COMMAND) {
+      STAT_ADD(STAT_REDIRECTIONS, (c->input != NULL) + (c->output != NULL));
       if (c->input != NULL)
 	freopen(c->input, "r", stdin);
       if (c->output != NULL)
 	freopen(c->output, "w", stdout);
-      //TODO: don't know if this should be _nf or not
-      execute_command(c->u.subshell_command, time_travel);    
-      c->status = c->u.subshell_command->status;
-      exit(c->status);
-      //}
-      //else {
-      //return_pid = waitpid(pid, &child_status, 0);
-      //exit(0);
-      //}
-    
+      c = c->u.subshell_command;
+      continue;
+    }
+    else if (c->type == AND_COMMAND || c->type == OR_COMMAND) {
+      command_t left = c->u.command[0];
+      execute_command(left, time_travel);
+      if ((left->status == 0) != (c->type == AND_COMMAND))
+	exit(left->status);
+      c = c->u.command[1];
+      continue;
+    }
     break;
   }
-  //error (1, 0, "command execution not yet implemented");
+  // A sequence or a pipeline, or a simple command being accounted,
+  // which needs a wait4 of its own
+  execute_command(c, time_travel);
+  exit(c->status);
 }
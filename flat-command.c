@@ -0,0 +1,221 @@
+// UCLA CS 111 Lab 1 flattened command trees
+
+#include "command.h"
+#include "command-internals.h"
+#include "alloc.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The parser builds every tree out of separately malloc'd nodes, word
+// vectors and strings.  Once a script is parsed its trees are copied
+// into one flat_script: the nodes of all trees in one array in
+// pre-order, the word vectors in one array and all strings in one
+// buffer, and each redirection file name stored once, with an id.
+// Node I is also the struct command at commands[I], linked to the
+// others by pointers as before, so code walking a tree works unchanged
+// while passes that only need every node of a tree scan a range of the
+// array.  Scripts are flattened and looked up from any thread, so the
+// list of them is taken under a lock.
+
+static pthread_mutex_t scriptsLock = PTHREAD_MUTEX_INITIALIZER;
+static struct flat_script** scripts = NULL;
+static int numScripts = 0;
+
+struct builder {
+  struct flat_script* fs;
+  int nextNode;
+  int nextWord;
+  char* nextString;
+  int* fileSlots;  // Open-addressed table of file ids, -1 if free
+  int numSlots;    // A power of two
+};
+
+static void countTree(command_t c, int* nodes, int* words, size_t* bytes,
+                      int* files)
+{
+  (*nodes)++;
+  if (c->input) {
+    *bytes += strlen(c->input) + 1;
+    (*files)++;
+  }
+  if (c->output) {
+    *bytes += strlen(c->output) + 1;
+    (*files)++;
+  }
+  switch(c->type) {
+  case SIMPLE_COMMAND:
+    {
+      char** w = c->u.word;
+      for (; *w; w++) {
+        *bytes += strlen(*w) + 1;
+        (*words)++;
+      }
+      (*words)++;
+    }
+    break;
+  case SUBSHELL_COMMAND:
+    countTree(c->u.subshell_command, nodes, words, bytes, files);
+    break;
+  default:
+    countTree(c->u.command[0], nodes, words, bytes, files);
+    countTree(c->u.command[1], nodes, words, bytes, files);
+    break;
+  }
+}
+
+static char* copyString(struct builder* b, char const* s)
+{
+  char* copy = b->nextString;
+  size_t len = strlen(s) + 1;
+  memcpy(copy, s, len);
+  b->nextString += len;
+  return copy;
+}
+
+static int fileId(struct builder* b, char const* name)
+{
+  if (name == NULL)
+    return -1;
+  unsigned h = 2166136261u;
+  char const* p = name;
+  for (; *p; p++)
+    h = (h ^ (unsigned char) *p) * 16777619u;
+  int i = h & (b->numSlots - 1);
+  while (b->fileSlots[i] >= 0) {
+    if (strcmp(b->fs->files[b->fileSlots[i]], name) == 0)
+      return b->fileSlots[i];
+    i = (i + 1) & (b->numSlots - 1);
+  }
+  b->fileSlots[i] = b->fs->numFiles;
+  b->fs->files[b->fs->numFiles] = copyString(b, name);
+  return b->fs->numFiles++;
+}
+
+static int place(struct builder* b, command_t c)
+{
+  struct flat_script* fs = b->fs;
+  int i = b->nextNode++;
+  struct flat_node* n = &fs->nodes[i];
+  command_t flat = &fs->commands[i];
+  n->type = c->type;
+  n->input = fileId(b, c->input);
+  n->output = fileId(b, c->output);
+  n->child[0] = n->child[1] = -1;
+  n->word = n->numWords = 0;
+  flat->type = c->type;
+  flat->status = -1;
+  flat->pid = 0;
+  flat->input = n->input < 0 ? NULL : fs->files[n->input];
+  flat->output = n->output < 0 ? NULL : fs->files[n->output];
+  switch(c->type) {
+  case SIMPLE_COMMAND:
+    n->word = b->nextWord;
+    for (; c->u.word[n->numWords]; n->numWords++)
+      fs->words[b->nextWord++] = copyString(b, c->u.word[n->numWords]);
+    fs->words[b->nextWord++] = NULL;
+    flat->u.word = &fs->words[n->word];
+    break;
+  case SUBSHELL_COMMAND:
+    n->child[0] = place(b, c->u.subshell_command);
+    flat->u.subshell_command = &fs->commands[n->child[0]];
+    break;
+  default:
+    n->child[0] = place(b, c->u.command[0]);
+    n->child[1] = place(b, c->u.command[1]);
+    flat->u.command[0] = &fs->commands[n->child[0]];
+    flat->u.command[1] = &fs->commands[n->child[1]];
+    break;
+  }
+  n->end = b->nextNode;
+  return i;
+}
+
+command_stream_t flatten_stream(command_stream_t s)
+{
+  int nodes = 0;
+  int words = 0;
+  int files = 0;
+  size_t bytes = 0;
+  command_t c;
+  reset_traverse(s);
+  while ((c = read_command_stream(s)))
+    countTree(c, &nodes, &words, &bytes, &files);
+  reset_traverse(s);
+
+  struct flat_script* fs = checked_malloc(sizeof(struct flat_script));
+  fs->size = nodes;
+  fs->nodes = checked_malloc((nodes + 1) * sizeof(struct flat_node));
+  fs->commands = checked_malloc((nodes + 1) * sizeof(struct command));
+  fs->words = checked_malloc((words + 1) * sizeof(char*));
+  fs->strings = checked_malloc(bytes + 1);
+  fs->files = checked_malloc((files + 1) * sizeof(char*));
+  fs->numFiles = 0;
+
+  struct builder b;
+  b.fs = fs;
+  b.nextNode = 0;
+  b.nextWord = 0;
+  b.nextString = fs->strings;
+  b.numSlots = 16;
+  while (b.numSlots < 2 * files)
+    b.numSlots *= 2;
+  b.fileSlots = checked_malloc(b.numSlots * sizeof(int));
+  memset(b.fileSlots, -1, b.numSlots * sizeof(int));
+
+  command_stream_t flat = new_command_stream();
+  while ((c = read_command_stream(s))) {
+    add_command(&fs->commands[place(&b, c)], flat);
+    free_command(c);
+  }
+  free(b.fileSlots);
+  free_stream(s, false);
+  reset_traverse(flat);
+
+  pthread_mutex_lock(&scriptsLock);
+  scripts = checked_realloc(scripts, (numScripts + 1) * sizeof(struct flat_script*));
+  scripts[numScripts++] = fs;
+  pthread_mutex_unlock(&scriptsLock);
+  return flat;
+}
+
+struct flat_script* flat_script_of(command_t c, int* index)
+{
+  struct flat_script* found = NULL;
+  pthread_mutex_lock(&scriptsLock);
+  int i = 0;
+  for (; i < numScripts; i++) {
+    struct flat_script* fs = scripts[i];
+    if (c >= fs->commands && c < fs->commands + fs->size) {
+      *index = c - fs->commands;
+      found = fs;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&scriptsLock);
+  return found;
+}
+
+void free_flat_stream(command_stream_t s)
+{
+  reset_traverse(s);
+  command_t c = read_command_stream(s);
+  int index;
+  struct flat_script* fs = c ? flat_script_of(c, &index) : NULL;
+  free_stream(s, false);
+  if (fs == NULL)
+    return;
+  pthread_mutex_lock(&scriptsLock);
+  int i = 0;
+  for (; i < numScripts && scripts[i] != fs; i++)
+    continue;
+  scripts[i] = scripts[--numScripts];
+  pthread_mutex_unlock(&scriptsLock);
+  free(fs->nodes);
+  free(fs->commands);
+  free(fs->words);
+  free(fs->strings);
+  free(fs->files);
+  free(fs);
+}
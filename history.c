@@ -0,0 +1,288 @@
+// UCLA CS 111 Lab 1 runtime history
+
+#include "command.h"
+#include "alloc.h"
+
+#include <errno.h>
+#include <error.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// How long each tree took in earlier runs, keyed by its text as
+// command_text writes it, so the same command in another script or a
+// later version of this one is recognized.  The file has one line per
+// command: "SECONDS RUNS TEXT", where SECONDS is a moving average that
+// weighs recent runs more.  A command whose peak memory is known has
+// "SECONDS RUNS KBk TEXT" instead, where KB is the largest peak resident
+// set of its recent runs in kilobytes, let down slowly by smaller ones.
+// It is read when the script is loaded and rewritten whole after the
+// run.
+
+#define HISTORY_WEIGHT 0.3  // Of the newest run in the average
+#define MAX_KEY 4096
+
+struct history_entry {
+  char* key;
+  double seconds;
+  int runs;
+  long kb;  // 0 if unknown
+};
+
+// Each thread has its own, for the run it is doing
+static __thread char const* history_file = NULL;
+static __thread struct history_entry* entries = NULL;
+static __thread size_t tableSize = 0;  // A power of two
+static __thread size_t numEntries = 0;
+
+// Per tree of this run
+static __thread int numTrees = 0;
+static __thread char** treeKeys;
+static __thread double* predicted;  // -1 if never seen
+static __thread double* observed;   // -1 if not run
+static __thread long* predictedKb;  // -1 if unknown
+static __thread long* observedKb;   // -1 if not measured
+
+static size_t hashKey(char const* key)
+{
+  unsigned long long h = 14695981039346656037ULL;
+  for (; *key; key++)
+    h = (h ^ (unsigned char) *key) * 1099511628211ULL;
+  return h;
+}
+
+static struct history_entry* findEntry(char const* key)
+{
+  size_t i = hashKey(key) & (tableSize - 1);
+  while (entries[i].key != NULL && strcmp(entries[i].key, key) != 0)
+    i = (i + 1) & (tableSize - 1);
+  return &entries[i];
+}
+
+static struct history_entry* addEntry(char const* key)
+{
+  if (2 * (numEntries + 1) > tableSize) {
+    struct history_entry* old = entries;
+    size_t oldSize = tableSize;
+    tableSize = tableSize ? 2 * tableSize : 64;
+    entries = checked_malloc(tableSize * sizeof(struct history_entry));
+    memset(entries, 0, tableSize * sizeof(struct history_entry));
+    size_t i = 0;
+    for (; i < oldSize; i++) {
+      if (old[i].key != NULL)
+        *findEntry(old[i].key) = old[i];
+    }
+    free(old);
+  }
+  struct history_entry* e = findEntry(key);
+  if (e->key == NULL) {
+    e->key = strdup(key);
+    e->seconds = 0;
+    e->runs = 0;
+    e->kb = 0;
+    numEntries++;
+  }
+  return e;
+}
+
+bool history_loaded(void)
+{
+  return history_file != NULL;
+}
+
+bool load_history(char const* file, command_stream_t s)
+{
+  close_history();
+  FILE* f = fopen(file, "r");
+  if (f == NULL && errno != ENOENT) {
+    error(0, errno, "%s: cannot open history", file);
+    return false;
+  }
+  history_file = file;
+  char line[MAX_KEY + 64];
+  while (f && fgets(line, sizeof line, f)) {
+    double seconds;
+    int runs;
+    int textStart;
+    if (sscanf(line, "%lf %d %n", &seconds, &runs, &textStart) < 2)
+      continue;
+    long kb = 0;
+    int kbEnd = 0;
+    sscanf(line + textStart, "%ldk %n", &kb, &kbEnd);
+    if (kbEnd > 0 && line[textStart + kbEnd - 1] == ' ')
+      textStart += kbEnd;
+    else
+      kb = 0;
+    line[strcspn(line, "\n")] = '\0';
+    struct history_entry* e = addEntry(line + textStart);
+    e->seconds = seconds;
+    e->runs = runs;
+    e->kb = kb;
+  }
+  if (f)
+    fclose(f);
+
+  // Keys must be taken before -r points outputs at temporary names
+  numTrees = 0;
+  command_t c;
+  while ((c = read_command_stream(s)))
+    numTrees++;
+  reset_traverse(s);
+  treeKeys = checked_malloc((numTrees + 1) * sizeof(char*));
+  predicted = checked_malloc((numTrees + 1) * sizeof(double));
+  observed = checked_malloc((numTrees + 1) * sizeof(double));
+  predictedKb = checked_malloc((numTrees + 1) * sizeof(long));
+  observedKb = checked_malloc((numTrees + 1) * sizeof(long));
+  int i = 0;
+  char key[MAX_KEY];
+  while ((c = read_command_stream(s))) {
+    command_text(c, key, sizeof key);
+    treeKeys[i] = strdup(key);
+    struct history_entry* e = tableSize ? findEntry(key) : NULL;
+    predicted[i] = e && e->key && e->runs ? e->seconds : -1;
+    observed[i] = -1;
+    predictedKb[i] = e && e->key && e->kb > 0 ? e->kb : -1;
+    observedKb[i] = -1;
+    i++;
+  }
+  reset_traverse(s);
+  return true;
+}
+
+double history_expected(int tree)
+{
+  if (history_file == NULL || tree < 0 || tree >= numTrees)
+    return -1;
+  return predicted[tree];
+}
+
+void history_observe(int tree, double seconds)
+{
+  if (history_file == NULL || tree < 0 || tree >= numTrees)
+    return;
+  observed[tree] = seconds;
+}
+
+long history_expected_kb(int tree)
+{
+  if (history_file == NULL || tree < 0 || tree >= numTrees)
+    return -1;
+  return predictedKb[tree];
+}
+
+void history_observe_kb(int tree, long kb)
+{
+  if (history_file == NULL || tree < 0 || tree >= numTrees)
+    return;
+  observedKb[tree] = kb;
+}
+
+void save_history(void)
+{
+  if (history_file == NULL)
+    return;
+  int i = 0;
+  for (; i < numTrees; i++) {
+    if (observed[i] < 0)
+      continue;
+    struct history_entry* e = addEntry(treeKeys[i]);
+    e->seconds = e->runs ? (1 - HISTORY_WEIGHT) * e->seconds + HISTORY_WEIGHT * observed[i]
+      : observed[i];
+    e->runs++;
+    if (observedKb[i] > 0) {
+      long faded = (1 - HISTORY_WEIGHT) * e->kb;
+      e->kb = observedKb[i] > faded ? observedKb[i] : faded;
+    }
+  }
+
+  // Write a new file and rename it over the old one, so a crash never
+  // leaves half a history
+  char* temp = checked_malloc(strlen(history_file) + 8);
+  sprintf(temp, "%s.new", history_file);
+  FILE* f = fopen(temp, "w");
+  if (f == NULL) {
+    error(0, errno, "%s: cannot write history", temp);
+    free(temp);
+    return;
+  }
+  size_t e = 0;
+  for (; e < tableSize; e++) {
+    if (entries[e].key == NULL || entries[e].runs == 0)
+      continue;
+    if (entries[e].kb > 0)
+      fprintf(f, "%.6f %d %ldk %s\n", entries[e].seconds, entries[e].runs, entries[e].kb,
+              entries[e].key);
+    else
+      fprintf(f, "%.6f %d %s\n", entries[e].seconds, entries[e].runs, entries[e].key);
+  }
+  if (fclose(f) != 0 || rename(temp, history_file) != 0)
+    error(0, errno, "%s: cannot write history", history_file);
+  free(temp);
+}
+
+void close_history(void)
+{
+  size_t e = 0;
+  for (; e < tableSize; e++)
+    free(entries[e].key);
+  free(entries);
+  entries = NULL;
+  tableSize = numEntries = 0;
+  int i = 0;
+  for (; i < numTrees; i++)
+    free(treeKeys[i]);
+  if (history_file) {
+    free(treeKeys);
+    free(predicted);
+    free(observed);
+    free(predictedKb);
+    free(observedKb);
+  }
+  numTrees = 0;
+  history_file = NULL;
+}
+
+static double misprediction(int tree)
+{
+  double e = observed[tree] - predicted[tree];
+  return e < 0 ? -e : e;
+}
+
+static int byError(void const* a, void const* b)
+{
+  double x = misprediction(*(int const*) a);
+  double y = misprediction(*(int const*) b);
+  return (x < y) - (x > y);
+}
+
+void report_history(int top)
+{
+  if (history_file == NULL)
+    return;
+  int* trees = checked_malloc((numTrees + 1) * sizeof(int));
+  int n = 0;
+  double totalPredicted = 0;
+  double totalObserved = 0;
+  int i = 0;
+  for (; i < numTrees; i++) {
+    if (predicted[i] < 0 || observed[i] < 0)
+      continue;
+    trees[n++] = i;
+    totalPredicted += predicted[i];
+    totalObserved += observed[i];
+  }
+  fprintf(stderr, "history: %d of %d trees predicted, %.3fs predicted, %.3fs actual\n",
+          n, numTrees, totalPredicted, totalObserved);
+  qsort(trees, n, sizeof(int), byError);
+  if (top > n)
+    top = n;
+  if (top > 0)
+    fprintf(stderr, "%5s %10s %10s  %s\n", "tree", "predicted", "actual", "command");
+  for (i = 0; i < top; i++) {
+    char text[41];
+    snprintf(text, sizeof text, "%s", treeKeys[trees[i]]);
+    fprintf(stderr, "%5d %10.3f %10.3f  %s\n", trees[i], predicted[trees[i]],
+            observed[trees[i]], text);
+  }
+  free(trees);
+}
@@ -0,0 +1,646 @@
+// UCLA CS 111 Lab 1 library interface
+
+#include "timetrash.h"
+#include "command.h"
+#include "alloc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A context keeps each script's stream as the parser handed it back,
+// along with every option a run needs.  The executor reads its options
+// from thread-local variables, which each call sets from the context
+// before doing anything else.  A run combines the streams and builds a
+// fresh graph, and puts the trees back as it found them, so that
+// nothing one run leaves behind changes the next.
+
+struct tt_context
+{
+  struct script *scripts;
+  int num_scripts;
+  int *script_status;  // Per script, of the last run
+
+  bool time_travel;
+  int jobs;
+  bool rename_outputs;
+  char *journal_file;
+  bool resume;
+  char *trace_file;
+  bool keep_order;
+  size_t keep_order_limit;
+  bool pipe_temps;
+  bool keep_temps;
+  bool placement;
+  long long memory_budget_kb;  // 0 if unlimited
+  char *memory_hints;
+  enum sched_policy policy;
+  char *history_file;
+  char *weights_file;
+  char *dot_file;
+  int rusage_top;
+  int helpers;
+  char *workers;
+  char *worker_key;
+  struct worker_pool *pool;  // NULL until started
+  int window;
+  unsigned long long *stats;  // NULL if not counting
+};
+
+tt_context *
+tt_open (void)
+{
+  tt_context *ctx = checked_malloc (sizeof *ctx);
+  memset (ctx, 0, sizeof *ctx);
+  ctx->policy = POLICY_FIFO;
+  return ctx;
+}
+
+void
+tt_close (tt_context *ctx)
+{
+  int i;
+  for (i = 0; i < ctx->num_scripts; i++)
+    {
+      if (ctx->scripts[i].stream)
+	free_flat_stream (ctx->scripts[i].stream);
+      free ((char *) ctx->scripts[i].name);
+    }
+  free (ctx->scripts);
+  free (ctx->script_status);
+  free (ctx->journal_file);
+  free (ctx->trace_file);
+  free (ctx->memory_hints);
+  free (ctx->history_file);
+  free (ctx->weights_file);
+  free (ctx->dot_file);
+  free (ctx->workers);
+  free (ctx->worker_key);
+  if (ctx->pool)
+    {
+      use_worker_pool (ctx->pool);
+      stop_worker_pool ();
+    }
+  if (ctx->stats)
+    stop_stats (ctx->stats);
+  free (ctx);
+}
+
+// Points this thread's executor at the options of CTX
+static void
+use_context (tt_context *ctx)
+{
+  max_jobs = ctx->jobs;
+  journal_file = ctx->journal_file;
+  resume_run = ctx->resume;
+  keep_order = ctx->keep_order;
+  keep_order_limit = ctx->keep_order_limit ? ctx->keep_order_limit
+					   : 64 << 20;
+  pipe_temps = ctx->pipe_temps;
+  keep_temps = ctx->keep_temps;
+  placement = ctx->placement;
+  memory_budget_kb = ctx->memory_budget_kb;
+  sched_policy = ctx->policy;
+  use_worker_pool (ctx->pool);
+  use_stats (ctx->stats);
+}
+
+// Options
+// -------
+
+// Replaces *FIELD with a copy of VALUE, which may be NULL
+static void
+set_string (char **field, char const *value)
+{
+  free (*field);
+  *field = value ? strdup (value) : NULL;
+}
+
+void
+tt_set_time_travel (tt_context *ctx, bool on, int jobs)
+{
+  ctx->time_travel = on;
+  ctx->jobs = jobs > 0 ? jobs : 0;
+}
+
+void
+tt_set_rename_outputs (tt_context *ctx, bool on)
+{
+  ctx->rename_outputs = on;
+}
+
+void
+tt_set_journal (tt_context *ctx, char const *file, bool resume)
+{
+  set_string (&ctx->journal_file, file);
+  ctx->resume = resume;
+}
+
+void
+tt_set_trace (tt_context *ctx, char const *file)
+{
+  set_string (&ctx->trace_file, file);
+}
+
+void
+tt_set_keep_order (tt_context *ctx, bool on, size_t limit)
+{
+  ctx->keep_order = on;
+  ctx->keep_order_limit = limit;
+}
+
+void
+tt_set_pipe_temps (tt_context *ctx, bool on, bool keep)
+{
+  ctx->pipe_temps = on;
+  ctx->keep_temps = keep;
+}
+
+void
+tt_set_placement (tt_context *ctx, bool on)
+{
+  ctx->placement = on;
+}
+
+bool
+tt_set_memory (tt_context *ctx, char const *budget)
+{
+  long long kb = budget ? parse_size_kb (budget) : available_memory_kb ();
+  if (kb <= 0)
+    return false;
+  ctx->memory_budget_kb = kb;
+  return true;
+}
+
+void
+tt_set_memory_hints (tt_context *ctx, char const *file)
+{
+  set_string (&ctx->memory_hints, file);
+}
+
+bool
+tt_set_policy (tt_context *ctx, char const *name)
+{
+  int policy;
+  for (policy = 0; policy < NUM_POLICIES; policy++)
+    if (strcmp (name, policy_names[policy]) == 0)
+      {
+	ctx->policy = policy;
+	return true;
+      }
+  return false;
+}
+
+void
+tt_set_history (tt_context *ctx, char const *file)
+{
+  set_string (&ctx->history_file, file);
+}
+
+void
+tt_set_weights (tt_context *ctx, char const *file)
+{
+  set_string (&ctx->weights_file, file);
+}
+
+void
+tt_set_dot (tt_context *ctx, char const *file)
+{
+  set_string (&ctx->dot_file, file);
+}
+
+void
+tt_set_rusage (tt_context *ctx, int top)
+{
+  ctx->rusage_top = top > 0 ? top : 0;
+}
+
+void
+tt_set_workers (tt_context *ctx, int helpers, char const *workers,
+		char const *key_file)
+{
+  ctx->helpers = helpers > 0 ? helpers : 0;
+  set_string (&ctx->workers, workers);
+  set_string (&ctx->worker_key, key_file);
+}
+
+bool
+tt_start_workers (tt_context *ctx)
+{
+  if (ctx->pool || (! ctx->helpers && ! ctx->workers))
+    return true;
+  use_context (ctx);
+  ctx->pool = start_worker_pool (ctx->helpers);
+  if (ctx->workers && ! connect_workers (ctx->workers, ctx->worker_key))
+    {
+      stop_worker_pool ();
+      ctx->pool = NULL;
+      return false;
+    }
+  return true;
+}
+
+void
+tt_set_window (tt_context *ctx, int trees)
+{
+  ctx->window = trees > 0 ? trees : 0;
+}
+
+void
+tt_set_stats (tt_context *ctx, bool on)
+{
+  if (on && ! ctx->stats)
+    ctx->stats = start_stats ();
+  else if (! on && ctx->stats)
+    {
+      stop_stats (ctx->stats);
+      ctx->stats = NULL;
+    }
+}
+
+// Scripts
+// -------
+
+// Adds the N scripts at NEW, of which FILE is set for those given as
+// text, parsing them unless a window will
+static bool
+add_scripts (tt_context *ctx, struct script *new, int n)
+{
+  int i;
+  for (i = 0; i < n; i++)
+    {
+      new[i].stream = NULL;
+      new[i].num_trees = 0;
+    }
+  if (! ctx->window)
+    {
+      unsigned long long start = stat_clock ();
+      bool ok = load_scripts (new, n);
+      STAT_ADD (STAT_PARSE_NS, stat_clock () - start);
+      if (! ok)
+	{
+	  for (i = 0; i < n; i++)
+	    {
+	      if (new[i].stream)
+		free_flat_stream (new[i].stream);
+	      free ((char *) new[i].name);
+	    }
+	  return false;
+	}
+    }
+  ctx->scripts = checked_realloc (ctx->scripts, (ctx->num_scripts + n)
+					        * sizeof *ctx->scripts);
+  ctx->script_status = checked_realloc (ctx->script_status,
+					(ctx->num_scripts + n)
+					* sizeof *ctx->script_status);
+  for (i = 0; i < n; i++)
+    {
+      new[i].file = NULL;
+      ctx->script_status[ctx->num_scripts] = 0;
+      ctx->scripts[ctx->num_scripts++] = new[i];
+    }
+  return true;
+}
+
+bool
+tt_parse_file (tt_context *ctx, char const *file)
+{
+  return tt_parse_files (ctx, &file, 1);
+}
+
+bool
+tt_parse_files (tt_context *ctx, char const *const *files, int num_files)
+{
+  use_context (ctx);
+  struct script *new = checked_malloc ((num_files + 1) * sizeof *new);
+  int i;
+  for (i = 0; i < num_files; i++)
+    {
+      new[i].name = strdup (files[i]);
+      new[i].file = NULL;
+    }
+  bool ok = add_scripts (ctx, new, num_files);
+  free (new);
+  return ok;
+}
+
+bool
+tt_parse_text (tt_context *ctx, char const *name, char const *text,
+	       size_t len)
+{
+  use_context (ctx);
+  if (ctx->window)
+    {
+      fprintf (stderr, "%s: a window only reads script files\n", name);
+      return false;
+    }
+  struct script s;
+  s.name = strdup (name);
+  s.file = fmemopen ((void *) text, len, "r");
+  if (! s.file)
+    {
+      free ((char *) s.name);
+      return false;
+    }
+  FILE *f = s.file;
+  bool ok = add_scripts (ctx, &s, 1);
+  fclose (f);
+  return ok;
+}
+
+int
+tt_num_trees (tt_context const *ctx)
+{
+  int n = 0;
+  int i;
+  for (i = 0; i < ctx->num_scripts; i++)
+    n += ctx->scripts[i].num_trees;
+  return n;
+}
+
+int
+tt_num_scripts (tt_context const *ctx)
+{
+  return ctx->num_scripts;
+}
+
+// All trees of CTX in one stream, which the caller passes to
+// release_stream when done
+static command_stream_t
+combined_stream (tt_context *ctx)
+{
+  int i;
+  for (i = 0; i < ctx->num_scripts; i++)
+    reset_traverse (ctx->scripts[i].stream);
+  return combine_scripts (ctx->scripts, ctx->num_scripts, &script_hash);
+}
+
+static void
+release_stream (tt_context *ctx, command_stream_t s)
+{
+  if (ctx->num_scripts > 1)
+    free_stream (s, false);
+}
+
+// The dependency graph of S, with its temporary files piped if RUN
+static command_graph_t
+build_graph (tt_context *ctx, command_stream_t s, bool run)
+{
+  unsigned long long start = stat_clock ();
+  command_graph_t cg = create_graph_nodes (s);
+  if (ctx->rename_outputs)
+    createOutputVersions (cg);
+  createDependencies (cg);
+  if (run && ctx->pipe_temps)
+    eliminateTempFiles (cg);
+  STAT_ADD (STAT_GRAPH_NS, stat_clock () - start);
+  return cg;
+}
+
+// Running
+// -------
+
+bool
+tt_print (tt_context *ctx)
+{
+  use_context (ctx);
+  int number = 1;
+  bool ok = true;
+  command_t command;
+  if (ctx->window)
+    {
+      unsigned long long start = stat_clock ();
+      int i;
+      for (i = 0; ok && i < ctx->num_scripts; i++)
+	{
+	  struct tree_reader *reader = open_tree_reader (&ctx->scripts[i]);
+	  if (! reader)
+	    {
+	      ok = false;
+	      break;
+	    }
+	  while ((command = read_tree (reader)))
+	    {
+	      print_numbered_command (number++, command);
+	      free_command (command);
+	    }
+	  ok = close_tree_reader (reader);
+	}
+      STAT_ADD (STAT_EXECUTE_NS, stat_clock () - start);
+    }
+  else
+    {
+      command_stream_t s = combined_stream (ctx);
+      while ((command = read_command_stream (s)))
+	print_numbered_command (number++, command);
+      release_stream (ctx, s);
+    }
+  print_flush ();
+  return ok;
+}
+
+bool
+tt_analyze (tt_context *ctx)
+{
+  use_context (ctx);
+  command_stream_t s = combined_stream (ctx);
+  bool ok = ! ctx->history_file || load_history (ctx->history_file, s);
+  if (ok)
+    {
+      command_graph_t cg = build_graph (ctx, s, false);
+      ok = analyze_graph (cg, ctx->weights_file, ctx->dot_file);
+      free_command_graph (cg);
+    }
+  close_history ();
+  release_stream (ctx, s);
+  return ok;
+}
+
+bool
+tt_schedule (tt_context *ctx, int *jobs, int num_jobs)
+{
+  use_context (ctx);
+  command_stream_t s = combined_stream (ctx);
+  bool ok = ! ctx->history_file || load_history (ctx->history_file, s);
+  if (ok)
+    {
+      command_graph_t cg = build_graph (ctx, s, false);
+      ok = simulate_graph (cg, ctx->weights_file, jobs, num_jobs);
+      free_command_graph (cg);
+    }
+  close_history ();
+  release_stream (ctx, s);
+  return ok;
+}
+
+// Runs the trees of S all at once, as -t does.  Returns false if the
+// run could not be done as asked.
+static bool
+run_graph (tt_context *ctx, command_stream_t s)
+{
+  command_graph_t cg = build_graph (ctx, s, true);
+  if (ctx->trace_file)
+    trace_open (ctx->trace_file);
+  unsigned long long start = stat_clock ();
+  bool ok = execute_commands (cg);
+  STAT_ADD (STAT_EXECUTE_NS, stat_clock () - start);
+  trace_close ();
+
+  int last_tree = -1;
+  int i;
+  for (i = 0; i < ctx->num_scripts; i++)
+    {
+      last_tree += ctx->scripts[i].num_trees;
+      if (ctx->scripts[i].num_trees)
+	ctx->script_status[i] = graph_node_status (cg, last_tree);
+    }
+  free_command_graph (cg);
+  return ok;
+}
+
+// Runs the trees of S one after another.  Returns false if no worker
+// is left to run them on.
+static bool
+run_in_order (tt_context *ctx, command_stream_t s)
+{
+  bool ok = true;
+  unsigned long long start = stat_clock ();
+  int script = 0;
+  int tree = 0;
+  int trees_left = ctx->scripts[0].num_trees;
+  command_t command;
+  while ((command = read_command_stream (s)))
+    {
+      while (trees_left == 0)
+	trees_left = ctx->scripts[++script].num_trees;
+      trees_left--;
+
+      unsigned long long tree_start = stat_clock ();
+      accounting_start_tree (tree, command);
+      if (worker_pool_active ())
+	ok = pool_execute (command);
+      else
+	execute_command (command, false);
+      if (! ok)
+	break;
+      accounting_end_tree (command);
+      history_observe (tree++, (stat_clock () - tree_start) / 1e9);
+      ctx->script_status[script] = command_status (command);
+    }
+  STAT_ADD (STAT_EXECUTE_NS, stat_clock () - start);
+  return ok;
+}
+
+// Runs the trees of the scripts of CTX as a window reads them.  Returns
+// false if a script cannot be read or has a syntax error.
+static bool
+run_window (tt_context *ctx)
+{
+  unsigned long long start = stat_clock ();
+  bool ok = true;
+  if (ctx->time_travel)
+    ok = execute_window (ctx->scripts, ctx->num_scripts, ctx->window,
+			 ctx->script_status);
+  else
+    {
+      int i;
+      for (i = 0; ok && i < ctx->num_scripts; i++)
+	{
+	  struct tree_reader *reader = open_tree_reader (&ctx->scripts[i]);
+	  if (! reader)
+	    {
+	      ctx->script_status[i] = 1;
+	      ok = false;
+	      break;
+	    }
+	  command_t command;
+	  while ((command = read_tree (reader)))
+	    {
+	      execute_command (command, false);
+	      ctx->script_status[i] = command_status (command);
+	      free_command (command);
+	    }
+	  ok = close_tree_reader (reader);
+	  if (! ok)
+	    ctx->script_status[i] = 1;
+	}
+    }
+  STAT_ADD (STAT_EXECUTE_NS, stat_clock () - start);
+  return ok;
+}
+
+int
+tt_execute (tt_context *ctx)
+{
+  use_context (ctx);
+  int i;
+  for (i = 0; i < ctx->num_scripts; i++)
+    ctx->script_status[i] = 0;
+  if (! ctx->num_scripts)
+    return 0;
+  // Or every child that exits writes the caller's buffered output again
+  fflush (NULL);
+
+  if (ctx->window)
+    {
+      if (! run_window (ctx))
+	return 1;
+      return ctx->script_status[ctx->num_scripts - 1];
+    }
+
+  if (! tt_start_workers (ctx))
+    return -1;
+  command_stream_t s = combined_stream (ctx);
+  bool ok = (! ctx->history_file || load_history (ctx->history_file, s))
+	    && (! ctx->memory_hints
+		|| load_memory_hints (ctx->memory_hints, s));
+  if (ok)
+    {
+      if (ctx->rusage_top)
+	start_accounting (s);
+      if (ctx->time_travel)
+	ok = run_graph (ctx, s);
+      else
+	ok = run_in_order (ctx, s);
+      if (ctx->rusage_top)
+	{
+	  report_accounting (ctx->rusage_top);
+	  report_history (ctx->rusage_top);
+	  stop_accounting ();
+	}
+      save_history ();
+    }
+  close_history ();
+  forget_memory_hints ();
+  release_stream (ctx, s);
+  return ok ? ctx->script_status[ctx->num_scripts - 1] : -1;
+}
+
+int
+tt_script_status (tt_context const *ctx, int script)
+{
+  return ctx->script_status[script];
+}
+
+void
+tt_print_stats (tt_context *ctx)
+{
+  use_context (ctx);
+  print_stats ();
+}
+
+// Serving
+// -------
+
+int
+tt_serve (tt_context *ctx, char const *socket)
+{
+  use_context (ctx);
+  return serve (socket, ctx->time_travel, ctx->rename_outputs);
+}
+
+int
+tt_run_remote (char const *socket, char const *file)
+{
+  return run_remote (socket, file);
+}
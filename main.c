@@ -3,103 +3,339 @@
 #include <errno.h>
 #include <error.h>
 #include <getopt.h>
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
-#include "command.h"
+#include "timetrash.h"
 
 static char const *program_name;
-static char const *script_name;
 
 static void
 usage (void)
 {
-  error (1, 0, "usage: %s [-pt] SCRIPT-FILE", program_name);
+  error (1, 0, "usage: %s [-prst] [-j JOBS] [-z HELPERS]"
+	 " [-W HOST:PORT,... --worker-key=FILE]\n"
+	 "       [--journal=FILE [--resume]] [--trace=FILE]"
+	 "       [--keep-order[=BYTES]] [--pipe-temps [--keep-temps]]"
+	 " [--rusage[=TOP]] [--history=FILE]\n"
+	 "       [--policy=fifo|critical|longest] [--placement]"
+	 " [--memory[=SIZE] [--memory-hints=FILE]]\n"
+	 "       SCRIPT-FILE...\n"
+	 "       %s [-pst] [-j JOBS] --window=TREES SCRIPT-FILE...\n"
+	 "       %s [-r] --analyze [--weights=JOURNAL | --history=FILE]"
+	 " [--dot=FILE] SCRIPT-FILE...\n"
+	 "       %s [-r] --simulate[=JOBS,...] [--weights=JOURNAL | --history=FILE]"
+	 " SCRIPT-FILE...\n"
+	 "       %s [-rt] [-j JOBS] --serve=SOCKET\n"
+	 "       %s --connect=SOCKET SCRIPT-FILE",
+	 program_name, program_name, program_name, program_name, program_name,
+	 program_name);
 }
 
+enum
+{
+  JOURNAL_OPTION = CHAR_MAX + 1,
+  RESUME_OPTION,
+  SERVE_OPTION,
+  CONNECT_OPTION,
+  TRACE_OPTION,
+  RUSAGE_OPTION,
+  ANALYZE_OPTION,
+  WEIGHTS_OPTION,
+  DOT_OPTION,
+  SIMULATE_OPTION,
+  HISTORY_OPTION,
+  POLICY_OPTION,
+  WINDOW_OPTION,
+  KEEP_ORDER_OPTION,
+  PIPE_TEMPS_OPTION,
+  KEEP_TEMPS_OPTION,
+  PLACEMENT_OPTION,
+  MEMORY_OPTION,
+  MEMORY_HINTS_OPTION,
+  WORKER_KEY_OPTION,
+};
+
+static struct option const long_options[] =
+{
+  {"journal", required_argument, NULL, JOURNAL_OPTION},
+  {"resume", no_argument, NULL, RESUME_OPTION},
+  {"serve", required_argument, NULL, SERVE_OPTION},
+  {"connect", required_argument, NULL, CONNECT_OPTION},
+  {"trace", required_argument, NULL, TRACE_OPTION},
+  {"rusage", optional_argument, NULL, RUSAGE_OPTION},
+  {"analyze", no_argument, NULL, ANALYZE_OPTION},
+  {"weights", required_argument, NULL, WEIGHTS_OPTION},
+  {"dot", required_argument, NULL, DOT_OPTION},
+  {"simulate", optional_argument, NULL, SIMULATE_OPTION},
+  {"history", required_argument, NULL, HISTORY_OPTION},
+  {"policy", required_argument, NULL, POLICY_OPTION},
+  {"window", required_argument, NULL, WINDOW_OPTION},
+  {"keep-order", optional_argument, NULL, KEEP_ORDER_OPTION},
+  {"pipe-temps", no_argument, NULL, PIPE_TEMPS_OPTION},
+  {"keep-temps", no_argument, NULL, KEEP_TEMPS_OPTION},
+  {"placement", no_argument, NULL, PLACEMENT_OPTION},
+  {"memory", optional_argument, NULL, MEMORY_OPTION},
+  {"memory-hints", required_argument, NULL, MEMORY_HINTS_OPTION},
+  {"worker-key", required_argument, NULL, WORKER_KEY_OPTION},
+  {NULL, 0, NULL, 0}
+};
+
+// Reports each script when there are several; the overall status is
+// that of the first script that failed
 static int
-get_next_byte (void *stream)
+report_status (tt_context const *ctx, char **names)
 {
-  return getc (stream);
+  int num_scripts = tt_num_scripts (ctx);
+  int status = 0;
+  int i;
+  for (i = 0; i < num_scripts; i++)
+    {
+      int script_status = tt_script_status (ctx, i);
+      if (num_scripts > 1)
+	fprintf (stderr, "%s: exit status %d\n", names[i], script_status);
+      if (! status)
+	status = script_status;
+    }
+  return status;
 }
 
 int
 main (int argc, char **argv)
 {
-  int opt;
-  int command_number = 1;
+  int jobs_limit = 0;
   int print_tree = 0;
   int time_travel = 0;
+  int rename_outputs = 0;
+  int helpers = 0;
+  char const *workers = NULL;
+  char const *worker_key = NULL;
+  char const *journal_file = NULL;
+  bool resume_run = false;
+  char const *serve_socket = NULL;
+  char const *connect_socket = NULL;
+  char const *trace_file = NULL;
+  int rusage_top = 0;
+  int analyze = 0;
+  int print_stats_at_exit = 0;
+  char const *weights_file = NULL;
+  char const *dot_file = NULL;
+  char const *simulate_jobs = NULL;
+  char const *history_file = NULL;
+  bool reorder = false;
+  bool keep_order = false;
+  size_t keep_order_limit = 0;
+  bool pipe_temps = false;
+  bool keep_temps = false;
+  bool placement = false;
+  bool memory = false;
+  char const *memory_budget = NULL;
+  char const *memory_hints = NULL;
+  int window = 0;
   program_name = argv[0];
+  tt_context *ctx = tt_open ();
 
   for (;;)
-    switch (getopt (argc, argv, "pt"))
+    switch (getopt_long (argc, argv, "j:prstz:W:", long_options, NULL))
       {
+      case 'j':
+	jobs_limit = atoi (optarg);
+	if (jobs_limit <= 0)
+	  usage ();
+	break;
       case 'p': print_tree = 1; break;
+      case 'r': rename_outputs = 1; break;
+      case 's': print_stats_at_exit = 1; break;
       case 't': time_travel = 1; break;
+      case 'z':
+	helpers = atoi (optarg);
+	if (helpers <= 0)
+	  usage ();
+	break;
+      case 'W': workers = optarg; break;
+      case WORKER_KEY_OPTION: worker_key = optarg; break;
+      case JOURNAL_OPTION: journal_file = optarg; break;
+      case RESUME_OPTION: resume_run = true; break;
+      case SERVE_OPTION: serve_socket = optarg; break;
+      case CONNECT_OPTION: connect_socket = optarg; break;
+      case TRACE_OPTION: trace_file = optarg; break;
+      case ANALYZE_OPTION: analyze = 1; break;
+      case WEIGHTS_OPTION: weights_file = optarg; break;
+      case DOT_OPTION: dot_file = optarg; break;
+      case SIMULATE_OPTION: simulate_jobs = optarg ? optarg : "1,2,4,8,16"; break;
+      case HISTORY_OPTION: history_file = optarg; break;
+      case POLICY_OPTION:
+	if (! tt_set_policy (ctx, optarg))
+	  usage ();
+	reorder = strcmp (optarg, "fifo") != 0;
+	break;
+      case KEEP_ORDER_OPTION:
+	keep_order = true;
+	if (optarg)
+	  {
+	    char *end;
+	    keep_order_limit = strtoull (optarg, &end, 10);
+	    if (end == optarg || *end)
+	      usage ();
+	  }
+	break;
+      case PIPE_TEMPS_OPTION: pipe_temps = true; break;
+      case KEEP_TEMPS_OPTION: keep_temps = true; break;
+      case PLACEMENT_OPTION: placement = true; break;
+      case MEMORY_OPTION:
+	memory = true;
+	memory_budget = optarg;
+	if (optarg && ! tt_set_memory (ctx, optarg))
+	  usage ();
+	break;
+      case MEMORY_HINTS_OPTION: memory_hints = optarg; break;
+      case WINDOW_OPTION:
+	window = atoi (optarg);
+	if (window <= 0)
+	  usage ();
+	break;
+      case RUSAGE_OPTION:
+	rusage_top = optarg ? atoi (optarg) : 10;
+	if (rusage_top <= 0)
+	  usage ();
+	break;
       default: usage (); break;
       case -1: goto options_exhausted;
       }
  options_exhausted:;
 
-  // There must be exactly one file argument.
-  if (optind != argc - 1)
+  tt_set_time_travel (ctx, time_travel, jobs_limit);
+  tt_set_rename_outputs (ctx, rename_outputs);
+  if (serve_socket)
+    {
+      if (optind != argc || print_tree)
+	usage ();
+      return tt_serve (ctx, serve_socket);
+    }
+  if (connect_socket)
+    {
+      if (optind != argc - 1)
+	usage ();
+      return tt_run_remote (connect_socket, argv[optind]);
+    }
+
+  // There must be at least one file argument.
+  if (optind == argc)
+    usage ();
+  if (resume_run && ! journal_file)
+    usage ();
+  // Workers take jobs only from whoever knows their key
+  if ((workers && ! worker_key) || (worker_key && ! workers))
+    usage ();
+  // Only the -t scheduler has a timeline to trace
+  if (trace_file && ! time_travel)
+    usage ();
+  if ((weights_file && ! analyze && ! simulate_jobs)
+      || (dot_file && ! analyze) || (weights_file && history_file)
+      || (reorder && ! time_travel))
+    usage ();
+  // Output can only be captured from trees forked here
+  if (keep_order && (! time_travel || print_tree || helpers || workers
+		     || window))
+    usage ();
+  // Scratch files are passed between trees forked here, and are gone if
+  // the run stops part way
+  if ((pipe_temps && (! time_travel || print_tree || helpers || workers
+		      || window || resume_run))
+      || (keep_temps && ! pipe_temps))
+    usage ();
+  // Only trees forked here can be pinned, and a window reuses the
+  // places of finished trees before their readers are placed
+  if (placement && (! time_travel || print_tree || helpers || workers
+		    || window))
+    usage ();
+  // The budget is this machine's, for trees numbered as in the script
+  if ((memory && (! time_travel || print_tree || workers || window))
+      || (memory_hints && ! memory))
+    usage ();
+  if (memory && ! memory_budget && ! tt_set_memory (ctx, NULL))
+    error (1, 0, "cannot read available memory from /proc/meminfo");
+  // A window only ever sees part of the script, which rules out
+  // anything that needs all of it up front
+  if (window
+      && (rename_outputs || helpers || workers || journal_file || trace_file
+	  || rusage_top || analyze || weights_file || dot_file
+	  || simulate_jobs || history_file || reorder))
     usage ();
 
-  script_name = argv[optind];
-  FILE *script_stream = fopen (script_name, "r");
-  if (! script_stream)
-    error (1, errno, "%s: cannot open", script_name);
-  command_stream_t command_stream =
-    make_command_stream (get_next_byte, script_stream);
-
-  command_t last_command = NULL;
-  command_t command;
-
-
-  //TESTING
-  if(time_travel){
-    int jj;
-    command_graph_t cg = create_graph_nodes(command_stream);
-    reset_traverse(command_stream);
-    createDependencies(cg);
-    
-    execute_commands(cg);
-    //dump_command_graph(cg);
-  }
-  //TESTING
-  
-  
-  while ((command = read_command_stream (command_stream)))
+  // Job limits to simulate
+  int num_jobs = 0;
+  int *jobs = NULL;
+  if (simulate_jobs)
     {
-      if (print_tree)
+      char const *p = simulate_jobs;
+      jobs = malloc ((strlen (p) / 2 + 1) * sizeof *jobs);
+      if (! jobs)
+	error (1, errno, "malloc");
+      for (;;)
 	{
-	  printf ("# %d\n", command_number++);
-	  print_command (command);
-	}
-      else
-	{
-	  if (time_travel) {
-	    /*char** rl = createReadList(command);
-	    int i = 0;
-	    printf("read list: ");
-	    while (rl[i] != NULL) {
-	      printf("%s ", rl[i]);
-	      i++;
-	    }
-	    char** wl = createWriteList(command);
-	    i = 0;
-	    printf("write list: ");
-	    while (wl[i] != NULL) {
-	      printf("%s ", wl[i]);
-	      i++;
-	      }*/
-	  }
-	  else {
-	    last_command = command;
-	    execute_command (command, time_travel);
-	  }
+	  char *end;
+	  long n = strtol (p, &end, 10);
+	  if (end == p || n <= 0 || n > INT_MAX || (*end && *end != ','))
+	    usage ();
+	  jobs[num_jobs++] = n;
+	  if (! *end)
+	    break;
+	  p = end + 1;
 	}
     }
 
-  return print_tree || !last_command ? 0 : command_status (last_command);
+  tt_set_journal (ctx, journal_file, resume_run);
+  tt_set_trace (ctx, trace_file);
+  tt_set_keep_order (ctx, keep_order, keep_order_limit);
+  tt_set_pipe_temps (ctx, pipe_temps, keep_temps);
+  tt_set_placement (ctx, placement);
+  tt_set_memory_hints (ctx, memory_hints);
+  tt_set_history (ctx, history_file);
+  tt_set_weights (ctx, weights_file);
+  tt_set_dot (ctx, dot_file);
+  tt_set_rusage (ctx, rusage_top);
+  tt_set_window (ctx, window);
+  tt_set_stats (ctx, print_stats_at_exit);
+
+  // Before parsing, so the helpers fork from a small process
+  int execute = ! print_tree && ! analyze && ! simulate_jobs;
+  if (execute)
+    {
+      tt_set_workers (ctx, helpers, workers, worker_key);
+      if (! tt_start_workers (ctx))
+	return 1;
+    }
+
+  int num_scripts = argc - optind;
+  char **names = argv + optind;
+  if (! tt_parse_files (ctx, (char const *const *) names, num_scripts))
+    return 1;
+
+  int status = 0;
+  if (print_tree)
+    status = tt_print (ctx) ? 0 : 1;
+  else if (analyze || simulate_jobs)
+    {
+      if (analyze && ! tt_analyze (ctx))
+	status = 1;
+      if (analyze && simulate_jobs)
+	putchar ('\n');
+      if (simulate_jobs && ! tt_schedule (ctx, jobs, num_jobs))
+	status = 1;
+    }
+  else
+    {
+      if (tt_execute (ctx) < 0)
+	status = 1;
+      else
+	status = report_status (ctx, names);
+    }
+  if (print_stats_at_exit)
+    tt_print_stats (ctx);
+  tt_close (ctx);
+  free (jobs);
+  return status;
 }
@@ -0,0 +1,166 @@
+// UCLA CS 111 Lab 1 memory expectations
+
+#include "command.h"
+#include "alloc.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <error.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// How much memory each tree is expected to need at its peak, for the
+// -t scheduler to pack trees into memory_budget_kb.  A tree named in
+// the hints file needs what the hint says; otherwise it needs the peak
+// the runtime history recorded for it, and a tree with neither is taken
+// to need nothing.  The hints file has one line per command: "SIZE
+// TEXT", where SIZE is bytes with an optional K, M or G suffix and TEXT
+// is the command as in the script.  It matches a tree whose text, as
+// command_text writes it for the history, differs only in spacing.
+// Empty lines and lines starting with # are skipped.
+
+#define MAX_KEY 4096
+
+__thread long long memory_budget_kb = 0;
+
+static __thread int numTrees = 0;
+static __thread long long* hinted = NULL;  // Per tree, -1 if no hint
+
+long long available_memory_kb(void)
+{
+  FILE* f = fopen("/proc/meminfo", "r");
+  if (f == NULL)
+    return 0;
+  char line[128];
+  long long kb = 0;
+  while (fgets(line, sizeof line, f)) {
+    if (sscanf(line, "MemAvailable: %lld kB", &kb) == 1)
+      break;
+  }
+  fclose(f);
+  return kb;
+}
+
+// Drops the spaces in S that do not separate two words
+static void squeeze(char* s)
+{
+  char* to = s;
+  char const* from = s;
+  for (; *from; from++) {
+    if (!isspace((unsigned char) *from)) {
+      *to++ = *from;
+      continue;
+    }
+    while (isspace((unsigned char) from[1]))
+      from++;
+    if (to > s && !strchr(";|&()<>", to[-1]) && from[1] && !strchr(";|&()<>", from[1]))
+      *to++ = ' ';
+  }
+  *to = '\0';
+}
+
+long long parse_size_kb(char const* s)
+{
+  char* end;
+  errno = 0;
+  unsigned long long n = strtoull(s, &end, 10);
+  if (end == s || errno || *s == '-')
+    return -1;
+  unsigned long long unit = 1;
+  switch(toupper((unsigned char) *end)) {
+  case 'K': unit = 1ULL << 10; end++; break;
+  case 'M': unit = 1ULL << 20; end++; break;
+  case 'G': unit = 1ULL << 30; end++; break;
+  default: break;
+  }
+  if (*end || n > (1ULL << 62) / unit)
+    return -1;
+  return (n * unit + 1023) / 1024;
+}
+
+// Frees the first NUMHINTS of KEYS, and KEYS and SIZES
+static void freeHints(char** keys, long long* sizes, int numHints)
+{
+  int i = 0;
+  for (; i < numHints; i++)
+    free(keys[i]);
+  free(keys);
+  free(sizes);
+}
+
+bool load_memory_hints(char const* file, command_stream_t s)
+{
+  FILE* f = fopen(file, "r");
+  if (f == NULL) {
+    error(0, errno, "%s: cannot open memory hints", file);
+    return false;
+  }
+  char** keys = NULL;
+  long long* sizes = NULL;
+  int numHints = 0;
+  char line[MAX_KEY + 64];
+  int lineNumber = 0;
+  while (fgets(line, sizeof line, f)) {
+    lineNumber++;
+    line[strcspn(line, "\n")] = '\0';
+    if (line[0] == '\0' || line[0] == '#')
+      continue;
+    size_t sizeEnd = strcspn(line, " \t");
+    char* text = line + sizeEnd + strspn(line + sizeEnd, " \t");
+    line[sizeEnd] = '\0';
+    long long kb = parse_size_kb(line);
+    if (kb < 0 || *text == '\0') {
+      error(0, 0, "%s:%d: expected SIZE COMMAND", file, lineNumber);
+      fclose(f);
+      freeHints(keys, sizes, numHints);
+      return false;
+    }
+    keys = checked_realloc(keys, (numHints + 1) * sizeof(char*));
+    sizes = checked_realloc(sizes, (numHints + 1) * sizeof(long long));
+    squeeze(text);
+    keys[numHints] = strdup(text);
+    sizes[numHints++] = kb;
+  }
+  fclose(f);
+
+  // Taken before -r points outputs at temporary names, as the
+  // history's keys are
+  forget_memory_hints();
+  command_t c;
+  while ((c = read_command_stream(s)))
+    numTrees++;
+  reset_traverse(s);
+  hinted = checked_malloc((numTrees + 1) * sizeof(long long));
+  int tree = 0;
+  char key[MAX_KEY];
+  while ((c = read_command_stream(s))) {
+    command_text(c, key, sizeof key);
+    squeeze(key);
+    hinted[tree] = -1;
+    int i = 0;
+    for (; i < numHints; i++) {
+      if (strcmp(keys[i], key) == 0)
+        hinted[tree] = sizes[i];  // The last hint for a command wins
+    }
+    tree++;
+  }
+  reset_traverse(s);
+  freeHints(keys, sizes, numHints);
+  return true;
+}
+
+void forget_memory_hints(void)
+{
+  free(hinted);
+  hinted = NULL;
+  numTrees = 0;
+}
+
+long long expected_peak_kb(int tree)
+{
+  if (hinted && tree >= 0 && tree < numTrees && hinted[tree] >= 0)
+    return hinted[tree];
+  long kb = history_expected_kb(tree);
+  return kb > 0 ? kb : 0;
+}
@@ -0,0 +1,292 @@
+// UCLA CS 111 Lab 1 loading script files
+
+#include "command.h"
+#include "alloc.h"
+
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+// Scripts are parsed in this process.  The parser keeps its state per
+// thread and returns NULL on a syntax error, so with several scripts
+// each one is parsed on a thread of its own, a few at a time, and the
+// trees need not be copied from anywhere.
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+struct byte_source {
+  FILE* f;
+  unsigned long long hash; // FNV-1a of every byte handed to the parser
+  unsigned long long bytes;
+};
+
+static int get_next_byte(void* arg)
+{
+  struct byte_source* src = arg;
+  int c = getc(src->f);
+  if (c != EOF) {
+    src->hash = (src->hash ^ (unsigned char) c) * FNV_PRIME;
+    src->bytes++;
+  }
+  return c;
+}
+
+bool parse_script(struct script* s)
+{
+  FILE* f = s->file ? s->file : fopen(s->name, "r");
+  if (!f) {
+    error(0, errno, "%s: cannot open", s->name);
+    return false;
+  }
+  struct byte_source src;
+  src.f = f;
+  src.hash = FNV_OFFSET;
+  src.bytes = 0;
+  set_parse_line(1);
+  command_stream_t parsed = make_command_stream(get_next_byte, &src);
+  STAT_ADD(STAT_BYTES_READ, src.bytes);
+  if (f != s->file)
+    fclose(f);
+  if (parsed == NULL)
+    return false;
+  s->stream = flatten_stream(parsed);
+  s->num_trees = 0;
+  while (read_command_stream(s->stream))
+    s->num_trees++;
+  reset_traverse(s->stream);
+  s->hash = src.hash;
+  return true;
+}
+
+struct parser {
+  struct script* script;
+  unsigned long long* counters;  // The caller's, which the thread adds to
+  bool ok;
+  pthread_t thread;
+};
+
+static void* run_parser(void* arg)
+{
+  struct parser* p = arg;
+  stat_counters = p->counters;
+  p->ok = parse_script(p->script);
+  return NULL;
+}
+
+bool load_scripts(struct script* scripts, int n)
+{
+  if (n == 1)
+    return parse_script(&scripts[0]);
+
+  int maxParsers = sysconf(_SC_NPROCESSORS_ONLN);
+  if (maxParsers < 1)
+    maxParsers = 1;
+  struct parser* parsers = checked_malloc(n * sizeof(struct parser));
+  int started = 0;
+  int joined = 0;
+  bool ok = true;
+  while (joined < n) {
+    while (started < n && started - joined < maxParsers) {
+      struct parser* p = &parsers[started];
+      p->script = &scripts[started++];
+      p->counters = stat_counters;
+      int err = pthread_create(&p->thread, NULL, run_parser, p);
+      if (err)
+        error(1, err, "pthread_create");
+    }
+    pthread_join(parsers[joined].thread, NULL);
+    if (!parsers[joined++].ok)
+      ok = false;
+  }
+  free(parsers);
+  return ok;
+}
+
+command_stream_t combine_scripts(struct script* scripts, int n,
+				 unsigned long long* hash)
+{
+  if (n == 1) {
+    *hash = scripts[0].hash;
+    return scripts[0].stream;
+  }
+  command_stream_t all = new_command_stream();
+  *hash = FNV_OFFSET;
+  int i = 0;
+  for (; i < n; i++) {
+    command_t c;
+    while ((c = read_command_stream(scripts[i].stream)))
+      add_command(c, all);
+    *hash = (*hash ^ scripts[i].hash) * FNV_PRIME;
+  }
+  reset_traverse(all);
+  return all;
+}
+
+// Reading one tree at a time
+// -------------------------------------------------------------------
+// The parser only takes a whole input, so the reader cuts the script
+// into pieces and parses each piece on its own.  A piece ends where the
+// parser would start a new tree: at two or more newlines, outside any
+// parentheses, after something that is not an operator.  A comment
+// swallows the newline ending it, just as the parser does.  Each piece
+// is parsed from the line where it starts, so line numbers in errors
+// stay right.
+//
+// The script is read with read(2), not stdio: trees run in children
+// while the rest is still being read, and a child exiting with a stdio
+// stream open would seek the shared descriptor back.
+
+struct tree_reader {
+  int fd;
+  bool ownFile;
+  char buf[4096];
+  size_t bufPos;
+  size_t bufLen;
+  unsigned long long bytes;
+  char* piece;
+  size_t size;
+  size_t cap;
+  size_t pos;  // Next byte of PIECE handed to the parser
+  int line;  // Of the start of PIECE
+  bool failed;  // On a syntax error
+  command_stream_t stream;  // Trees of the current piece
+};
+
+static int get_reader_byte(struct tree_reader* r)
+{
+  if (r->bufPos == r->bufLen) {
+    ssize_t n;
+    do
+      n = read(r->fd, r->buf, sizeof r->buf);
+    while (n < 0 && errno == EINTR);
+    if (n < 0)
+      error(1, errno, "read");
+    if (n == 0)
+      return EOF;
+    r->bufPos = 0;
+    r->bufLen = n;
+    r->bytes += n;
+  }
+  return (unsigned char) r->buf[r->bufPos++];
+}
+
+static int get_piece_byte(void* arg)
+{
+  struct tree_reader* r = arg;
+  if (r->pos == r->size)
+    return EOF;
+  return (unsigned char) r->piece[r->pos++];
+}
+
+static void add_piece_byte(struct tree_reader* r, int c)
+{
+  if (r->size == r->cap)
+    r->piece = checked_grow_alloc(r->piece, &r->cap);
+  r->piece[r->size++] = c;
+}
+
+// Reads the next piece into R->piece.  Returns false if it holds no
+// command at all.
+static bool read_piece(struct tree_reader* r)
+{
+  r->size = 0;
+  r->pos = 0;
+  bool content = false;
+  char last = '\0';  // Last byte of a token
+  int newlines = 0;  // Since then
+  int depth = 0;
+  int c;
+  while ((c = get_reader_byte(r)) != EOF) {
+    if (c == '#') {
+      add_piece_byte(r, c);
+      while ((c = get_reader_byte(r)) != EOF && c != '\n')
+        add_piece_byte(r, c);
+      if (c == EOF)
+        break;
+      add_piece_byte(r, c);
+      continue;
+    }
+    if (c == '\n')
+      newlines++;
+    else if (c != ' ' && c != '\t') {
+      if (content && newlines >= 2 && depth == 0 && !strchr("|&;(<>", last)) {
+        r->bufPos--;  // The byte starts the next piece
+        return true;
+      }
+      content = true;
+      newlines = 0;
+      last = c;
+      if (c == '(')
+        depth++;
+      else if (c == ')')
+        depth--;
+    }
+    add_piece_byte(r, c);
+  }
+  return content;
+}
+
+struct tree_reader* open_tree_reader(struct script* s)
+{
+  struct tree_reader* r = checked_malloc(sizeof(struct tree_reader));
+  r->ownFile = s->file == NULL;
+  r->fd = s->file ? fileno(s->file) : open(s->name, O_RDONLY | O_CLOEXEC);
+  if (r->fd < 0) {
+    error(0, errno, "%s: cannot open", s->name);
+    free(r);
+    return NULL;
+  }
+  r->bufPos = r->bufLen = 0;
+  r->bytes = 0;
+  r->cap = 1024;
+  r->piece = checked_malloc(r->cap);
+  r->line = 1;
+  r->failed = false;
+  r->stream = NULL;
+  return r;
+}
+
+command_t read_tree(struct tree_reader* r)
+{
+  if (r->failed)
+    return NULL;
+  for (;;) {
+    command_t c = r->stream ? read_command_stream(r->stream) : NULL;
+    if (c)
+      return c;
+    if (r->stream)
+      free_stream(r->stream, false);
+    r->stream = NULL;
+    if (!read_piece(r))
+      return NULL;
+    set_parse_line(r->line);
+    r->stream = make_command_stream(get_piece_byte, r);
+    size_t i = 0;
+    for (; i < r->size; i++)
+      r->line += r->piece[i] == '\n';
+    if (r->stream == NULL) {
+      r->failed = true;
+      return NULL;
+    }
+  }
+}
+
+bool close_tree_reader(struct tree_reader* r)
+{
+  bool ok = !r->failed;
+  STAT_ADD(STAT_BYTES_READ, r->bytes);
+  if (r->stream)
+    free_stream(r->stream, false);
+  if (r->ownFile)
+    close(r->fd);
+  free(r->piece);
+  free(r);
+  return ok;
+}
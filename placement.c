@@ -0,0 +1,245 @@
+// UCLA CS 111 Lab 1 CPU placement
+
+#define _GNU_SOURCE // for sched_setaffinity and the CPU_* macros
+
+#include "command.h"
+#include "alloc.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <error.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The CPUs this process may run on are split into domains, each the
+// CPUs sharing one last-level cache, as /sys/devices/system/cpu
+// describes them; where it does not, every CPU is a domain of its own.
+// A placed node is pinned to all of its domain, so every process it
+// forks, the stages of a pipeline included, passes data through that
+// cache.  A domain is full once it runs as many nodes as it has CPUs.
+//
+// A node goes to the domain of the tree it reads from, if that has
+// room, since the output just written is still in its cache.  Failing
+// that it goes to the emptiest domain with room on the same NUMA node,
+// where the page cache holding the output is local, and failing that to
+// the emptiest domain of all.
+
+__thread bool placement = false;
+
+struct domain {
+  cpu_set_t cpus;
+  int size;
+  int numa;  // -1 if unknown
+  int load;  // Placed nodes still running
+  char name[64];
+};
+
+// Each thread places the nodes of its own run
+static __thread struct domain* domains = NULL;
+static __thread int numDomains = 0;
+static __thread int* nodeDomain;  // Where each node last ran, -1 if nowhere
+
+static bool readSysfs(char const* path, char* buf, size_t size)
+{
+  FILE* f = fopen(path, "r");
+  if (f == NULL)
+    return false;
+  bool ok = fgets(buf, size, f) != NULL;
+  fclose(f);
+  buf[strcspn(buf, "\n")] = '\0';
+  return ok;
+}
+
+// Parses a list such as "0-3,8-11" into SET
+static bool parseCpuList(char const* s, cpu_set_t* set)
+{
+  CPU_ZERO(set);
+  while (*s) {
+    char* end;
+    long first = strtol(s, &end, 10);
+    long last = first;
+    if (end == s)
+      return false;
+    if (*end == '-')
+      last = strtol(end + 1, &end, 10);
+    for (; first <= last && first < CPU_SETSIZE; first++)
+      CPU_SET(first, set);
+    if (*end && *end != ',')
+      return false;
+    s = *end ? end + 1 : end;
+  }
+  return true;
+}
+
+static void formatCpuList(cpu_set_t const* set, char* buf, size_t size)
+{
+  size_t used = 0;
+  buf[0] = '\0';
+  int cpu = 0;
+  while (cpu < CPU_SETSIZE) {
+    if (!CPU_ISSET(cpu, set)) {
+      cpu++;
+      continue;
+    }
+    int last = cpu;
+    while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set))
+      last++;
+    int n = last > cpu ? snprintf(buf + used, size - used, "%s%d-%d", used ? "," : "", cpu, last)
+      : snprintf(buf + used, size - used, "%s%d", used ? "," : "", cpu);
+    if (n < 0 || (size_t) n >= size - used)
+      return;  // Cut short, but still names the first CPUs
+    used += n;
+    cpu = last + 1;
+  }
+}
+
+// The CPUs sharing the highest level of cache with CPU
+static bool sharedCache(int cpu, cpu_set_t* set)
+{
+  int bestLevel = 0;
+  int index = 0;
+  for (;; index++) {
+    char path[128];
+    char buf[256];
+    snprintf(path, sizeof path, "/sys/devices/system/cpu/cpu%d/cache/index%d/level", cpu, index);
+    if (!readSysfs(path, buf, sizeof buf))
+      break;
+    int level = atoi(buf);
+    if (level <= bestLevel)
+      continue;
+    snprintf(path, sizeof path, "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list",
+             cpu, index);
+    if (readSysfs(path, buf, sizeof buf) && parseCpuList(buf, set))
+      bestLevel = level;
+  }
+  return bestLevel > 0;
+}
+
+static int numaNode(int cpu)
+{
+  char path[64];
+  snprintf(path, sizeof path, "/sys/devices/system/cpu/cpu%d", cpu);
+  DIR* dir = opendir(path);
+  if (dir == NULL)
+    return -1;
+  int node = -1;
+  struct dirent* e;
+  while ((e = readdir(dir)) != NULL) {
+    if (strncmp(e->d_name, "node", 4) == 0 && e->d_name[4] >= '0' && e->d_name[4] <= '9') {
+      node = atoi(e->d_name + 4);
+      break;
+    }
+  }
+  closedir(dir);
+  return node;
+}
+
+// Done once, as the topology does not change under a run
+static void findDomains(void)
+{
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof allowed, &allowed) != 0)
+    error(1, errno, "sched_getaffinity");
+  cpu_set_t seen;
+  CPU_ZERO(&seen);
+  int cpu = 0;
+  for (; cpu < CPU_SETSIZE; cpu++) {
+    if (!CPU_ISSET(cpu, &allowed) || CPU_ISSET(cpu, &seen))
+      continue;
+    cpu_set_t set;
+    if (sharedCache(cpu, &set))
+      CPU_AND(&set, &set, &allowed);
+    else
+      CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    CPU_OR(&seen, &seen, &set);
+    domains = checked_realloc(domains, (numDomains + 1) * sizeof(struct domain));
+    struct domain* d = &domains[numDomains++];
+    d->cpus = set;
+    d->size = CPU_COUNT(&set);
+    d->numa = numaNode(cpu);
+    d->load = 0;
+    formatCpuList(&set, d->name, sizeof d->name);
+  }
+}
+
+void start_placement(int size)
+{
+  if (domains == NULL)
+    findDomains();
+  int d = 0;
+  for (; d < numDomains; d++)
+    domains[d].load = 0;
+  nodeDomain = checked_malloc((size + 1) * sizeof(int));
+  int i = 0;
+  for (; i < size; i++)
+    nodeDomain[i] = -1;
+}
+
+void stop_placement(void)
+{
+  free(nodeDomain);
+  nodeDomain = NULL;
+}
+
+// Whether domain A is less loaded than B, for their sizes
+static bool emptier(int a, int b)
+{
+  return b < 0 || domains[a].load * domains[b].size < domains[b].load * domains[a].size;
+}
+
+// The emptiest domain on NUMA node NUMA with room, or of all if NUMA
+// is -1; -1 if there is none
+static int emptiest(int numa)
+{
+  int best = -1;
+  int d = 0;
+  for (; d < numDomains; d++) {
+    if (numa >= 0 && domains[d].numa != numa)
+      continue;
+    if (numa >= 0 && domains[d].load >= domains[d].size)
+      continue;
+    if (emptier(d, best))
+      best = d;
+  }
+  return best;
+}
+
+int place_node(int node, int near, bool together, char const** reason)
+{
+  int from = near >= 0 ? nodeDomain[near] : -1;
+  int d;
+  if (from >= 0 && (together || domains[from].load < domains[from].size)) {
+    d = from;
+    *reason = together ? "pipeline" : "producer";
+  }
+  else if (from >= 0 && domains[from].numa >= 0 && (d = emptiest(domains[from].numa)) >= 0)
+    *reason = "numa";
+  else {
+    d = emptiest(-1);
+    *reason = "spread";
+  }
+  nodeDomain[node] = d;
+  domains[d].load++;
+  return d;
+}
+
+char const* domain_cpus(int domain)
+{
+  return domains[domain].name;
+}
+
+void pin_node(int node)
+{
+  // Only a hint: a CPU taken offline since just runs the node unpinned
+  if (nodeDomain[node] >= 0)
+    sched_setaffinity(0, sizeof(cpu_set_t), &domains[nodeDomain[node]].cpus);
+}
+
+void unplace_node(int node)
+{
+  if (nodeDomain[node] >= 0)
+    domains[nodeDomain[node]].load--;
+}
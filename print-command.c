@@ -2,9 +2,81 @@
 
 #include "command.h"
 #include "command-internals.h"
+#include "alloc.h"
 
+#include <errno.h>
+#include <error.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Output is rendered into one buffer and written with write(2) when it
+// fills, rather than through several printf calls per node; -p spends
+// most of its time printing otherwise.  print_command writes its tree
+// out at once, since a caller may mix it with stdio, while
+// print_numbered_command only writes when the buffer is full and
+// leaves the rest to print_flush.  Every thread has a buffer of its
+// own.
+
+#define OUT_SIZE (1 << 18)
+
+static __thread char *out;
+static __thread size_t out_len;
+
+// A run of spaces to copy indentation from
+static char const spaces[] = "                                                                ";
+
+void
+print_flush (void)
+{
+  size_t done = 0;
+  while (done < out_len)
+    {
+      ssize_t n = write (STDOUT_FILENO, out + done, out_len - done);
+      if (n < 0 && errno == EINTR)
+	continue;
+      if (n < 0)
+	error (1, errno, "write error");
+      done += n;
+    }
+  out_len = 0;
+}
+
+static void
+out_append (char const *s, size_t len)
+{
+  if (! out)
+    out = checked_malloc (OUT_SIZE);
+  while (out_len + len > OUT_SIZE)
+    {
+      size_t part = OUT_SIZE - out_len;
+      memcpy (out + out_len, s, part);
+      out_len += part;
+      s += part;
+      len -= part;
+      print_flush ();
+    }
+  memcpy (out + out_len, s, len);
+  out_len += len;
+}
+
+static void
+out_string (char const *s)
+{
+  out_append (s, strlen (s));
+}
+
+static void
+out_indent (int indent)
+{
+  while (indent > 0)
+    {
+      int n = indent < (int) sizeof spaces - 1 ? indent : (int) sizeof spaces - 1;
+      out_append (spaces, n);
+      indent -= n;
+    }
+}
 
 static void
 command_indented_print (int indent, command_t c)
@@ -19,7 +91,10 @@ command_indented_print (int indent, command_t c)
 	command_indented_print (indent + 2 * (c->u.command[0]->type != c->type),
 				c->u.command[0]);
 	static char const command_label[][3] = { "&&", ";", "||", "|" };
-	printf (" \\\n%*s%s\n", indent, "", command_label[c->type]);
+	out_append (" \\\n", 3);
+	out_indent (indent);
+	out_string (command_label[c->type]);
+	out_append ("\n", 1);
 	command_indented_print (indent + 2 * (c->u.command[1]->type != c->type),
 				c->u.command[1]);
 	break;
@@ -28,16 +103,23 @@ command_indented_print (int indent, command_t c)
     case SIMPLE_COMMAND:
       {
 	char **w = c->u.word;
-	printf ("%*s%s", indent, "", *w);
+	out_indent (indent);
+	out_string (*w);
 	while (*++w)
-	  printf (" %s", *w);
+	  {
+	    out_append (" ", 1);
+	    out_string (*w);
+	  }
 	break;
       }
 
     case SUBSHELL_COMMAND:
-      printf ("%*s(\n", indent, "");
+      out_indent (indent);
+      out_append ("(\n", 2);
       command_indented_print (indent + 1, c->u.subshell_command);
-      printf ("\n%*s)", indent, "");
+      out_append ("\n", 1);
+      out_indent (indent);
+      out_append (")", 1);
       break;
 
     default:
@@ -45,14 +127,90 @@ command_indented_print (int indent, command_t c)
     }
 
   if (c->input)
-    printf ("<%s", c->input);
+    {
+      out_append ("<", 1);
+      out_string (c->input);
+    }
   if (c->output)
-    printf (">%s", c->output);
+    {
+      out_append (">", 1);
+      out_string (c->output);
+    }
 }
 
 void
 print_command (command_t c)
 {
+  fflush (stdout);
+  command_indented_print (2, c);
+  out_append ("\n", 1);
+  print_flush ();
+}
+
+void
+print_numbered_command (int number, command_t c)
+{
+  char label[32];
+  out_append (label, snprintf (label, sizeof label, "# %d\n", number));
   command_indented_print (2, c);
-  putchar ('\n');
+  out_append ("\n", 1);
+}
+
+static void
+command_text_append (command_t c, char *buf, size_t size)
+{
+  size_t len = strlen (buf);
+  switch (c->type)
+    {
+    case AND_COMMAND:
+    case SEQUENCE_COMMAND:
+    case OR_COMMAND:
+    case PIPE_COMMAND:
+      {
+	static char const command_label[][3] = { "&&", ";", "||", "|" };
+	command_text_append (c->u.command[0], buf, size);
+	len = strlen (buf);
+	snprintf (buf + len, size - len, " %s ", command_label[c->type]);
+	command_text_append (c->u.command[1], buf, size);
+	break;
+      }
+
+    case SIMPLE_COMMAND:
+      {
+	char **w = c->u.word;
+	snprintf (buf + len, size - len, "%s", *w);
+	while (*++w)
+	  {
+	    len = strlen (buf);
+	    snprintf (buf + len, size - len, " %s", *w);
+	  }
+	break;
+      }
+
+    case SUBSHELL_COMMAND:
+      snprintf (buf + len, size - len, "(");
+      command_text_append (c->u.subshell_command, buf, size);
+      len = strlen (buf);
+      snprintf (buf + len, size - len, ")");
+      break;
+
+    default:
+      abort ();
+    }
+
+  len = strlen (buf);
+  if (c->input)
+    snprintf (buf + len, size - len, "<%s", c->input);
+  len = strlen (buf);
+  if (c->output)
+    snprintf (buf + len, size - len, ">%s", c->output);
+}
+
+void
+command_text (command_t c, char *buf, size_t size)
+{
+  if (size == 0)
+    return;
+  buf[0] = '\0';
+  command_text_append (c, buf, size);
 }
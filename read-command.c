@@ -10,11 +10,86 @@
 #include <string.h>   // for strcpy()
 
 
-int lin_num = 1;//global for line numbers
-int num_trees = 0;//global for number of command trees
+// Line of the script being parsed, for error messages.  Each thread
+// has its own, so threads can parse at the same time.
+static __thread int lin_num = 1;
+
+void set_parse_line(int line) {
+  lin_num = line;
+}
+
+// Add token to linked list
+static void add_token(token* to_add, token_list_t* head);
+
+// Free memory allocated to linked list
+static void free_token_list(token_list_t head);
+
+// For debugging purposes
+static void print_token_list(token_list_t token_list);
+
+// Constructor
+static void initialize_stream(command_stream_t m_command_stream);
+
+static command_t traverse(command_stream_t cStream);
+
+// For debugging
+static void print_stream(command_stream_t cStream);
+
+// Constructor
+static stack2_t init_stack();
+
+// Add command onto stack
+static void push(command_t to_add, stack2_t stack);
+
+// Remove and return top command of stack
+static command_t pop(stack2_t stack);
+
+// Return top command on stack
+static command_t peek(stack2_t stack);
+
+// Check if stack is empty
+static bool isEmpty(stack2_t stack);
+
+// Free all memory allocated to stack
+static void free_stack(stack2_t stack);
+
+// Print out contents of stack
+static void print_stack(stack2_t stack);
+
+// Testing Data Structure
+static void test_stack();
+
+// Checks if passed in character matches characters allowed by the spec
+static bool is_valid_char(char character);
+
+// Reads input file into a buffer while parsing out the comments
+static char* read_file_into_buffer(int (*get_next_byte) (void *), void *get_next_byte_argument);
+
+// Creates a linked list of tokens given an input buffer.  Sets *OK to
+// false, with a message on stderr, if the buffer holds a bad character.
+static token_list_t convert_to_tokens(char* buffer, bool* ok);
+
+// Checks passed in token_list to verify that token ordering is syntactically valid.
+// Returns false, with a message on stderr, if it is not.
+static bool check_token_list(token_list_t token_list);
+
+// Returns true if the type is an operator
+static bool is_operator(int type);
+
+// Returns the precendence of a passed in operator
+static int get_precedence(int type);
+
+// Takes token list and creates a command stream with no depth
+static command_stream_t make_basic_stream(token_list_t tList);
+
+// Handles different newline cases
+static command_stream_t solve_newlines(command_stream_t nlStream);
+
+// Takes a simple command stream and turns it into a forest of command trees
+static command_stream_t make_advanced_stream(command_stream_t basic_stream);
 
 // Returns true if character is valid based on the spec
-bool is_valid_char(char character) {
+static bool is_valid_char(char character) {
   if(isalnum(character))
     return true;
 
@@ -38,7 +113,7 @@ bool is_valid_char(char character) {
 }
 
 // Returns precedence of operator
-int get_precedence(int type){
+static int get_precedence(int type){
   if(type == PIPE_COMMAND)
     return 3;
   if(type == AND_COMMAND || type == OR_COMMAND)
@@ -50,7 +125,7 @@ int get_precedence(int type){
 }
 
 // Returns true if the passed in enum/int is an operator
-bool is_operator(int type){
+static bool is_operator(int type){
   return (type == PIPE_COMMAND || type == AND_COMMAND || type == OR_COMMAND || type == SEQUENCE_COMMAND);
 }
 
@@ -71,7 +146,7 @@ struct token_list {
 };
 
 // Add token to linked list
-void add_token(token* to_add, token_list_t* head) {
+static void add_token(token* to_add, token_list_t* head) {
 
   // empty list
   if((*head) == NULL) {
@@ -131,7 +206,7 @@ void add_token(token* to_add, token_list_t* head) {
 // Print all tokens in list for the sake of debugging
 // Prints one out on each line in the following format:
 // Type: token_type Line Number: lin_num Words: "Words"
-void print_token_list(token_list_t token_list) {
+static void print_token_list(token_list_t token_list) {
 
   token_list_t ptr = token_list;
 
@@ -193,19 +268,15 @@ void print_token_list(token_list_t token_list) {
   return;
 }
 
-// Frees all tokens in a list
-void free_token_list(token_list_t head) {
-
-  token_list_t nxt_ptr = head->m_next;
-  token_list_t cur_ptr = head;
+// Frees all tokens in a list, with their words
+static void free_token_list(token_list_t head) {
 
-  while(nxt_ptr != NULL) {
-    free(cur_ptr);
-
-    cur_ptr = nxt_ptr;
-    nxt_ptr = nxt_ptr->m_next;
+  while(head != NULL) {
+    token_list_t nxt_ptr = head->m_next;
+    free(head->m_token.words);
+    free(head);
+    head = nxt_ptr;
   }
-  free(cur_ptr);
 }
 
 //////////////////////////////////////////////////////////////
@@ -224,8 +295,8 @@ struct stack {
 };
 
 // Initial stack constructor
-stack2_t init_stack() {
-  stack2_t stack = checked_malloc(sizeof(stack));
+static stack2_t init_stack() {
+  stack2_t stack = checked_malloc(sizeof(struct stack));
   stack->m_size = 0;
   stack->m_top = NULL;
 
@@ -233,7 +304,7 @@ stack2_t init_stack() {
 }
 
 // Pushes command onto given stack
-void push(command_t to_add, stack2_t stack){
+static void push(command_t to_add, stack2_t stack){
 
   st_node_t top_node;
 
@@ -273,7 +344,7 @@ void push(command_t to_add, stack2_t stack){
 }
 
 // Removes a command from the stack and returns it
-command_t pop(stack2_t stack) {
+static command_t pop(stack2_t stack) {
 
   // Grab command from top node
   st_node_t top_node = stack->m_top;
@@ -289,12 +360,12 @@ command_t pop(stack2_t stack) {
 }
 
 // Accessor Method to look at top of stack
-command_t peek(stack2_t stack) {
+static command_t peek(stack2_t stack) {
   return stack->m_top->m_data;
 }
 
 // Returns true if the stack is empty
-bool isEmpty(stack2_t stack) {
+static bool isEmpty(stack2_t stack) {
   if(stack->m_top == NULL)
     return true;
   else
@@ -302,7 +373,7 @@ bool isEmpty(stack2_t stack) {
 }
 
 // For debugging purposes
-void print_stack(stack2_t stack) {
+static void print_stack(stack2_t stack) {
 
   int MAX_SIZE = LEFT_PAREN_COMMAND;
   char* command_name = checked_malloc(sizeof(char) * MAX_SIZE);
@@ -343,7 +414,7 @@ void print_stack(stack2_t stack) {
 }
 
 // Test function 
-void test_stack() {
+static void test_stack() {
 
   stack2_t stack = init_stack();
   int i = 0;
@@ -364,7 +435,7 @@ void test_stack() {
 }
 
 // Frees allocated memory
-void free_stack(stack2_t stack) {
+static void free_stack(stack2_t stack) {
 
   int i = 0;
   for(; i < stack->m_size; i++) {
@@ -392,9 +463,17 @@ struct command_stream {
 };
 
 // Initial Constructor Method
-void initialize_stream(command_stream_t m_command_stream){
+static void initialize_stream(command_stream_t m_command_stream){
   m_command_stream->m_head = NULL;
   m_command_stream->m_curr = NULL;
+  m_command_stream->m_size = 0;
+}
+
+// Allocates and initializes an empty stream
+command_stream_t new_command_stream(void){
+  command_stream_t cStream = checked_malloc(sizeof(struct command_stream));
+  initialize_stream(cStream);
+  return cStream;
 }
 
 // Add command to the given linked list
@@ -427,7 +506,9 @@ void reset_traverse(command_stream_t cStream){
 
 // Returns current command pointed to by m_curr
 // Then iterates m_curr forward one
-command_t traverse(command_stream_t cStream){
+// The command is the stream's own, so status set on it by execution
+// is seen by every later reader of the stream
+static command_t traverse(command_stream_t cStream){
   if(cStream == NULL){
     fprintf(stderr, "NULL Command Stream");
     return NULL;
@@ -443,12 +524,7 @@ command_t traverse(command_stream_t cStream){
   
   // Iterate grab command and iterate m_curr
   else{
-    command_t cmd = checked_malloc(sizeof(struct command));
-    cmd->type = cStream->m_curr->m_dataptr->type;
-    cmd->status = cStream->m_curr->m_dataptr->status;
-    cmd->input = cStream->m_curr->m_dataptr->input;
-    cmd->output = cStream->m_curr->m_dataptr->output;
-    cmd->u = cStream->m_curr->m_dataptr->u;
+    command_t cmd = cStream->m_curr->m_dataptr;
     cStream->m_curr = cStream->m_curr->m_next;
     //fprintf(stderr, "Traverse output is: %d\n",cmd->type);
     return cmd;
@@ -460,7 +536,7 @@ command_t traverse(command_stream_t cStream){
 }
 
 // Dumps contents for debugging
-void  print_stream(command_stream_t cStream){
+static void  print_stream(command_stream_t cStream){
   if(cStream->m_head == NULL && cStream->m_curr == NULL){
     fprintf(stderr, "Command Stream Empty\n");
   }
@@ -474,19 +550,54 @@ void  print_stream(command_stream_t cStream){
   }
 }
 
-// Frees up allocated memory
-void free_stream(command_stream_t m_command_stream) {
-  int i = 0;
+// Frees up the list of a stream whose commands have been passed on.
+// With free_tokens, also frees the tokens parsing consumed: every
+// command but the simple ones, and the file name word after each
+// redirection, whose string now belongs to the redirected command.
+void free_stream(command_stream_t m_command_stream, bool free_tokens) {
   node_t cur_ptr = m_command_stream->m_head;
-  node_t next_ptr = cur_ptr->m_next;
 
   while (cur_ptr != NULL) {
-    free(cur_ptr->m_dataptr);
+    node_t next_ptr = cur_ptr->m_next;
+    command_t cmd = cur_ptr->m_dataptr;
+    if (free_tokens && (cmd->type == LEFT_ARROW_COMMAND ||
+                        cmd->type == RIGHT_ARROW_COMMAND) && next_ptr) {
+      free(next_ptr->m_dataptr->u.word);
+      free(next_ptr->m_dataptr);
+      free(cur_ptr);
+      cur_ptr = next_ptr;
+      next_ptr = cur_ptr->m_next;
+    }
+    if (free_tokens && cmd->type != SIMPLE_COMMAND)
+      free(cmd);
     free(cur_ptr);
-
     cur_ptr = next_ptr;
-    next_ptr = cur_ptr->m_next;
   }
+  free(m_command_stream);
+}
+
+// Frees a parsed tree: its nodes, word vectors and every string
+void free_command(command_t c) {
+  free(c->input);
+  free(c->output);
+  switch(c->type) {
+    case SIMPLE_COMMAND:
+    {
+      char** w = c->u.word;
+      for(; *w; w++)
+        free(*w);
+      free(c->u.word);
+    }
+      break;
+    case SUBSHELL_COMMAND:
+      free_command(c->u.subshell_command);
+      break;
+    default:
+      free_command(c->u.command[0]);
+      free_command(c->u.command[1]);
+      break;
+  }
+  free(c);
 }
 
 //////////////////////////////////////////////////////////
@@ -495,7 +606,7 @@ void free_stream(command_stream_t m_command_stream) {
 
 // Read file into buffer and preprocess the characters:
 // Comments removed
-char* read_file_into_buffer(int (*get_next_byte) (void *), void *get_next_byte_argument) 
+static char* read_file_into_buffer(int (*get_next_byte) (void *), void *get_next_byte_argument) 
 {
   size_t capacity = 1024; // arbitrary size
   size_t iter = 0;
@@ -550,7 +661,7 @@ char* read_file_into_buffer(int (*get_next_byte) (void *), void *get_next_byte_a
 
 // Converts input buffer into a linked list of tokens 
 // This helps to categorize the inputs
-token_list_t convert_to_tokens(char* buffer) {
+static token_list_t convert_to_tokens(char* buffer, bool* ok) {
 
   // list info
   token_list_t m_head = NULL;
@@ -565,6 +676,8 @@ token_list_t convert_to_tokens(char* buffer) {
   char current;
   char next;
 
+  *ok = true;
+
   // empty buffer case
   if(buffer[iter] == '\0')
     return NULL;
@@ -656,7 +769,10 @@ token_list_t convert_to_tokens(char* buffer) {
     // Print error message
     if (type == UNKNOWN) {
       fprintf(stderr, "Error: Line %i: Unknown Token -> %c \n", lin_num, current);
-      exit(1);
+      free(temp_token);
+      free_token_list(m_head);
+      *ok = false;
+      return NULL;
     }
     else if (type == WORD) {
       // Allocate memory for full string
@@ -675,6 +791,7 @@ token_list_t convert_to_tokens(char* buffer) {
       temp_token->words = NULL;
   
     add_token(temp_token, &m_head);
+    STAT_INC(STAT_TOKENS);
 
     free(temp_token);
     iter++;
@@ -684,12 +801,12 @@ token_list_t convert_to_tokens(char* buffer) {
 }
 
 // Checks passed in token_list to verify that token ordering is syntactically valid
-void check_token_list(token_list_t token_list) {
+static bool check_token_list(token_list_t token_list) {
 
   // Null pointer case
   if (token_list == NULL){
     fprintf(stderr, "Error: token_list is NULL");
-    exit(1);
+    return false;
   }
 
   token_list_t curr_ptr = token_list;
@@ -721,7 +838,7 @@ void check_token_list(token_list_t token_list) {
           // Consecutive semicolon case
           if (next_token.type == SEMICOLON) {
             fprintf(stderr, "Error: Line %i: Semicolons cannot appear consecutively", curr_token.lin_num);
-            exit(1);
+            return false;
           }
           // Semicolons are treated as newlines if not inside a subshell
           if (paren_count == 0) {
@@ -730,7 +847,7 @@ void check_token_list(token_list_t token_list) {
           // Cannot be first token to appear
           if (curr_ptr->m_prev == NULL) {
             fprintf(stderr, "Error: Line %i: Semicolons cannot be the first token to appear", curr_token.lin_num);
-            exit(1);
+            return false;
           }
         }
         // End of list
@@ -746,7 +863,7 @@ void check_token_list(token_list_t token_list) {
             // Newline Cannot be before IO Redirection
             if((prev_token.type == LEFT_ARROW) || (prev_token.type == RIGHT_ARROW)) {
               fprintf(stderr, "Error: Line %i: Newline cannot be before IO Redirection < >", curr_token.lin_num);
-              exit(1);
+              return false;
             }
             // break out of switch statement to continue iteration
             else if ((prev_token.type == AND) || (prev_token.type == OR) || (prev_token.type == PIPE) || (prev_token.type == SEMICOLON)) {
@@ -764,7 +881,7 @@ void check_token_list(token_list_t token_list) {
           }
           else {
             fprintf(stderr, "Error: Line %i: Newline can only be followed by file names and parenthesis", curr_token.lin_num);
-            exit(1);
+            return false;
           }
         }
         // end of list
@@ -773,7 +890,7 @@ void check_token_list(token_list_t token_list) {
         // IO redirection error testcase
         if ((prev_token.type == RIGHT_ARROW) || (prev_token.type == LEFT_ARROW)) {
           fprintf(stderr, "Error: Line %i: Newline cannot follow IO Redirection < >", curr_token.lin_num);
-          exit(1);
+          return false;
         }
         break;
 
@@ -783,11 +900,11 @@ void check_token_list(token_list_t token_list) {
       case RIGHT_ARROW:
         if((next_token.type != WORD) || (curr_ptr->m_next == NULL)) {
           fprintf(stderr, "Error: Line %i: IO Redirection must be followed by a word \n", curr_token.lin_num);
-          exit(1);
+          return false;
         }
 	if(prev == NULL) {
 	  fprintf(stderr, "Error: Line %i : IO Redirection must be surrounded by words", curr_token.lin_num);
-	  exit(1);
+	  return false;
 	}
         // Check to see if there is an existing file
         if(curr_token.type == LEFT_ARROW) {
@@ -816,7 +933,7 @@ void check_token_list(token_list_t token_list) {
       case OR:
         if(next_token.type == PIPE || prev == NULL) {
 	  fprintf(stderr, "Error: Line %i : Or operator must be surrounded by commands", curr_token.lin_num);
-	  exit(1);
+	  return false;
 	}
 	if(next_token.type == NEWLINE) {
 	  // Now iterate through next tokens until something other than newline seen
@@ -836,7 +953,7 @@ void check_token_list(token_list_t token_list) {
 	  }
 	  if(isEOF) {
 	    fprintf(stderr, "Error: Line %i : End of file reached after operator", curr_token.lin_num);
-	    exit(1);
+	    return false;
 	  }
 	}
 	break;
@@ -844,14 +961,14 @@ void check_token_list(token_list_t token_list) {
       case AND:
 	if(prev == NULL) {
 	  fprintf(stderr, "Error: Line %i : And operator must be surrounded by commands",curr_token.lin_num);
-	  exit(1);
+	  return false;
 	}
 	break;
 
       case PIPE:
 	if(prev == NULL) {
 	  fprintf(stderr, "Error: Line %i : Pipe operator must be surrounded by commands", curr_token.lin_num);
-	  exit(1);
+	  return false;
 	}
 	break;
 
@@ -867,8 +984,9 @@ void check_token_list(token_list_t token_list) {
   // not equal amount of parenthesis
   if(paren_count != 0) {
     fprintf(stderr, "Error: Missing an accompanying right parenthesis");
-    exit(1);
+    return false;
   }
+  return true;
 }
 
 // Initializes a command and returns it
@@ -877,6 +995,7 @@ command_t form_basic_command(int type){
   command_t cmd = checked_malloc(sizeof(struct command));
   cmd->type = type;
   cmd->status = -1;
+  cmd->pid = 0;
   cmd->input = NULL;
   cmd->output = NULL;
 
@@ -899,7 +1018,7 @@ command_t form_basic_command(int type){
 }
 
 // Creates a simple linked list of commands with no depth
-command_stream_t make_basic_stream(token_list_t tList){
+static command_stream_t make_basic_stream(token_list_t tList){
 
   // Allocate memory
   command_stream_t cStream = checked_malloc(sizeof(struct command_stream));
@@ -916,6 +1035,7 @@ command_stream_t make_basic_stream(token_list_t tList){
       	command_t cmd = checked_malloc(sizeof(struct command));
       	cmd->type = SIMPLE_COMMAND;
       	cmd->status = -1;
+      	cmd->pid = 0;
       	cmd->input = NULL;
       	cmd->output = NULL;
       	int num_words = 1;
@@ -928,7 +1048,7 @@ command_stream_t make_basic_stream(token_list_t tList){
       	  if(wordPtr->m_next == NULL){break;}
       	}
             
-      	cmd->u.word = (char**)checked_malloc((num_words+1));
+      	cmd->u.word = (char**)checked_malloc(sizeof(char*) * (num_words+1));
             
       	int ii = 0;
       	for(; ii < num_words; ii++){
@@ -1033,7 +1153,7 @@ command_stream_t make_basic_stream(token_list_t tList){
 
 // Handles newlines cases given a simple command list
 // Receives output of make_basic_stream
-command_stream_t solve_newlines(command_stream_t nlStream) {
+static command_stream_t solve_newlines(command_stream_t nlStream) {
   //print_stream(nlStream);
   command_stream_t cStream = checked_malloc(sizeof(struct command_stream));
   initialize_stream(cStream);
@@ -1108,7 +1228,7 @@ command_stream_t solve_newlines(command_stream_t nlStream) {
 }
 
 // Perhaps a way to deal with subshells
-command_stream_t make_advanced_stream(command_stream_t basic_stream) {
+static command_stream_t make_advanced_stream(command_stream_t basic_stream) {
   //print_stream(basic_stream);
   //print_stream(basic_stream);
 
@@ -1147,6 +1267,7 @@ command_stream_t make_advanced_stream(command_stream_t basic_stream) {
 	new_com->type = op->type;
 	   
 	new_com->status = -1;
+	new_com->pid = 0;
 	new_com->input = NULL;
 	new_com->output = NULL;
 	new_com->u.command[0] = com1;
@@ -1164,6 +1285,7 @@ command_stream_t make_advanced_stream(command_stream_t basic_stream) {
       command_t subshell_com = checked_malloc(sizeof(struct command));
       subshell_com->type = SUBSHELL_COMMAND;
       subshell_com->status = -1;
+      subshell_com->pid = 0;
       subshell_com->input = NULL;
       subshell_com->output = NULL;
       subshell_com->u.subshell_command = sub_com;
@@ -1188,6 +1310,7 @@ command_stream_t make_advanced_stream(command_stream_t basic_stream) {
       	  new_com->type = op->type;
       	  
       	  new_com->status = -1;//maybe change later
+      	  new_com->pid = 0;
       	  new_com->input = NULL;
       	  new_com->output = NULL;
       	  new_com->u.command[0] = com1;
@@ -1228,6 +1351,7 @@ command_stream_t make_advanced_stream(command_stream_t basic_stream) {
       	new_com->type = op->type;
       	  
       	new_com->status = -1;//maybe change later
+      	new_com->pid = 0;
       	new_com->input = NULL;
       	new_com->output = NULL;
       	new_com->u.command[0] = com1;
@@ -1237,7 +1361,7 @@ command_stream_t make_advanced_stream(command_stream_t basic_stream) {
 
       finish_up = false;
       add_command(pop(com_stack),cStream);
-      num_trees++;
+      STAT_INC(STAT_TREES);
     }
     cmd = traverse(basic_stream);
   }
@@ -1251,6 +1375,7 @@ command_stream_t make_advanced_stream(command_stream_t basic_stream) {
     new_com->type = op->type;
     
     new_com->status = -1;//maybe change later
+    new_com->pid = 0;
     new_com->input = NULL;
     new_com->output = NULL;
     new_com->u.command[0] = com1;
@@ -1261,11 +1386,12 @@ command_stream_t make_advanced_stream(command_stream_t basic_stream) {
   // Reached end of stream
   // Pop the command_t into the command stream
   add_command(pop(com_stack),cStream);
-  num_trees++;
+  STAT_INC(STAT_TREES);
+  free(com_stack);
+  free(op_stack);
   reset_traverse(cStream);//Ensures proper function of read_command_stream
   //print_stream(cStream);
   
-  //fprintf(stderr, "Number of command trees is: %d\n",num_trees);
   return cStream;
 }
 
@@ -1277,20 +1403,41 @@ make_command_stream (int (*get_next_byte) (void *),
   char* buffer = read_file_into_buffer(get_next_byte, get_next_byte_argument);
 
   // Takes input buffer and creates a linked list of catagorized "tokens"
-  token_list_t token_list = convert_to_tokens(buffer);
+  bool ok;
+  token_list_t token_list = convert_to_tokens(buffer, &ok);
 
   // Null list checking
   if(token_list == NULL) {
-    fprintf(stderr, "Error: No commands found in file\n");
-    exit(1);
+    if (ok)
+      fprintf(stderr, "Error: No commands found in file\n");
+    free(buffer);
     return NULL;
   }
   
   // Check the list of tokens for syntax and ordering
-  check_token_list(token_list);
+  if(!check_token_list(token_list)) {
+    free_token_list(token_list);
+    free(buffer);
+    return NULL;
+  }
 
   // Take use linked list of tokens to make a command stream
-  return make_advanced_stream(solve_newlines(make_basic_stream(token_list)));
+  free(buffer);
+  command_stream_t basic_stream = make_basic_stream(token_list);
+  free_token_list(token_list);
+  command_stream_t nl_stream = solve_newlines(basic_stream);
+
+  // Everything but the newlines moved on into the newline stream
+  command_t cmd;
+  reset_traverse(basic_stream);
+  while((cmd = traverse(basic_stream)))
+    if(cmd->type == NEWLINE_COMMAND)
+      free(cmd);
+  free_stream(basic_stream, false);
+
+  command_stream_t cStream = make_advanced_stream(nl_stream);
+  free_stream(nl_stream, true);
+  return cStream;
 }
 
 command_t
@@ -0,0 +1,305 @@
+// UCLA CS 111 Lab 1 per-command resource accounting
+
+#include "command.h"
+#include "command-internals.h"
+#include "alloc.h"
+
+#include <errno.h>
+#include <error.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <time.h>
+
+// Every command in the script gets a record in a table shared with all
+// processes forked afterwards, so whichever process reaps a command
+// with wait4 can store its usage where the report will find it.  The
+// table is filled in before anything runs and only the values change
+// later, each record by the one process that reaps its command.
+//
+// Trees that arrive later, from a worker or a served client, are added
+// as they are about to run, by the process that will fork them.  A
+// tree's record is the usage of the process that ran it under -t or on
+// a worker, and otherwise everything its commands used while it ran.
+
+struct record {
+  command_t cmd;
+  int tree;
+  bool isTree;
+  bool done;
+  double wall;
+  struct rusage ru;
+};
+
+// Each thread accounts for the run it is doing
+static __thread struct record* table = NULL;
+static __thread size_t tableSize;  // A power of two
+static __thread int numTrees;
+static __thread struct record** trees;  // By tree index, once added
+static __thread double runStart;
+static __thread struct rusage childrenAtStart;
+
+// For accounting_start_tree
+static __thread double treeStart;
+static __thread struct rusage treeBefore;
+
+bool accounting(void)
+{
+  return table != NULL;
+}
+
+double accounting_now(void)
+{
+  if (table == NULL)
+    return 0;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static double seconds(struct timeval tv)
+{
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static double cpuTime(struct rusage const* ru)
+{
+  return seconds(ru->ru_utime) + seconds(ru->ru_stime);
+}
+
+static void addTime(struct timeval* sum, struct timeval tv, int sign)
+{
+  long usec = sum->tv_usec + sign * tv.tv_usec;
+  sum->tv_sec += sign * tv.tv_sec + usec / 1000000;
+  sum->tv_usec = usec % 1000000;
+  if (sum->tv_usec < 0) {
+    sum->tv_usec += 1000000;
+    sum->tv_sec--;
+  }
+}
+
+// Adds (or with SIGN -1 subtracts) RU into SUM.  Peak RSS is a
+// maximum, not a total, and is kept as one.
+static void combine(struct rusage* sum, struct rusage const* ru, int sign)
+{
+  addTime(&sum->ru_utime, ru->ru_utime, sign);
+  addTime(&sum->ru_stime, ru->ru_stime, sign);
+  if (ru->ru_maxrss > sum->ru_maxrss)
+    sum->ru_maxrss = ru->ru_maxrss;
+  sum->ru_minflt += sign * ru->ru_minflt;
+  sum->ru_majflt += sign * ru->ru_majflt;
+  sum->ru_inblock += sign * ru->ru_inblock;
+  sum->ru_oublock += sign * ru->ru_oublock;
+  sum->ru_nvcsw += sign * ru->ru_nvcsw;
+  sum->ru_nivcsw += sign * ru->ru_nivcsw;
+}
+
+void rusage_add(struct rusage* sum, struct rusage const* ru)
+{
+  combine(sum, ru, 1);
+}
+
+static struct record* findRecord(command_t c)
+{
+  size_t i = ((size_t) c >> 4) & (tableSize - 1);
+  while (table[i].cmd != NULL && table[i].cmd != c)
+    i = (i + 1) & (tableSize - 1);
+  return &table[i];
+}
+
+static int countCommands(command_t c)
+{
+  switch (c->type) {
+  case SIMPLE_COMMAND:
+    return 1;
+  case SUBSHELL_COMMAND:
+    return 1 + countCommands(c->u.subshell_command);
+  default:
+    return 1 + countCommands(c->u.command[0]) + countCommands(c->u.command[1]);
+  }
+}
+
+static void addCommands(command_t c, int tree)
+{
+  struct record* r = findRecord(c);
+  r->cmd = c;
+  r->tree = tree;
+  if (c->type == SUBSHELL_COMMAND)
+    addCommands(c->u.subshell_command, tree);
+  else if (c->type != SIMPLE_COMMAND) {
+    addCommands(c->u.command[0], tree);
+    addCommands(c->u.command[1], tree);
+  }
+}
+
+void start_accounting(command_stream_t s)
+{
+  int numCommands = 0;
+  numTrees = 0;
+  command_t c;
+  while ((c = read_command_stream(s))) {
+    numCommands += countCommands(c);
+    numTrees++;
+  }
+  reset_traverse(s);
+
+  tableSize = 16;
+  while (tableSize < 2 * (size_t) numCommands)
+    tableSize *= 2;
+  table = mmap(NULL, tableSize * sizeof(struct record), PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (table == MAP_FAILED)
+    error(1, errno, "mmap");
+  memset(table, 0, tableSize * sizeof(struct record));
+
+  trees = checked_malloc((numTrees + 1) * sizeof(struct record*));
+  int i = 0;
+  while ((c = read_command_stream(s))) {
+    addCommands(c, i);
+    accounting_add_tree(i++, c);
+  }
+  reset_traverse(s);
+
+  getrusage(RUSAGE_CHILDREN, &childrenAtStart);
+  runStart = accounting_now();
+}
+
+void account_command(command_t c, struct rusage const* ru, double start)
+{
+  if (table == NULL)
+    return;
+  struct record* r = findRecord(c);
+  if (r->cmd == NULL)
+    return;
+  r->ru = *ru;
+  r->wall = accounting_now() - start;
+  r->done = true;
+}
+
+void accounting_add_tree(int tree, command_t c)
+{
+  if (table == NULL || tree >= numTrees)
+    return;
+  struct record* r = findRecord(c);
+  r->cmd = c;
+  r->tree = tree;
+  r->isTree = true;
+  trees[tree] = r;
+}
+
+void accounting_start_tree(int tree, command_t c)
+{
+  if (table == NULL)
+    return;
+  accounting_add_tree(tree, c);
+  getrusage(RUSAGE_CHILDREN, &treeBefore);
+  treeStart = accounting_now();
+}
+
+void accounting_end_tree(command_t c)
+{
+  if (table == NULL || findRecord(c)->done)
+    return;
+  struct rusage ru;
+  getrusage(RUSAGE_CHILDREN, &ru);
+  combine(&ru, &treeBefore, -1);
+  ru.ru_maxrss = 0;
+  account_command(c, &ru, treeStart);
+}
+
+void stop_accounting(void)
+{
+  if (table == NULL)
+    return;
+  munmap(table, tableSize * sizeof(struct record));
+  table = NULL;
+  free(trees);
+}
+
+static int byCpu(void const* a, void const* b)
+{
+  double x = cpuTime(&(*(struct record* const*) a)->ru);
+  double y = cpuTime(&(*(struct record* const*) b)->ru);
+  return (x < y) - (x > y);
+}
+
+static void printRecords(struct record** recs, int n, int top, char const* what)
+{
+  qsort(recs, n, sizeof(struct record*), byCpu);
+  if (top > n)
+    top = n;
+  fprintf(stderr, "top %d of %d %s by CPU time:\n", top, n, what);
+  fprintf(stderr, "%5s %8s %8s %8s %8s %9s %8s %6s %7s %7s %7s %7s  %s\n",
+          "tree", "wall", "cpu", "user", "sys", "maxrss-kB", "minflt", "majflt",
+          "vcsw", "ivcsw", "inblk", "oublk", "command");
+  int i = 0;
+  for (; i < top; i++) {
+    struct record* r = recs[i];
+    char text[41];
+    command_text(r->cmd, text, sizeof text);
+    fprintf(stderr, "%5d %8.3f %8.3f %8.3f %8.3f %9ld %8ld %6ld %7ld %7ld %7ld %7ld  %s\n",
+            r->tree, r->wall, cpuTime(&r->ru), seconds(r->ru.ru_utime),
+            seconds(r->ru.ru_stime), r->ru.ru_maxrss, r->ru.ru_minflt,
+            r->ru.ru_majflt, r->ru.ru_nvcsw, r->ru.ru_nivcsw, r->ru.ru_inblock,
+            r->ru.ru_oublock, text);
+  }
+}
+
+void report_accounting(int top)
+{
+  if (table == NULL)
+    return;
+  double wall = accounting_now() - runStart;
+
+  struct record** recs = checked_malloc(tableSize * sizeof(struct record*));
+  int numRecs = 0;
+  size_t i = 0;
+  for (; i < tableSize; i++) {
+    if (table[i].done && table[i].cmd->type == SIMPLE_COMMAND)
+      recs[numRecs++] = &table[i];
+  }
+  // Commands run by pre-forked helpers or remote workers are only
+  // known by their trees
+  if (numRecs)
+    printRecords(recs, numRecs, top, "commands");
+
+  // A tree's peak RSS is that of its biggest command
+  for (i = 0; i < tableSize; i++) {
+    struct record* t = trees[table[i].tree];
+    if (table[i].done && !table[i].isTree && t) {
+      if (table[i].ru.ru_maxrss > t->ru.ru_maxrss)
+        t->ru.ru_maxrss = table[i].ru.ru_maxrss;
+    }
+  }
+  struct rusage total;
+  memset(&total, 0, sizeof total);
+  bool allTrees = true;
+  numRecs = 0;
+  int t = 0;
+  for (; t < numTrees; t++) {
+    struct record* r = trees[t];
+    if (r == NULL || !r->done) {
+      allTrees = false;
+      continue;
+    }
+    rusage_add(&total, &r->ru);
+    recs[numRecs++] = r;
+  }
+  if (numRecs)
+    printRecords(recs, numRecs, top, "trees");
+  free(recs);
+
+  // Trees run on remote workers are not our children, so their usage
+  // only shows up in their records
+  if (!allTrees) {
+    getrusage(RUSAGE_CHILDREN, &total);
+    combine(&total, &childrenAtStart, -1);
+  }
+  double cpu = cpuTime(&total);
+  fprintf(stderr, "total: wall %.3fs, cpu %.3fs (user %.3fs, sys %.3fs), "
+          "peak RSS %ld kB, effective parallelism %.2f\n",
+          wall, cpu, seconds(total.ru_utime), seconds(total.ru_stime),
+          total.ru_maxrss, wall > 0 ? cpu / wall : 0.0);
+}
@@ -0,0 +1,332 @@
+// UCLA CS 111 Lab 1 command serialization
+
+#include "command.h"
+#include "command-internals.h"
+#include "alloc.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// A command tree is written in pre-order.  Every node starts with its
+// type, input and output; simple commands then carry their word count
+// and words, subshells their inner command, and the other types their
+// two children.  Integers are native-endian ints, strings are a length
+// (-1 for NULL) followed by the bytes without a terminator.
+
+/////////////////////////////////////////////////
+///////////////  Writing           //////////////
+/////////////////////////////////////////////////
+
+struct wire {
+  char* data;
+  size_t size;
+  size_t cap;
+};
+
+static void put_bytes(struct wire* w, void const* p, size_t n)
+{
+  while (w->size + n > w->cap)
+    w->data = checked_grow_alloc(w->data, &w->cap);
+  memcpy(w->data + w->size, p, n);
+  w->size += n;
+}
+
+static void put_int(struct wire* w, int i)
+{
+  put_bytes(w, &i, sizeof(int));
+}
+
+static void put_string(struct wire* w, char const* s)
+{
+  if (s == NULL) {
+    put_int(w, -1);
+    return;
+  }
+  int len = strlen(s);
+  put_int(w, len);
+  put_bytes(w, s, len);
+}
+
+static void put_command(struct wire* w, command_t c)
+{
+  put_int(w, c->type);
+  put_string(w, c->input);
+  put_string(w, c->output);
+  switch(c->type) {
+  case SIMPLE_COMMAND:
+    {
+      int n = 0;
+      while (c->u.word[n] != NULL)
+	n++;
+      put_int(w, n);
+      int i = 0;
+      for (; i < n; i++)
+	put_string(w, c->u.word[i]);
+    }
+    break;
+  case SUBSHELL_COMMAND:
+    put_command(w, c->u.subshell_command);
+    break;
+  default:
+    put_command(w, c->u.command[0]);
+    put_command(w, c->u.command[1]);
+    break;
+  }
+}
+
+char* serialize_command(command_t c, size_t* len)
+{
+  struct wire w;
+  w.cap = 256;
+  w.size = 0;
+  w.data = checked_malloc(w.cap);
+  put_command(&w, c);
+  *len = w.size;
+  return w.data;
+}
+
+/////////////////////////////////////////////////
+///////////////  Reading           //////////////
+/////////////////////////////////////////////////
+
+struct cursor {
+  char const* p;
+  char const* end;
+  bool bad; // Set once the input turns out to be truncated or malformed
+};
+
+static int get_int(struct cursor* r)
+{
+  int i = 0;
+  if (r->bad || (size_t) (r->end - r->p) < sizeof(int)) {
+    r->bad = true;
+    return 0;
+  }
+  memcpy(&i, r->p, sizeof(int));
+  r->p += sizeof(int);
+  return i;
+}
+
+static char* get_string(struct cursor* r)
+{
+  int len = get_int(r);
+  if (r->bad || len < 0)
+    return NULL;
+  if (r->end - r->p < len) {
+    r->bad = true;
+    return NULL;
+  }
+  char* s = checked_malloc(len + 1);
+  memcpy(s, r->p, len);
+  s[len] = '\0';
+  r->p += len;
+  return s;
+}
+
+static command_t get_command(struct cursor* r, int depth)
+{
+  int type = get_int(r);
+  if (r->bad || type < AND_COMMAND || type > SUBSHELL_COMMAND || depth > 10000) {
+    r->bad = true;
+    return NULL;
+  }
+  command_t c = form_basic_command(type);
+  c->input = get_string(r);
+  c->output = get_string(r);
+  switch(type) {
+  case SIMPLE_COMMAND:
+    {
+      int n = get_int(r);
+      if (r->bad || n <= 0 || n > r->end - r->p) {
+	r->bad = true;
+	return NULL;
+      }
+      c->u.word = checked_malloc(sizeof(char*) * (n + 1));
+      int i = 0;
+      for (; i < n; i++) {
+	c->u.word[i] = get_string(r);
+	if (c->u.word[i] == NULL) {
+	  r->bad = true;
+	  return NULL;
+	}
+      }
+      c->u.word[n] = NULL;
+    }
+    break;
+  case SUBSHELL_COMMAND:
+    c->u.subshell_command = get_command(r, depth + 1);
+    break;
+  default:
+    c->u.command[0] = get_command(r, depth + 1);
+    c->u.command[1] = get_command(r, depth + 1);
+    break;
+  }
+  return r->bad ? NULL : c;
+}
+
+command_t deserialize_command(char const* buf, size_t len)
+{
+  struct cursor r;
+  r.p = buf;
+  r.end = buf + len;
+  r.bad = false;
+  command_t c = get_command(&r, 0);
+  if (r.bad || r.p != r.end)
+    return NULL;
+  return c;
+}
+
+// A job is a tree followed by its read list and write list, each a
+// count and that many strings
+
+static void put_list(struct wire* w, char** list)
+{
+  int n = 0;
+  while (list[n] != NULL)
+    n++;
+  put_int(w, n);
+  int i = 0;
+  for (; i < n; i++)
+    put_string(w, list[i]);
+}
+
+char* serialize_job(command_t c, char** read_list, char** write_list, size_t* len)
+{
+  struct wire w;
+  w.cap = 256;
+  w.size = 0;
+  w.data = checked_malloc(w.cap);
+  put_command(&w, c);
+  put_list(&w, read_list);
+  put_list(&w, write_list);
+  *len = w.size;
+  return w.data;
+}
+
+static char** get_list(struct cursor* r)
+{
+  int n = get_int(r);
+  if (r->bad || n < 0 || n > r->end - r->p) {
+    r->bad = true;
+    return NULL;
+  }
+  char** list = checked_malloc(sizeof(char*) * (n + 1));
+  int i = 0;
+  for (; i < n; i++) {
+    list[i] = get_string(r);
+    if (list[i] == NULL) {
+      r->bad = true;
+      free_job_list(list);
+      return NULL;
+    }
+  }
+  list[n] = NULL;
+  return list;
+}
+
+void free_job_list(char** list)
+{
+  if (list == NULL)
+    return;
+  int i = 0;
+  for (; list[i] != NULL; i++)
+    free(list[i]);
+  free(list);
+}
+
+command_t deserialize_job(char const* buf, size_t len,
+			  char*** read_list, char*** write_list)
+{
+  struct cursor r;
+  r.p = buf;
+  r.end = buf + len;
+  r.bad = false;
+  command_t c = get_command(&r, 0);
+  *read_list = get_list(&r);
+  *write_list = get_list(&r);
+  if (r.bad || r.p != r.end) {
+    if (c)
+      free_command(c);
+    free_job_list(*read_list);
+    free_job_list(*write_list);
+    *read_list = *write_list = NULL;
+    return NULL;
+  }
+  return c;
+}
+
+/////////////////////////////////////////////////
+///////////////  Messages          //////////////
+/////////////////////////////////////////////////
+
+// Uses send with MSG_NOSIGNAL where possible, so that a worker going
+// away shows up as an error instead of a SIGPIPE
+static bool write_all(int fd, char const* p, size_t n)
+{
+  while (n > 0) {
+    ssize_t w = send(fd, p, n, MSG_NOSIGNAL);
+    if (w < 0 && errno == ENOTSOCK)
+      w = write(fd, p, n);
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w <= 0)
+      return false;
+    p += w;
+    n -= w;
+  }
+  return true;
+}
+
+static bool read_all(int fd, char* p, size_t n)
+{
+  while (n > 0) {
+    ssize_t r = read(fd, p, n);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return false;
+    p += r;
+    n -= r;
+  }
+  return true;
+}
+
+// The header and payload go out in a single write so that processes
+// sharing one socket never interleave their messages.
+bool send_message(int fd, int type, int index, int status,
+		  char const* payload, size_t len)
+{
+  struct message m;
+  m.type = type;
+  m.index = index;
+  m.status = status;
+  m.len = len;
+  char* buf = checked_malloc(sizeof m + len);
+  memcpy(buf, &m, sizeof m);
+  if (len)
+    memcpy(buf + sizeof m, payload, len);
+  bool ok = write_all(fd, buf, sizeof m + len);
+  free(buf);
+  return ok;
+}
+
+bool recv_message(int fd, struct message* m, char** payload)
+{
+  *payload = NULL;
+  if (!read_all(fd, (char*) m, sizeof *m))
+    return false;
+  if (m->len == 0)
+    return true;
+  if (m->len > MAX_MESSAGE_SIZE)
+    return false;
+  *payload = checked_malloc(m->len);
+  if (!read_all(fd, *payload, m->len)) {
+    free(*payload);
+    *payload = NULL;
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,487 @@
+// UCLA CS 111 Lab 1 long-running service mode
+
+#define _GNU_SOURCE // for accept4
+
+#include "command.h"
+#include "alloc.h"
+
+#include <errno.h>
+#include <error.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// timetrash --serve=SOCKET stays resident and runs scripts for clients
+// connecting to a Unix domain socket.  A request is a few text lines,
+// sent along with the client's stdin, stdout and stderr (SCM_RIGHTS),
+// and ended by shutting down the writing side:
+//
+//   CWD <directory>      optional; relative paths are taken from here
+//   RUN <script path>    or
+//   SCRIPT               followed by the script text itself
+//
+// The reply is "STATUS <n>\n".  Parsed scripts are cached by path,
+// modification time and size (or by content hash for SCRIPT requests),
+// and the commands they name are looked up in PATH once.  Every request
+// runs in a forked runner, and all runners share one job server, so -j
+// limits the number of running graph nodes across all clients.  The
+// server itself only reads requests, parses and forks, without waiting
+// on any one client, so requests arriving together are served
+// together.
+
+#define MAX_FDS 3
+
+struct cached_script {
+  char* key;
+  command_stream_t stream;
+  int num_trees;
+  struct cached_script* next;
+};
+
+static struct cached_script* cache;
+
+static int
+send_reply (int fd, int status)
+{
+  char reply[32];
+  int len = sprintf (reply, "STATUS %d\n", status);
+  return send (fd, reply, len, MSG_NOSIGNAL) == len;
+}
+
+// A connection whose request is still arriving.  Requests are read
+// without blocking, a piece whenever one comes in, so a slow or idle
+// client holds up nobody else; one that takes longer than
+// REQUEST_TIMEOUT seconds is dropped.
+struct pending
+{
+  int fd;
+  char *buf;
+  size_t len;
+  size_t cap;
+  int fds[MAX_FDS];  // Passed along with the request
+  int nfds;
+  time_t deadline;
+};
+
+#define REQUEST_TIMEOUT 10
+
+// Closes P and marks it dropped
+static void
+drop_pending (struct pending *p)
+{
+  if (p->fd < 0)
+    return;
+  int i;
+  for (i = 0; i < p->nfds; i++)
+    close (p->fds[i]);
+  close (p->fd);
+  free (p->buf);
+  p->fd = -1;
+}
+
+// Reads what has arrived of P's request, collecting any file
+// descriptors passed along with it.  Returns 1 once the client has
+// finished sending, leaving the request NUL-terminated in P->buf, 0 if
+// more is to come, and -1 on an error.
+static int
+read_pending (struct pending *p)
+{
+  for (;;)
+    {
+      if (p->len + 1 == p->cap)
+	{
+	  if (p->cap >= MAX_MESSAGE_SIZE)
+	    break;
+	  p->buf = checked_grow_alloc (p->buf, &p->cap);
+	}
+      struct iovec iov;
+      iov.iov_base = p->buf + p->len;
+      iov.iov_len = p->cap - 1 - p->len;
+      union
+      {
+	char space[CMSG_SPACE (MAX_FDS * sizeof (int))];
+	struct cmsghdr align;
+      } control;
+      struct msghdr msg;
+      memset (&msg, 0, sizeof msg);
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = control.space;
+      msg.msg_controllen = sizeof control.space;
+      ssize_t n = recvmsg (p->fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+      if (n < 0)
+	return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR
+	  ? 0 : -1;
+      struct cmsghdr *cmsg = CMSG_FIRSTHDR (&msg);
+      for (; cmsg; cmsg = CMSG_NXTHDR (&msg, cmsg))
+	if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+	  {
+	    int *passed = (int *) CMSG_DATA (cmsg);
+	    int num = (cmsg->cmsg_len - CMSG_LEN (0)) / sizeof (int);
+	    int i;
+	    for (i = 0; i < num; i++)
+	      {
+		if (p->nfds < MAX_FDS)
+		  p->fds[p->nfds++] = passed[i];
+		else
+		  close (passed[i]);
+	      }
+	  }
+      if (n == 0)
+	break;
+      p->len += n;
+    }
+  p->buf[p->len] = '\0';
+  return 1;
+}
+
+static struct cached_script *
+find_cached (char const *key)
+{
+  struct cached_script *c = cache;
+  for (; c; c = c->next)
+    if (strcmp (c->key, key) == 0)
+      return c;
+  return NULL;
+}
+
+// Returns the cached parse for KEY, parsing F (or NAME) on a miss.
+// Returns NULL if the script does not parse.
+static struct cached_script *
+get_script (char const *key, char const *name, FILE *f)
+{
+  struct cached_script *c = find_cached (key);
+  if (c)
+    return c;
+
+  struct script s;
+  s.name = name;
+  s.file = f;
+  if (! parse_script (&s))
+    return NULL;
+
+  c = checked_malloc (sizeof *c);
+  c->key = strdup (key);
+  c->stream = s.stream;
+  c->num_trees = s.num_trees;
+  c->next = cache;
+  cache = c;
+
+  command_t command;
+  while ((command = read_command_stream (c->stream)))
+    warm_path_cache (command);
+  reset_traverse (c->stream);
+  return c;
+}
+
+static int
+run_stream (struct cached_script *c, int time_travel, int rename_outputs)
+{
+  int status = 0;
+  reset_traverse (c->stream);
+  if (time_travel)
+    {
+      command_graph_t cg = create_graph_nodes (c->stream);
+      if (rename_outputs)
+	createOutputVersions (cg);
+      createDependencies (cg);
+      status = execute_commands (cg)
+	       ? graph_node_status (cg, c->num_trees - 1) : 1;
+      free_command_graph (cg);
+      return status;
+    }
+  command_t command;
+  while ((command = read_command_stream (c->stream)))
+    {
+      acquireJobToken (true);
+      execute_command (command, 0);
+      releaseJobToken ();
+      status = command_status (command);
+    }
+  return status;
+}
+
+// Runs the request read into P.  The runner forked for it closes the
+// listener and the NUM_PENDING connections in PENDING still arriving,
+// so that their clients see the end of their replies as soon as their
+// own runners finish.
+static void
+handle_client (int listener, struct pending *p, struct pending *pending,
+	       int num_pending, int time_travel, int rename_outputs)
+{
+  int fd = p->fd;
+  int *fds = p->fds;
+  int nfds = p->nfds;
+  size_t len = p->len;
+  char *req = p->buf;
+
+  char *cwd = NULL;
+  char *line = req;
+  if (strncmp (line, "CWD ", 4) == 0)
+    {
+      cwd = line + 4;
+      line = strchr (line, '\n');
+      if (! line)
+	goto bad_request;
+      *line++ = '\0';
+    }
+
+  // Errors while parsing go to the client too
+  int saved_stderr = -1;
+  if (nfds == MAX_FDS)
+    {
+      saved_stderr = dup (2);
+      dup2 (fds[2], 2);
+    }
+
+  struct cached_script *script = NULL;
+  char key[64];
+  if (strncmp (line, "RUN ", 4) == 0)
+    {
+      char *path = line + 4;
+      char *nl = strchr (path, '\n');
+      if (nl)
+	*nl = '\0';
+      char *full = path;
+      if (path[0] != '/' && cwd)
+	{
+	  full = checked_malloc (strlen (cwd) + strlen (path) + 2);
+	  sprintf (full, "%s/%s", cwd, path);
+	}
+      struct stat st;
+      if (stat (full, &st) != 0)
+	error (0, errno, "%s", path);
+      else
+	{
+	  char *pkey = checked_malloc (strlen (full) + 64);
+	  sprintf (pkey, "P%s:%ld.%09ld:%lld", full, (long) st.st_mtim.tv_sec,
+		   (long) st.st_mtim.tv_nsec, (long long) st.st_size);
+	  script = get_script (pkey, full, NULL);
+	  free (pkey);
+	}
+      if (full != path)
+	free (full);
+    }
+  else if (strncmp (line, "SCRIPT\n", 7) == 0)
+    {
+      char *body = line + 7;
+      size_t body_len = req + len - body;
+      unsigned long long h = 14695981039346656037ULL;
+      size_t i = 0;
+      for (; i < body_len; i++)
+	h = (h ^ (unsigned char) body[i]) * 1099511628211ULL;
+      sprintf (key, "B%016llx:%zu", h, body_len);
+      FILE *f = fmemopen (body, body_len, "r");
+      if (f)
+	{
+	  script = get_script (key, "(script)", f);
+	  fclose (f);
+	}
+    }
+  else
+    error (0, 0, "bad request");
+
+  if (saved_stderr >= 0)
+    {
+      dup2 (saved_stderr, 2);
+      close (saved_stderr);
+    }
+
+  if (! script)
+    send_reply (fd, 1);
+  else
+    {
+      pid_t pid = fork ();
+      if (pid < 0)
+	{
+	  error (0, errno, "fork");
+	  send_reply (fd, 126);
+	}
+      if (pid == 0)
+	{
+	  close (listener);
+	  int i = 0;
+	  for (; i < num_pending; i++)
+	    if (&pending[i] != p)
+	      drop_pending (&pending[i]);
+	  i = 0;
+	  for (; i < nfds; i++)
+	    dup2 (fds[i], i);
+	  if (cwd && chdir (cwd) != 0)
+	    error (0, errno, "%s", cwd);
+	  send_reply (fd, run_stream (script, time_travel, rename_outputs));
+	  _exit (0);
+	}
+    }
+
+ bad_request:
+  drop_pending (p);
+}
+
+int
+serve (char const *socket_path, int time_travel, int rename_outputs)
+{
+  struct sockaddr_un addr;
+  memset (&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  if (strlen (socket_path) >= sizeof addr.sun_path)
+    error (1, 0, "%s: socket path too long", socket_path);
+  strcpy (addr.sun_path, socket_path);
+
+  int listener = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0)
+    error (1, errno, "socket");
+  unlink (socket_path);
+  if (bind (listener, (struct sockaddr *) &addr, sizeof addr) != 0)
+    error (1, errno, "%s", socket_path);
+  if (listen (listener, 64) != 0)
+    error (1, errno, "listen");
+
+  long cpus = sysconf (_SC_NPROCESSORS_ONLN);
+  start_jobserver (max_jobs > 0 ? max_jobs : cpus > 0 ? cpus : 1);
+
+  struct pending *pending = NULL;
+  int num_pending = 0;
+  struct pollfd *pfds = NULL;
+  for (;;)
+    {
+      while (waitpid (-1, NULL, WNOHANG) > 0)
+	continue;
+      pfds = checked_realloc (pfds, (num_pending + 1) * sizeof *pfds);
+      pfds[0].fd = listener;
+      pfds[0].events = POLLIN;
+      int i;
+      for (i = 0; i < num_pending; i++)
+	{
+	  pfds[i + 1].fd = pending[i].fd;
+	  pfds[i + 1].events = POLLIN;
+	}
+      if (poll (pfds, num_pending + 1, 1000) < 0)
+	continue;
+
+      // Every connection that is done sending is handled, and every one
+      // that failed or timed out dropped
+      time_t now = time (NULL);
+      for (i = 0; i < num_pending; i++)
+	{
+	  struct pending *p = &pending[i];
+	  int done = pfds[i + 1].revents ? read_pending (p) : 0;
+	  if (done > 0)
+	    handle_client (listener, p, pending, num_pending, time_travel,
+			   rename_outputs);
+	  else if (done < 0 || now >= p->deadline)
+	    drop_pending (p);
+	}
+      int kept = 0;
+      for (i = 0; i < num_pending; i++)
+	if (pending[i].fd >= 0)
+	  pending[kept++] = pending[i];
+      num_pending = kept;
+
+      if (! (pfds[0].revents & POLLIN))
+	continue;
+      int fd = accept4 (listener, NULL, NULL, SOCK_CLOEXEC);
+      if (fd < 0)
+	continue;
+      pending = checked_realloc (pending, (num_pending + 1) * sizeof *pending);
+      struct pending *p = &pending[num_pending++];
+      p->fd = fd;
+      p->cap = 4096;
+      p->buf = checked_malloc (p->cap);
+      p->len = 0;
+      p->nfds = 0;
+      p->deadline = now + REQUEST_TIMEOUT;
+    }
+}
+
+// Client side: asks the server on SOCKET_PATH to run SCRIPT ("-" sends
+// the script text from stdin) and returns its exit status
+int
+run_remote (char const *socket_path, char const *script)
+{
+  struct sockaddr_un addr;
+  memset (&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  if (strlen (socket_path) >= sizeof addr.sun_path)
+    error (1, 0, "%s: socket path too long", socket_path);
+  strcpy (addr.sun_path, socket_path);
+  int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect (fd, (struct sockaddr *) &addr, sizeof addr) != 0)
+    error (1, errno, "%s", socket_path);
+
+  char *cwd = getcwd (NULL, 0);
+  size_t cap = 4096;
+  size_t len = 0;
+  char *req = checked_malloc (cap);
+  if (strcmp (script, "-") == 0)
+    {
+      len = snprintf (req, cap, "CWD %s\nSCRIPT\n", cwd ? cwd : ".");
+      int c;
+      while ((c = getchar ()) != EOF)
+	{
+	  if (len == cap)
+	    req = checked_grow_alloc (req, &cap);
+	  req[len++] = c;
+	}
+    }
+  else
+    {
+      req = checked_realloc (req, strlen (script) + (cwd ? strlen (cwd) : 1) + 16);
+      len = sprintf (req, "CWD %s\nRUN %s\n", cwd ? cwd : ".", script);
+    }
+
+  int fds[MAX_FDS] = { 0, 1, 2 };
+  union
+  {
+    char space[CMSG_SPACE (sizeof fds)];
+    struct cmsghdr align;
+  } control;
+  struct iovec iov;
+  iov.iov_base = req;
+  iov.iov_len = len;
+  struct msghdr msg;
+  memset (&msg, 0, sizeof msg);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.space;
+  msg.msg_controllen = sizeof control.space;
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR (&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN (sizeof fds);
+  memcpy (CMSG_DATA (cmsg), fds, sizeof fds);
+
+  ssize_t sent = sendmsg (fd, &msg, MSG_NOSIGNAL);
+  if (sent < 0)
+    error (1, errno, "%s", socket_path);
+  while ((size_t) sent < len)
+    {
+      ssize_t n = send (fd, req + sent, len - sent, MSG_NOSIGNAL);
+      if (n <= 0)
+	error (1, errno, "%s", socket_path);
+      sent += n;
+    }
+  shutdown (fd, SHUT_WR);
+  free (req);
+  free (cwd);
+
+  char reply[64];
+  size_t got = 0;
+  ssize_t n;
+  while (got < sizeof reply - 1
+	 && (n = read (fd, reply + got, sizeof reply - 1 - got)) > 0)
+    got += n;
+  reply[got] = '\0';
+  int status;
+  if (sscanf (reply, "STATUS %d", &status) != 1)
+    error (1, 0, "%s: no reply from server", socket_path);
+  return status;
+}
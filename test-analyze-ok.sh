@@ -0,0 +1,66 @@
+#! /bin/sh
+
+# UCLA CS 111 Lab 1 - Test that --analyze and --simulate report on the
+# graph without running it, and that edges are labeled with the file
+# that causes them.
+
+tmp=$0-$$.tmp
+mkdir "$tmp" || exit
+
+(
+cd "$tmp" || exit
+
+cat >test.sh <<'EOF2'
+echo one > tmp
+
+cat < tmp > out1
+
+echo two > tmp
+
+cat out1 > all
+EOF2
+
+cat >test.exp <<'EOF2'
+trees: 4
+dependencies: 4
+levels: 3, widest is level 2 with 2 trees
+work: 4.000 trees
+span: 3.000 trees
+speedup bound: 1.33
+EOF2
+
+../timetrash --analyze --dot=test.dot test.sh >test.out 2>test.err || exit
+head -n 6 test.out | diff -u test.exp - || exit
+test ! -s test.err || {
+  cat test.err
+  exit 1
+}
+test ! -e tmp || exit
+
+grep -q 'n0 -> n1 \[label="RAW tmp"' test.dot || exit
+grep -q 'n0 -> n2 \[label="WAW tmp"' test.dot || exit
+grep -q 'n1 -> n2 \[label="WAR tmp"' test.dot || exit
+grep -q 'n1 -> n3 \[label="RAW out1"' test.dot || exit
+
+# A dot file or weights that cannot be used fail the run, not the process
+if ../timetrash --analyze --dot=no/test.dot test.sh >test.out 2>test.err; then
+  exit 1
+fi
+grep -q 'no/test\.dot: cannot open' test.err || exit
+head -n 6 test.out | diff -u test.exp - || exit
+if ../timetrash --simulate=1 --weights=no/journal test.sh >test.out 2>test.err
+then
+  exit 1
+fi
+grep -q 'no/journal: cannot open journal' test.err || exit
+
+# Uniform times: one job runs all four trees in turn, two overlap the
+# last tree with the chain of three
+../timetrash --simulate=1,2 test.sh >test.out 2>test.err || exit
+grep -q '^ *1 fifo *4\.000 ' test.out || exit
+grep -q '^ *2 fifo *3\.000 ' test.out || exit
+test ! -e tmp || exit
+
+) || exit
+
+rm -fr "$tmp"
@@ -0,0 +1,67 @@
+#! /bin/sh
+
+# UCLA CS 111 Lab 1 - Test that execute_command_async runs a command in
+# the background, that command_poll reports it running until it exits,
+# and that output buffered before it started is written once.
+
+tmp=$0-$$.tmp
+mkdir "$tmp" || exit
+
+(
+cd "$tmp" || exit
+
+cat >async.sh <<'EOF'
+(echo a ; echo b)
+
+sleep 0.2 && false
+EOF
+
+cat >driver.c <<'EOF'
+#include <stdio.h>
+#include "command.h"
+
+static int
+get_byte (void *f)
+{
+  return getc (f);
+}
+
+int
+main (void)
+{
+  FILE *f = fopen ("async.sh", "r");
+  if (! f)
+    return 1;
+  command_stream_t s = make_command_stream (get_byte, f);
+  command_t echoes = read_command_stream (s);
+  command_t sleeper = read_command_stream (s);
+  if (! echoes || ! sleeper)
+    return 2;
+
+  printf ("hello ");
+  execute_command_async (echoes, 0);
+  if (command_status (echoes) != 0)
+    return 3;
+
+  execute_command_async (sleeper, 0);
+  if (command_poll (sleeper) != -1)
+    return 4;
+  // Blocks until reaped, after which polling gives the same status
+  if (command_status (sleeper) != 1 || command_poll (sleeper) != 1)
+    return 5;
+  puts ("done");
+  return 0;
+}
+EOF
+
+${CC-gcc} -pthread -I.. -o driver driver.c ../libtimetrash-internal.a || exit
+./driver >driver.out 2>driver.err || {
+  echo "driver failed with status $?"
+  cat driver.err
+  exit 1
+}
+printf 'hello a\nb\ndone\n' | diff -u - driver.out || exit
+
+) || exit
+
+rm -fr "$tmp"
@@ -0,0 +1,67 @@
+#! /bin/sh
+
+# UCLA CS 111 Lab 1 - Test that --history records how long each tree
+# took, that a later run predicts from it, and that scheduling by it
+# gives the same results as plain time travel.
+
+tmp=$0-$$.tmp
+mkdir "$tmp" || exit
+
+(
+cd "$tmp" || exit
+
+cat >test.sh <<'EOF2'
+sleep 0.2 > slow
+
+echo one > a
+
+cat a > b
+
+cat slow b > out
+EOF2
+
+../timetrash --history=hist test.sh >test.out 2>test.err || exit
+test ! -s test.err || {
+  cat test.err
+  exit 1
+}
+test $(wc -l <hist) -eq 4 || exit
+grep -q '^0\.[12][0-9]* 1 sleep 0\.2>slow$' hist || exit
+
+# The second run is scheduled by the times of the first, and averages
+# in its own.  -t also records each tree's peak memory.
+for policy in critical longest; do
+  rm -f slow a b out
+  ../timetrash -t --history=hist --policy=$policy test.sh >test.out \
+    2>test.err || exit
+  test ! -s test.err || {
+    cat test.err
+    exit 1
+  }
+  echo one | diff -u - out || exit
+done
+grep -q ' 3 [1-9][0-9]*k sleep 0\.2>slow$' hist || exit
+
+# Recorded peaks are what a memory budget is spent on.  No two trees
+# fit in a budget the size of the largest peak, so they run one at a
+# time.
+budget=$(sed 's/^[^ ]* [^ ]* \([0-9]*\)k .*/\1/' hist | sort -n | tail -n 1)
+rm -f slow a b out
+../timetrash -t --history=hist --memory=${budget}K --trace=trace.json test.sh \
+  || exit
+echo one | diff -u - out || exit
+grep -q '"name":"hold"' trace.json || exit
+! grep -q '"name":"running","ph":"C","pid":1,"ts":[0-9.]*,"args":{"value":[2-9]' \
+  trace.json || exit
+
+# Predictions stand in for --weights
+../timetrash --analyze --history=hist test.sh >test.out || exit
+grep -q '^recorded times: 4 of 4 trees$' test.out || exit
+grep -q '^span: 0\.[12][0-9]*s$' test.out || exit
+
+../timetrash --rusage=2 --history=hist test.sh >test.out 2>test.err || exit
+grep -q '^history: 4 of 4 trees predicted' test.err || exit
+
+) || exit
+
+rm -fr "$tmp"
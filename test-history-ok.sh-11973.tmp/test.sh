@@ -0,0 +1,7 @@
+sleep 0.2 > slow
+
+echo one > a
+
+cat a > b
+
+cat slow b > out
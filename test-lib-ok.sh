@@ -0,0 +1,145 @@
+#! /bin/sh
+
+# UCLA CS 111 Lab 1 - Test that a program linked with libtimetrash.a can
+# parse, analyze and run scripts, and survives a syntax error; and that
+# threads can each run a context of their own at the same time.
+
+tmp=$0-$$.tmp
+mkdir "$tmp" || exit
+
+(
+cd "$tmp" || exit
+
+cat >good.sh <<'EOF'
+echo one > a
+
+echo two > b
+
+cat a b > c
+
+sort -r < c > d
+EOF
+
+cat >driver.c <<'EOF'
+#include <stdio.h>
+#include <string.h>
+#include "timetrash.h"
+
+int
+main (void)
+{
+  tt_context *ctx = tt_open ();
+  if (! tt_parse_file (ctx, "good.sh") || tt_num_trees (ctx) != 4)
+    return 1;
+  if (tt_parse_file (ctx, "missing.sh")
+      || tt_parse_text (ctx, "bad", "echo x ;;\n", 10))
+    return 2;
+  char const *more = "false || cat d > e\n";
+  if (! tt_parse_text (ctx, "more", more, strlen (more)))
+    return 3;
+  tt_analyze (ctx);
+  if (tt_execute (ctx) != 0)
+    return 4;
+  // The same context again, with time travel
+  tt_set_time_travel (ctx, true, 2);
+  if (tt_execute (ctx) != 0)
+    return 5;
+  tt_close (ctx);
+  puts ("done");
+  return 0;
+}
+EOF
+
+${CC-gcc} -pthread -I.. -o driver driver.c ../libtimetrash.a || exit
+./driver >driver.out 2>driver.err || {
+  echo "driver failed with status $?"
+  cat driver.err
+  exit 1
+}
+grep -q '^trees: 5$' driver.out || exit
+tail -n 1 driver.out | grep -qx done || exit
+test "$(cat e)" = "two
+one" || exit
+# Only the two scripts that failed to parse complained
+test "$(grep -c . driver.err)" -le 2 || exit
+
+cat >bad.sh <<'EOF'
+echo fine
+
+echo x ;;
+EOF
+
+cat >threads.c <<'EOF'
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include "timetrash.h"
+
+// Runs a script writing files named after the thread, with time
+// travel, a few times over; the script of thread b fails
+static void *
+run (void *arg)
+{
+  char const *name = arg;
+  char script[512];
+  snprintf (script, sizeof script,
+	    "seq 1 20000 > %s.1\n\n"
+	    "seq 20001 30000 > %s.2\n\n"
+	    "cat %s.1 %s.2 | wc -l > %s.out\n\n"
+	    "sleep 0.1 && %s\n",
+	    name, name, name, name, name, *name == 'a' ? "true" : "false");
+  tt_context *ctx = tt_open ();
+  tt_set_time_travel (ctx, true, 0);
+  tt_set_rename_outputs (ctx, true);
+  long status = -1;
+  if (tt_parse_text (ctx, name, script, strlen (script)))
+    {
+      int i;
+      for (i = 0; i < 3; i++)
+	status = tt_execute (ctx);
+    }
+  tt_close (ctx);
+  return (void *) status;
+}
+
+int
+main (void)
+{
+  // Several files are parsed on threads, and one bad one fails them all
+  char const *files[] = { "good.sh", "bad.sh", "good.sh" };
+  tt_context *ctx = tt_open ();
+  if (tt_parse_files (ctx, files, 3) || tt_num_scripts (ctx) != 0)
+    return 1;
+  files[1] = "good.sh";
+  if (! tt_parse_files (ctx, files, 3) || tt_num_trees (ctx) != 12)
+    return 2;
+  tt_close (ctx);
+
+  pthread_t a, b;
+  void *status_a, *status_b;
+  if (pthread_create (&a, NULL, run, "a")
+      || pthread_create (&b, NULL, run, "b"))
+    return 3;
+  pthread_join (a, &status_a);
+  pthread_join (b, &status_b);
+  if ((long) status_a != 0 || (long) status_b != 1)
+    return 4;
+  puts ("done");
+  return 0;
+}
+EOF
+
+${CC-gcc} -pthread -I.. -o threads threads.c ../libtimetrash.a || exit
+./threads >threads.out 2>threads.err || {
+  echo "threads failed with status $?"
+  cat threads.err
+  exit 1
+}
+test "$(cat threads.out)" = done || exit
+test $(cat a.out) -eq 30000 && test $(cat b.out) -eq 30000 || exit
+# The syntax error in bad.sh is reported with its line
+grep -q 'Line 3:' threads.err || exit
+
+) || exit
+
+rm -fr "$tmp"
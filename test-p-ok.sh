@@ -86,6 +86,11 @@ test ! -s test.err || {
   exit 1
 }
 
+# Parsing a tree at a time gives the same trees
+../timetrash -p --window=1 test.sh >test.out 2>test.err || exit
+diff -u test.exp test.out || exit
+test ! -s test.err || exit
+
 ) || exit
 
 rm -fr "$tmp"
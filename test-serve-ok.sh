@@ -0,0 +1,71 @@
+#! /bin/sh
+
+# UCLA CS 111 Lab 1 - Test that --serve runs scripts for --connect
+# clients, and that a client that connects and then sends nothing holds
+# up nobody else.
+
+tmp=$0-$$.tmp
+mkdir "$tmp" || exit
+
+(
+cd "$tmp" || exit
+
+cat >idle.c <<'END'
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Connects to the socket named on the command line and sits there
+int
+main (int argc, char **argv)
+{
+  struct sockaddr_un addr;
+  memset (&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  strcpy (addr.sun_path, argv[1]);
+  int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect (fd, (struct sockaddr *) &addr, sizeof addr) != 0)
+    return 1;
+  puts ("connected");
+  fflush (stdout);
+  sleep (30);
+  return 0;
+}
+END
+${CC-gcc} -o idle idle.c || exit
+
+../timetrash -t --serve=sock 2>serve.err & server=$!
+trap 'kill $server $idle 2>/dev/null' EXIT
+while test ! -S sock; do sleep 1; done
+
+cat >test.sh <<'EOF2'
+echo one > a
+
+echo two > b
+
+cat a b > c
+EOF2
+
+./idle sock >idle.out & idle=$!
+while test ! -s idle.out; do sleep 1; done
+
+start=$(date +%s)
+../timetrash --connect=sock test.sh || exit
+test "$(cat c)" = "one
+two" || exit
+echo 'false' | ../timetrash --connect=sock - && exit 1
+# Well inside the time the server gives a client to send its request
+test $(($(date +%s) - start)) -lt 5 || {
+  echo "held up by an idle client"
+  exit 1
+}
+test ! -s serve.err || {
+  cat serve.err
+  exit 1
+}
+
+) || exit
+
+rm -fr "$tmp"
@@ -0,0 +1,230 @@
+#! /bin/sh
+
+# UCLA CS 111 Lab 1 - Test that time travel gives the same results as
+# sequential execution.
+
+tmp=$0-$$.tmp
+mkdir "$tmp" || exit
+
+(
+cd "$tmp" || exit
+
+cat >test.sh <<'EOF'
+echo one > tmp
+
+cat < tmp > out1
+
+echo two > tmp
+
+cat < tmp | tr a-z A-Z > out2
+
+(echo three ; echo four) > tmp
+
+sort -r < tmp > out3
+
+cat out1 out2 out3 > all
+EOF
+
+cat >test.exp <<'EOF'
+one
+TWO
+three
+four
+EOF
+
+for flags in -t '-t -r' '-t -z 2' '-t --trace=trace.json' '-t --window=2' \
+  --window=1 '-t --placement'; do
+  rm -f tmp out1 out2 out3 all .tmp.tt* || exit
+  ../timetrash $flags test.sh >test.out 2>test.err || exit
+  diff -u test.exp all || exit
+  test "$(cat tmp)" = "three
+four" || exit
+  test ! -s test.out || {
+    cat test.out
+    exit 1
+  }
+  test ! -s test.err || {
+    cat test.err
+    exit 1
+  }
+  test -z "$(ls -a | grep '^\.tmp\.tt')" || exit
+done
+
+# One slice per tree in the trace, and a dependency arrow into every
+# tree but the first
+test "$(grep -c '"cat":"node"' trace.json)" = 7 || exit
+test "$(grep -c '"cat":"dependency","ph":"f"' trace.json)" = 6 || exit
+tail -n 1 trace.json | grep -q '^]$' || exit
+
+# The usage report lists the trees and ends with the totals
+../timetrash -t --rusage=3 test.sh 2>test.err || exit
+grep -q '^top 3 of 7 trees by CPU time:$' test.err || exit
+tail -n 1 test.err | grep -q '^total: wall .* effective parallelism' || exit
+
+# Counters: seven trees, each of them a graph node that was forked.
+# The last command of every process is exec'd in it, so only the pipe's
+# sides and the first echo in the subshell need forks of their own.
+../timetrash -t -s test.sh 2>test.err || exit
+grep -qx 'trees=7' test.err || exit
+grep -qx 'graph_nodes=7' test.err || exit
+grep -qx 'pipes=1' test.err || exit
+grep -qx 'forks=11' test.err || exit
+
+# Every side of a longer pipeline exits when it is done, and never goes
+# on to run the rest of the script
+cat >pipes.sh <<'EOF'
+echo x | (cat ; echo y) | cat
+
+(((echo z)))
+EOF
+for flags in '' '-t -j 1'; do
+  test "$(../timetrash $flags pipes.sh)" = "x
+y
+z" || exit
+done
+
+# A file written behind && may never be written, so -r leaves it to the
+# real file, and its reader finds what the tree before wrote
+cat >skip.sh <<'EOF'
+echo a > f
+
+false && echo b > f
+
+cat < f
+EOF
+for flags in '' '-t -r'; do
+  rm -f f .f.tt* || exit
+  out=$(../timetrash $flags skip.sh 2>test.err) || exit
+  test "$out" = a || exit
+  test ! -s test.err || {
+    cat test.err
+    exit 1
+  }
+  test -z "$(ls -a | grep '^\.f\.tt')" || exit
+done
+
+# Independent trees finish in any order, but --keep-order prints their
+# output in script order, even with no room to hold any of it
+cat >order.sh <<'EOF'
+sleep 0.3 ; echo one
+
+echo two
+
+sleep 0.1 ; cat missing ; echo three
+
+echo four
+EOF
+for limit in '' =0; do
+  ../timetrash -t --keep-order$limit order.sh >order.out 2>order.err || exit
+  printf 'one\ntwo\nthree\nfour\n' | diff -u - order.out || exit
+  grep -q missing order.err || exit
+done
+
+# Scratch files written once and read once go through a pipe or memfd,
+# and only --keep-temps leaves them behind.  The writer of a file whose
+# reader quits early still runs to the end.
+cat >temps.sh <<'EOF'
+sort -r < test.exp > t1
+
+cat < t1 > sorted
+
+seq 100000 > t2 && echo ok > done
+
+head -n 1 < t2 > first
+
+echo x > t3
+
+(cat ; echo y) < t3 > sub
+EOF
+for keep in '' --keep-temps; do
+  rm -f t1 t2 t3 sorted done first sub || exit
+  ../timetrash -t --pipe-temps $keep temps.sh >test.out 2>test.err || exit
+  test ! -s test.err || {
+    cat test.err
+    exit 1
+  }
+  sort -r test.exp | diff -u - sorted || exit
+  test "$(cat done first sub)" = "ok
+1
+x
+y" || exit
+  if test -n "$keep"; then
+    test "$(cat t3)" = x && test "$(wc -l <t2)" = 100000 || exit
+  else
+    test ! -e t1 && test ! -e t2 && test ! -e t3 || exit
+  fi
+done
+# The edges of the two piped files are gone from the graph
+../timetrash -t -s --pipe-temps temps.sh 2>test.err || exit
+grep -qx 'graph_edges=1' test.err || exit
+
+# A scratch file written behind && stays a file, so when it is not
+# written its reader finds it missing rather than empty
+cat >cond.sh <<'EOF'
+false && echo x > t4
+
+cat < t4 > got
+EOF
+for flags in '' '-t --pipe-temps'; do
+  rm -f t4 got || exit
+  ../timetrash $flags cond.sh 2>cond.err
+  test -s cond.err && test ! -s got || exit
+done
+
+# Every placement is in the trace.  The reader of a piped scratch file
+# goes with its writer, and a tree reading a file goes next to the tree
+# that wrote it.
+../timetrash -t --pipe-temps --placement --trace=place.json temps.sh \
+  >test.out 2>test.err || exit
+test "$(grep -c '"name":"place"' place.json)" = 6 || exit
+grep -q '"tree":1,"cpus":"[0-9,-]*","near":0,"reason":"pipeline"' place.json \
+  || exit
+../timetrash -t --placement --trace=place.json test.sh || exit
+grep -q '"near":[0-9]*,"reason":"[a-z]*"' place.json || exit
+
+# A tree that does not fit in the memory budget next to those running
+# waits, and a later one that fits goes ahead of it
+cat >memory.sh <<'EOF'
+sleep 0.2 > big1
+
+sleep 0.2 > big2
+
+echo small > small
+EOF
+cat >hints <<'EOF'
+# Both sleeps are hinted to need most of the budget
+60M sleep 0.2 > big1
+60M   sleep 0.2>big2
+EOF
+../timetrash -t --memory=100M --memory-hints=hints --trace=memory.json \
+  memory.sh || exit
+grep -o '"name":"launch".*"tree":[0-9]*' memory.json \
+  | sed 's/.*"tree"://' | tr '\n' ' ' | grep -qx '0 2 1 ' || exit
+grep -q '"name":"hold"' memory.json || exit
+test "$(cat small)" = small || exit
+if ../timetrash -t --memory=lots memory.sh 2>/dev/null \
+  || ../timetrash --memory memory.sh 2>/dev/null; then
+  exit 1
+fi
+
+# A journal that cannot be written fails the run before any tree runs
+rm -f all || exit
+if ../timetrash -t --journal=no/journal test.sh 2>test.err; then
+  exit 1
+fi
+grep -q 'no/journal: cannot open journal' test.err || exit
+test ! -e all || exit
+
+# A scratch file that cannot be kept still reaches its reader, and then
+# the run fails
+rm -fr t3 sub && mkdir t3 || exit
+if ../timetrash -t --pipe-temps --keep-temps temps.sh 2>test.err; then
+  exit 1
+fi
+grep -q 't3: cannot keep scratch file' test.err || exit
+test "$(cat sub)" = "x
+y" || exit
+
+) || exit
+
+rm -fr "$tmp"
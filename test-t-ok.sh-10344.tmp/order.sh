@@ -0,0 +1,7 @@
+sleep 0.3 ; echo one
+
+echo two
+
+sleep 0.1 ; cat missing ; echo three
+
+echo four
@@ -0,0 +1,11 @@
+sort -r < test.exp > t1
+
+cat < t1 > sorted
+
+seq 100000 > t2 && echo ok > done
+
+head -n 1 < t2 > first
+
+echo x > t3
+
+(cat ; echo y) < t3 > sub
@@ -0,0 +1,5 @@
+sleep 0.2 > big1
+
+sleep 0.2 > big2
+
+echo small > small
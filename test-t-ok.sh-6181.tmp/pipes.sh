@@ -0,0 +1,3 @@
+echo x | (cat ; echo y) | cat
+
+(((echo z)))
@@ -0,0 +1,13 @@
+echo one > tmp
+
+cat < tmp > out1
+
+echo two > tmp
+
+cat < tmp | tr a-z A-Z > out2
+
+(echo three ; echo four) > tmp
+
+sort -r < tmp > out3
+
+cat out1 out2 out3 > all
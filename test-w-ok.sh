@@ -0,0 +1,113 @@
+#! /bin/sh
+
+# UCLA CS 111 Lab 1 - Test that time travel gives the same results when
+# command trees run on several timetrash-worker daemons.
+
+tmp=$0-$$.tmp
+mkdir "$tmp" || exit
+
+(
+cd "$tmp" || exit
+
+echo sesame >key
+../timetrash-worker -k key -p 0 -s 2 >port1 & w1=$!
+../timetrash-worker -k key -p 0 -s 1 >port2 & w2=$!
+trap 'kill $w1 $w2 2>/dev/null' EXIT
+while test ! -s port1 || test ! -s port2; do sleep 1; done
+
+cat >test.sh <<'EOF'
+echo one > a
+
+echo two > b
+
+cat a b > c
+
+(cat < c ; echo three) > d
+
+echo four > a
+
+cat a d > all
+EOF
+
+cat >test.exp <<'EOF'
+four
+one
+two
+three
+EOF
+
+../timetrash -t -W localhost:$(cat port1),127.0.0.1:$(cat port2) \
+  --worker-key=key test.sh >test.out 2>test.err || exit
+
+diff -u test.exp all || exit
+test ! -s test.out || {
+  cat test.out
+  exit 1
+}
+test ! -s test.err || {
+  cat test.err
+  exit 1
+}
+
+# A coordinator with another key is turned away before it can send a
+# job, and so is one without the -W key option
+echo open >other
+if ../timetrash -t -W 127.0.0.1:$(cat port1) --worker-key=other test.sh \
+     >/dev/null 2>key.err; then
+  exit 1
+fi
+grep -q 'another key' key.err || exit
+if ../timetrash -t -W 127.0.0.1:$(cat port1) test.sh 2>/dev/null; then
+  exit 1
+fi
+
+# A worker that dies part way through loses the trees it was running,
+# and they run again on the one left.  Each tree makes its directory
+# only after its sleep, so a tree that ran to the end twice would fail.
+# The worker leads its own process group, so that killing the group
+# takes its connection and the trees it runs with it.
+setsid ../timetrash-worker -k key -p 0 -s 2 >port3 & w3=$!
+trap 'kill $w1 $w2 2>/dev/null; kill -KILL -$w3 2>/dev/null' EXIT
+while test ! -s port3; do sleep 1; done
+
+cat >lose.sh <<'EOF'
+sleep 2 && mkdir d1
+
+sleep 2 && mkdir d2
+
+sleep 2 && mkdir d3
+
+sleep 2 && mkdir d4
+EOF
+../timetrash -t -W localhost:$(cat port1),127.0.0.1:$(cat port3) \
+  --worker-key=key lose.sh >lose.out 2>lose.err & run=$!
+sleep 1
+kill -KILL -$w3 || exit
+wait $run || {
+  cat lose.err
+  exit 1
+}
+test -d d1 && test -d d2 && test -d d3 && test -d d4 || exit
+grep -q '^.*lost 127\.0\.0\.1:[0-9]*; re-queuing 2 command tree(s)$' lose.err \
+  || exit
+test "$(grep -c . lose.err)" = 1 || {
+  cat lose.err
+  exit 1
+}
+
+# With no worker left the run fails rather than waiting for one
+setsid ../timetrash-worker -k key -p 0 -s 2 >port4 & w4=$!
+trap 'kill $w1 $w2 2>/dev/null; kill -KILL -$w3 -$w4 2>/dev/null' EXIT
+while test ! -s port4; do sleep 1; done
+../timetrash -t -W 127.0.0.1:$(cat port4) --worker-key=key lose.sh \
+  >lose.out 2>lose.err & run=$!
+sleep 1
+kill -KILL -$w4 || exit
+if wait $run; then
+  exit 1
+fi
+grep -q 'no workers left' lose.err || exit
+
+) || exit
+
+rm -fr "$tmp"
@@ -0,0 +1,181 @@
+// UCLA CS 111 Lab 1 executor microbenchmarks
+
+#include <errno.h>
+#include <error.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "alloc.h"
+#include "command.h"
+#include "command-internals.h"
+
+// Times execute_command on hand-built trees: a trivial simple command,
+// pipes carrying various amounts of data, a subshell, and a command
+// with both redirections.  Each case runs with the parent holding
+// several amounts of touched heap, since fork has to copy the page
+// tables of a parent that has built a big AST and graph.  The order of
+// cases and the iteration counts are fixed, so runs are comparable.
+
+static char const *program_name;
+
+static void
+usage (void)
+{
+  error (1, 0, "usage: %s [-n ITERATIONS] [-m HEAP-MB,...]", program_name);
+}
+
+static double
+now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static command_t
+simple (char const *words, char *input, char *output)
+{
+  command_t c = checked_malloc (sizeof *c);
+  char *copy = strdup (words);
+  char **word = checked_malloc (8 * sizeof *word);
+  int n = 0;
+  char *w;
+  for (w = strtok (copy, " "); w && n < 7; w = strtok (NULL, " "))
+    word[n++] = w;
+  word[n] = NULL;
+  c->type = SIMPLE_COMMAND;
+  c->status = -1;
+  c->pid = 0;
+  c->input = input;
+  c->output = output;
+  c->u.word = word;
+  return c;
+}
+
+static command_t
+compound (enum command_type type, command_t a, command_t b)
+{
+  command_t c = checked_malloc (sizeof *c);
+  c->type = type;
+  c->status = -1;
+  c->pid = 0;
+  c->input = NULL;
+  c->output = NULL;
+  if (type == SUBSHELL_COMMAND)
+    c->u.subshell_command = a;
+  else
+    {
+      c->u.command[0] = a;
+      c->u.command[1] = b;
+    }
+  return c;
+}
+
+static int
+compare_doubles (void const *a, void const *b)
+{
+  double x = *(double const *) a;
+  double y = *(double const *) b;
+  return (x > y) - (x < y);
+}
+
+static void
+run_case (char const *name, command_t c, int iterations, int heap_mb,
+	  double *samples)
+{
+  int i;
+  // Warm up the PATH cache and the page cache first
+  for (i = 0; i < 3; i++)
+    execute_command (c, 0);
+  for (i = 0; i < iterations; i++)
+    {
+      double start = now ();
+      execute_command (c, 0);
+      samples[i] = now () - start;
+      if (command_status (c) != 0)
+	error (1, 0, "%s: exit status %d", name, command_status (c));
+    }
+  qsort (samples, iterations, sizeof *samples, compare_doubles);
+  printf ("%-22s %8d %10.1f %10.1f %10.1f %10.1f\n", name, heap_mb,
+	  samples[0], samples[iterations / 2],
+	  samples[(int) (iterations * 0.99)], samples[iterations - 1]);
+  fflush (stdout);
+}
+
+int
+main (int argc, char **argv)
+{
+  int iterations = 200;
+  char const *heaps = "0,64,256";
+  program_name = argv[0];
+
+  for (;;)
+    switch (getopt (argc, argv, "n:m:"))
+      {
+      case 'n':
+	iterations = atoi (optarg);
+	if (iterations <= 0)
+	  usage ();
+	break;
+      case 'm': heaps = optarg; break;
+      default: usage (); break;
+      case -1: goto options_exhausted;
+      }
+ options_exhausted:;
+  if (optind != argc)
+    usage ();
+
+  struct
+  {
+    char const *name;
+    command_t cmd;
+  } cases[] =
+    {
+      { "simple true", simple ("true", NULL, NULL) },
+      { "redirect true <>", simple ("true", "/dev/null", "/dev/null") },
+      { "subshell (true)",
+	compound (SUBSHELL_COMMAND, simple ("true", NULL, NULL), NULL) },
+      { "pipe 0 B",
+	compound (PIPE_COMMAND, simple ("true", NULL, NULL),
+		  simple ("cat", NULL, "/dev/null")) },
+      { "pipe 64 KiB",
+	compound (PIPE_COMMAND, simple ("head -c 65536 /dev/zero", NULL, NULL),
+		  simple ("cat", NULL, "/dev/null")) },
+      { "pipe 16 MiB",
+	compound (PIPE_COMMAND,
+		  simple ("head -c 16777216 /dev/zero", NULL, NULL),
+		  simple ("cat", NULL, "/dev/null")) },
+    };
+  int num_cases = sizeof cases / sizeof cases[0];
+  int i;
+  for (i = 0; i < num_cases; i++)
+    warm_path_cache (cases[i].cmd);
+
+  double *samples = checked_malloc (iterations * sizeof *samples);
+  printf ("# %d runs each, latency in microseconds\n", iterations);
+  printf ("%-22s %8s %10s %10s %10s %10s\n",
+	  "case", "heap-MB", "min", "p50", "p99", "max");
+
+  char *spec = strdup (heaps);
+  char *heap = NULL;
+  size_t heap_size = 0;
+  char *mb;
+  for (mb = strtok (spec, ","); mb; mb = strtok (NULL, ","))
+    {
+      // Every page touched, so that fork has page tables to copy
+      heap_size = (size_t) atoi (mb) << 20;
+      free (heap);
+      heap = heap_size ? checked_malloc (heap_size) : NULL;
+      if (heap)
+	memset (heap, 1, heap_size);
+      for (i = 0; i < num_cases; i++)
+	run_case (cases[i].name, cases[i].cmd, iterations, atoi (mb), samples);
+    }
+  free (heap);
+  free (spec);
+  free (samples);
+  return 0;
+}
@@ -0,0 +1,113 @@
+// UCLA CS 111 Lab 1 remote worker daemon
+
+#include <errno.h>
+#include <error.h>
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "command.h"
+
+// Runs command trees for a timetrash coordinator started with -W.
+// Every connection is served by its own child: once the coordinator
+// has sent the key in KEY-FILE, it greets it with the slot count and
+// then runs jobs as they arrive.  Paths in the trees are taken relative
+// to DIR, which should be the same shared directory the coordinator
+// runs in.  The worker listens on 127.0.0.1 unless -a names another
+// address, such as 0.0.0.0 for every interface.
+
+static char const *program_name;
+
+static void
+usage (void)
+{
+  error (1, 0, "usage: %s [-a ADDR] [-d DIR] [-s SLOTS] -k KEY-FILE -p PORT",
+	 program_name);
+}
+
+int
+main (int argc, char **argv)
+{
+  char const *address = "127.0.0.1";
+  char const *dir = NULL;
+  char const *key_file = NULL;
+  int port = -1;
+  int slots = sysconf (_SC_NPROCESSORS_ONLN);
+  program_name = argv[0];
+
+  for (;;)
+    switch (getopt (argc, argv, "a:d:k:p:s:"))
+      {
+      case 'a': address = optarg; break;
+      case 'd': dir = optarg; break;
+      case 'k': key_file = optarg; break;
+      case 'p': port = atoi (optarg); break;
+      case 's': slots = atoi (optarg); break;
+      default: usage (); break;
+      case -1: goto options_exhausted;
+      }
+ options_exhausted:;
+
+  if (optind != argc || port < 0 || port > 65535 || slots <= 0 || ! key_file)
+    usage ();
+  size_t key_len;
+  char *key = read_worker_key (key_file, &key_len);
+  if (! key)
+    return 1;
+  if (dir && chdir (dir) != 0)
+    error (1, errno, "%s: cannot change directory", dir);
+
+  int listener = socket (AF_INET, SOCK_STREAM, 0);
+  if (listener < 0)
+    error (1, errno, "socket");
+  int one = 1;
+  setsockopt (listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+  struct sockaddr_in addr;
+  memset (&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  if (inet_pton (AF_INET, address, &addr.sin_addr) != 1)
+    error (1, 0, "%s: not an IPv4 address", address);
+  addr.sin_port = htons (port);
+  if (bind (listener, (struct sockaddr *) &addr, sizeof addr) != 0)
+    error (1, errno, "%s port %d", address, port);
+  if (listen (listener, 16) != 0)
+    error (1, errno, "listen");
+
+  // Report the port actually bound, so -p 0 can be used in tests
+  socklen_t addrlen = sizeof addr;
+  getsockname (listener, (struct sockaddr *) &addr, &addrlen);
+  printf ("%d\n", ntohs (addr.sin_port));
+  fflush (stdout);
+
+  for (;;)
+    {
+      int fd = accept (listener, NULL, NULL);
+      while (waitpid (-1, NULL, WNOHANG) > 0)
+	continue;
+      if (fd < 0)
+	{
+	  if (errno != EINTR)
+	    error (0, errno, "accept");
+	  continue;
+	}
+      pid_t pid = fork ();
+      if (pid == 0)
+	{
+	  close (listener);
+	  if (check_worker_key (fd, key, key_len)
+	      && send_message (fd, MSG_HELLO, 0, slots, NULL, 0))
+	    serve_jobs (fd);
+	  _exit (0);
+	}
+      if (pid < 0)
+	error (0, errno, "fork");
+      close (fd);
+    }
+}
@@ -0,0 +1,169 @@
+// UCLA CS 111 Lab 1 library interface
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// libtimetrash.a runs timetrash scripts inside another program, and
+// the timetrash program is a front end to it.  A context holds parsed
+// scripts and the options to run them with, and can be printed,
+// analyzed or run any number of times.  A syntax error is returned
+// rather than ending the program.
+//
+// The parser and the executor keep their state per thread, so threads
+// may each parse and run their own context at the same time; several
+// scripts given to tt_parse_files are parsed on threads of their own.
+// A context must not be used by two threads at once.  Runs on
+// different threads share the process's working directory, environment
+// and files, so scripts run at the same time must not write the same
+// files; and the --rusage figures of trees run one after another are
+// the process's, so they include what other threads run meanwhile.
+
+typedef struct tt_context tt_context;
+
+// A context with no scripts that runs its trees one after another
+tt_context *tt_open (void);
+void tt_close (tt_context *ctx);
+
+// Options
+// -------
+// Each takes effect from the next call that prints, analyzes or runs.
+
+// Runs independent trees at the same time, as -t does, at most JOBS of
+// them at once if JOBS is positive
+void tt_set_time_travel (tt_context *ctx, bool on, int jobs);
+
+// Points outputs at temporary names and renames them once written, as
+// -r does
+void tt_set_rename_outputs (tt_context *ctx, bool on);
+
+// Journals finished trees in FILE, and with RESUME skips those a
+// previous run journaled, as --journal and --resume do
+void tt_set_journal (tt_context *ctx, char const *file, bool resume);
+
+// Writes the timeline of each -t run to FILE, as --trace does
+void tt_set_trace (tt_context *ctx, char const *file);
+
+// Writes the output of trees in script order, holding up to LIMIT
+// bytes of it in memory, or a default if LIMIT is 0, as --keep-order
+// does
+void tt_set_keep_order (tt_context *ctx, bool on, size_t limit);
+
+// Passes scratch files through pipes, and with KEEP still writes them,
+// as --pipe-temps and --keep-temps do
+void tt_set_pipe_temps (tt_context *ctx, bool on, bool keep);
+
+// Pins trees to the CPUs sharing a cache, as --placement does
+void tt_set_placement (tt_context *ctx, bool on);
+
+// Admits trees only while their expected peaks fit in BUDGET, a size
+// such as 512M, or in the memory available now if BUDGET is NULL, as
+// --memory does.  Returns false if BUDGET is not a size, or is NULL and
+// the available memory cannot be read.
+bool tt_set_memory (tt_context *ctx, char const *budget);
+
+// Reads the expected peaks of trees from FILE, as --memory-hints does
+void tt_set_memory_hints (tt_context *ctx, char const *file);
+
+// Orders ready trees by policy NAME: fifo, critical or longest, as
+// --policy does.  Returns false if there is no such policy.
+bool tt_set_policy (tt_context *ctx, char const *name);
+
+// Predicts tree runtimes from the history in FILE and records them
+// there, as --history does
+void tt_set_history (tt_context *ctx, char const *file);
+
+// Weighs trees by the runtimes journaled in FILE for tt_analyze and
+// tt_schedule, as --weights does
+void tt_set_weights (tt_context *ctx, char const *file);
+
+// Writes the graph tt_analyze analyzes to FILE, as --dot does
+void tt_set_dot (tt_context *ctx, char const *file);
+
+// Reports the resources of the TOP costliest trees after each run, as
+// --rusage does; 0 turns the report off
+void tt_set_rusage (tt_context *ctx, int top);
+
+// Runs trees on HELPERS local helper processes and on the workers in
+// WORKERS, a list of HOST:PORT, as -z and -W do; 0 and NULL for none.
+// The workers must have been given the key in KEY_FILE.
+void tt_set_workers (tt_context *ctx, int helpers, char const *workers,
+		     char const *key_file);
+
+// Forks the helpers and connects to the workers tt_set_workers named,
+// which tt_execute otherwise does on first use.  The helpers are copies
+// of the program as it is then, so start them before parsing, while it
+// is small; they last until tt_close.  Returns false, with a message on
+// stderr, if a worker cannot be reached or refuses the key.
+bool tt_start_workers (tt_context *ctx);
+
+// Parses script files only as their trees are needed, keeping at most
+// TREES of them in memory, as --window does; 0 parses them up front
+void tt_set_window (tt_context *ctx, int trees);
+
+// Counts what the library does, for tt_print_stats
+void tt_set_stats (tt_context *ctx, bool on);
+
+// Scripts
+// -------
+
+// Adds the trees of the script in FILE after those already added.
+// Returns false, with the parser's message on stderr, if the script
+// cannot be read or has a syntax error.  With a window set, FILE is
+// only noted, and read as it is printed or run.
+bool tt_parse_file (tt_context *ctx, char const *file);
+
+// Same, for the NUM_FILES scripts in FILES, each parsed on a thread of
+// its own
+bool tt_parse_files (tt_context *ctx, char const *const *files,
+		     int num_files);
+
+// Same, for the LEN bytes of script at TEXT; NAME is used in messages.
+// Not with a window set, which only reads files.
+bool tt_parse_text (tt_context *ctx, char const *name, char const *text,
+		    size_t len);
+
+int tt_num_trees (tt_context const *ctx);
+int tt_num_scripts (tt_context const *ctx);
+
+// Running
+// -------
+
+// Prints every tree to stdout, numbered, as -p does.  Returns false if a
+// windowed script cannot be read or has a syntax error.
+bool tt_print (tt_context *ctx);
+
+// Prints the work, span and critical path of the dependency graph to
+// stdout, as --analyze does.  Returns false, with a message on stderr,
+// if the history, the weights or the dot file cannot be used.
+bool tt_analyze (tt_context *ctx);
+
+// Prints the makespan a -t run would have with each of the NUM_JOBS job
+// limits in JOBS, as --simulate does.  Returns false, with a message on
+// stderr, if the history or the weights cannot be read.
+bool tt_schedule (tt_context *ctx, int *jobs, int num_jobs);
+
+// Runs every tree and returns the exit status of the last one, or 1 if
+// a windowed script cannot be read or has a syntax error.  Returns -1,
+// with a message on stderr, if the run could not be done as asked: the
+// workers, history, memory hints or journal cannot be used, a kept
+// scratch file cannot be written, or every worker has gone.  Some trees
+// may have run by then.
+int tt_execute (tt_context *ctx);
+
+// Exit status of the last tree of script number SCRIPT, counting from 0
+// in the order added, in the last tt_execute
+int tt_script_status (tt_context const *ctx, int script);
+
+// Prints what tt_set_stats counted to stderr, as -s does
+void tt_print_stats (tt_context *ctx);
+
+// Serving
+// -------
+
+// Serves scripts sent to SOCKET with the options of CTX, as --serve
+// does, until killed
+int tt_serve (tt_context *ctx, char const *socket);
+
+// Has the server at SOCKET run the script in FILE, as --connect does,
+// and returns its exit status
+int tt_run_remote (char const *socket, char const *file);
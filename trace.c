@@ -0,0 +1,150 @@
+// UCLA CS 111 Lab 1 trace event export
+
+#include "command.h"
+
+#include <errno.h>
+#include <error.h>
+#include <stdio.h>
+#include <time.h>
+
+// Writes Chrome trace-event JSON (loadable in chrome://tracing and
+// Perfetto).  Everything lives in one process; thread 0 is the
+// scheduler and thread N is job slot N.  A trace belongs to the thread
+// that opened it.  Timestamps are microseconds
+// since trace_open.
+
+static __thread FILE* trace_file = NULL;
+static __thread struct timespec trace_start;
+static __thread bool first_event;
+
+double trace_now(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - trace_start.tv_sec) * 1e6
+    + (now.tv_nsec - trace_start.tv_nsec) / 1e3;
+}
+
+bool tracing(void)
+{
+  return trace_file != NULL;
+}
+
+static void begin_event(void)
+{
+  fputs(first_event ? "\n" : ",\n", trace_file);
+  first_event = false;
+}
+
+// Writes S as a JSON string
+static void put_json_string(char const* s)
+{
+  putc('"', trace_file);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\')
+      putc('\\', trace_file);
+    if ((unsigned char) *s >= ' ')
+      putc(*s, trace_file);
+  }
+  putc('"', trace_file);
+}
+
+void trace_open(char const* file)
+{
+  trace_file = fopen(file, "w");
+  if (trace_file == NULL)
+    error(1, errno, "%s: cannot open trace", file);
+  clock_gettime(CLOCK_MONOTONIC, &trace_start);
+  first_event = true;
+  fputs("[", trace_file);
+  begin_event();
+  fputs("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+	"\"args\":{\"name\":\"timetrash\"}}", trace_file);
+  begin_event();
+  fputs("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,"
+	"\"args\":{\"name\":\"scheduler\"}}", trace_file);
+}
+
+void trace_slot_name(int slot)
+{
+  if (!trace_file)
+    return;
+  begin_event();
+  fprintf(trace_file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+	  "\"args\":{\"name\":\"slot %d\"}}", slot, slot);
+}
+
+// One slice per graph node from spawn to exit, with the time it spent
+// before its first exec nested inside.  ARGS, if not NULL, is extra
+// JSON members for the slice's args.
+void trace_node(int index, char const* name, int slot, double spawn,
+		double exec, double exit, int status, char const* args)
+{
+  if (!trace_file)
+    return;
+  begin_event();
+  fprintf(trace_file, "{\"name\":");
+  put_json_string(name);
+  fprintf(trace_file, ",\"cat\":\"node\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+	  "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"tree\":%d,\"status\":%d%s%s}}",
+	  slot, spawn, exit - spawn, index, status, args ? "," : "", args ? args : "");
+  if (exec > spawn) {
+    begin_event();
+    fprintf(trace_file, "{\"name\":\"launch\",\"cat\":\"launch\",\"ph\":\"X\","
+	    "\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}", slot, spawn, exec - spawn);
+  }
+}
+
+// Arrow from the end of tree FROM to the start of tree TO, which it
+// was the last dependency of
+void trace_flow(int from, int fromSlot, double fromTs, int to, int toSlot, double toTs)
+{
+  if (!trace_file)
+    return;
+  begin_event();
+  fprintf(trace_file, "{\"name\":\"dependency\",\"cat\":\"dependency\",\"ph\":\"s\","
+	  "\"id\":%d,\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"args\":{\"from\":%d}}",
+	  to, fromSlot, fromTs, from);
+  begin_event();
+  fprintf(trace_file, "{\"name\":\"dependency\",\"cat\":\"dependency\",\"ph\":\"f\","
+	  "\"bp\":\"e\",\"id\":%d,\"pid\":1,\"tid\":%d,\"ts\":%.3f}",
+	  to, toSlot, toTs);
+}
+
+void trace_instant(char const* name, int tree)
+{
+  trace_instant_args(name, tree, NULL);
+}
+
+void trace_instant_args(char const* name, int tree, char const* args)
+{
+  if (!trace_file)
+    return;
+  begin_event();
+  fprintf(trace_file, "{\"name\":");
+  put_json_string(name);
+  fprintf(trace_file, ",\"cat\":\"scheduler\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,"
+	  "\"tid\":0,\"ts\":%.3f,\"args\":{\"tree\":%d%s%s}}", trace_now(), tree,
+	  args ? "," : "", args ? args : "");
+}
+
+void trace_counter(char const* name, int value)
+{
+  if (!trace_file)
+    return;
+  begin_event();
+  fprintf(trace_file, "{\"name\":");
+  put_json_string(name);
+  fprintf(trace_file, ",\"ph\":\"C\",\"pid\":1,\"ts\":%.3f,\"args\":{\"value\":%d}}",
+	  trace_now(), value);
+}
+
+void trace_close(void)
+{
+  if (!trace_file)
+    return;
+  fputs("\n]\n", trace_file);
+  if (fclose(trace_file) != 0)
+    error(0, errno, "cannot write trace");
+  trace_file = NULL;
+}
@@ -0,0 +1,467 @@
+// UCLA CS 111 Lab 1 pre-forked worker pool and remote workers
+
+#define _GNU_SOURCE // for close_range
+
+#include "command.h"
+#include "command-internals.h"
+#include "alloc.h"
+
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Trees are launched through endpoints.  A local endpoint is a helper
+// forked at the start of a run, before the graph is built, so launching
+// a tree costs a fork of a process that does not grow with the graph
+// and the scheduler's state.  A remote endpoint is a TCP connection to
+// a timetrash-worker, which advertises how many slots it has.
+//
+// Either way the endpoint reads MSG_RUN messages carrying a serialized
+// job, forks a child that runs it, and the child writes MSG_DONE with
+// the exit status straight back on the endpoint's socket.
+//
+// A worker runs whatever it is sent, so it takes jobs only from a
+// coordinator that first sends MSG_AUTH with the key both were given
+// in a file.  The key crosses the network as it is, so a worker meant
+// to be reached from other machines belongs on a trusted network or
+// behind a tunnel.
+
+#define MAX_KEY_SIZE 4096
+#define AUTH_TIMEOUT 10  // Seconds a worker waits for the key
+
+struct endpoint {
+  int fd;
+  pid_t pid;      // Helper pid, or 0 for a remote worker
+  char* name;     // For messages
+  int slots;      // Most trees to run at once, or 0 for no limit
+  int load;       // Trees in flight
+  int* inflight;  // Their indexes
+  bool dead;
+};
+
+struct worker_pool {
+  struct endpoint* endpoints;
+  int numEndpoints;
+  int numLive;
+  // Indexes of trees whose endpoint was lost, waiting to be handed
+  // back to the caller of pool_wait
+  int* lost;
+  int numLost;
+};
+
+// The pool this thread launches trees through, if any.  A pool may be
+// started on one thread and used on another, one thread at a time.
+static __thread struct worker_pool* pool;
+
+/////////////////////////////////////////////////
+///////////////  Endpoint Side     //////////////
+/////////////////////////////////////////////////
+
+void serve_jobs(int fd)
+{
+  struct message m;
+  char* payload;
+  while (recv_message(fd, &m, &payload)) {
+    if (m.type == MSG_RUN) {
+      STAT_INC(STAT_FORKS);
+      pid_t pid = fork();
+      if (pid == 0) {
+	char** rl;
+	char** wl;
+	command_t c = deserialize_job(payload, m.len, &rl, &wl);
+	int status = 127;
+	if (c == NULL)
+	  error(0, 0, "malformed job");
+	else {
+	  execute_command(c, false);
+	  status = command_status(c);
+	  free_command(c);
+	  free_job_list(rl);
+	  free_job_list(wl);
+	}
+	struct rusage ru;
+	struct rusage children;
+	getrusage(RUSAGE_SELF, &ru);
+	getrusage(RUSAGE_CHILDREN, &children);
+	rusage_add(&ru, &children);
+	send_message(fd, MSG_DONE, m.index, status, (char*) &ru, sizeof ru);
+	_exit(0);
+      }
+      if (pid < 0) {
+	error(0, errno, "fork");
+	send_message(fd, MSG_DONE, m.index, 126, NULL, 0);
+      }
+    }
+    free(payload);
+    while (waitpid(-1, NULL, WNOHANG) > 0)
+      continue;
+  }
+  while (wait(NULL) > 0)
+    continue;
+}
+
+char* read_worker_key(char const* file, size_t* len)
+{
+  FILE* f = fopen(file, "r");
+  if (f == NULL) {
+    error(0, errno, "%s: cannot open key", file);
+    return NULL;
+  }
+  char* key = checked_malloc(MAX_KEY_SIZE + 1);
+  size_t n = fread(key, 1, MAX_KEY_SIZE + 1, f);
+  bool bad = ferror(f);
+  fclose(f);
+  while (n > 0 && (key[n - 1] == '\n' || key[n - 1] == '\r'))
+    n--;
+  if (bad || n == 0 || n > MAX_KEY_SIZE) {
+    error(0, 0, "%s: expected a key of 1 to %d bytes", file, MAX_KEY_SIZE);
+    free(key);
+    return NULL;
+  }
+  key[n] = '\0';
+  *len = n;
+  return key;
+}
+
+bool check_worker_key(int fd, char const* key, size_t len)
+{
+  struct timeval timeout = { AUTH_TIMEOUT, 0 };
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+  struct message m;
+  char* payload;
+  if (!recv_message(fd, &m, &payload))
+    return false;
+  // Compares every byte, so the time taken gives nothing away
+  unsigned char diff = m.type != MSG_AUTH || m.len != len;
+  size_t i = 0;
+  for (; payload && i < len && i < m.len; i++)
+    diff |= payload[i] ^ key[i];
+  free(payload);
+  timeout.tv_sec = 0;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+  return diff == 0;
+}
+
+/////////////////////////////////////////////////
+///////////////  Scheduler Side    //////////////
+/////////////////////////////////////////////////
+
+static struct endpoint* add_endpoint(int fd, pid_t pid, char* name, int slots)
+{
+  pool->endpoints = checked_realloc(pool->endpoints,
+                                    (pool->numEndpoints + 1) * sizeof(struct endpoint));
+  struct endpoint* e = &pool->endpoints[pool->numEndpoints++];
+  e->fd = fd;
+  e->pid = pid;
+  e->name = name;
+  e->slots = slots;
+  e->load = 0;
+  e->inflight = checked_malloc((slots ? slots : 1) * sizeof(int));
+  e->dead = false;
+  pool->numLive++;
+  return e;
+}
+
+struct worker_pool* start_worker_pool(int size)
+{
+  pool = checked_malloc(sizeof *pool);
+  memset(pool, 0, sizeof *pool);
+  int i = 0;
+  for (; i < size; i++) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0)
+      error(1, errno, "socketpair");
+    STAT_INC(STAT_FORKS);
+    pid_t pid = fork();
+    if (pid < 0)
+      error(1, errno, "fork");
+    if (pid == 0) {
+      // Keeps nothing of the process but stdio and its own socket, or it
+      // would hold open the sockets of other pools, whose helpers then
+      // never see their scheduler go
+      if (dup2(sv[1], 3) < 0)
+        _exit(126);
+      fcntl(3, F_SETFD, FD_CLOEXEC);
+      close_range(4, ~0U, 0);
+      serve_jobs(3);
+      _exit(0);
+    }
+    close(sv[1]);
+    add_endpoint(sv[0], pid, strdup("worker pool helper"), 0);
+  }
+  return pool;
+}
+
+void use_worker_pool(struct worker_pool* p)
+{
+  pool = p;
+}
+
+// Connects to the worker at HOST:PORT and proves we know KEY.  Returns
+// the connected socket, or -1 with a message on stderr.
+static int connect_worker(char const* host, char const* port, char const* key,
+                          size_t keyLen, int* slots)
+{
+  struct addrinfo hints;
+  struct addrinfo* res;
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  int err = getaddrinfo(host, port, &hints, &res);
+  if (err != 0) {
+    error(0, 0, "%s:%s: %s", host, port, gai_strerror(err));
+    return -1;
+  }
+  int fd = -1;
+  struct addrinfo* ai = res;
+  for (; ai != NULL; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+    if (fd < 0)
+      continue;
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+      break;
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+  if (fd < 0) {
+    error(0, errno, "%s:%s: cannot connect", host, port);
+    return -1;
+  }
+
+  struct message m;
+  char* payload = NULL;
+  if (!send_message(fd, MSG_AUTH, 0, 0, key, keyLen)
+      || !recv_message(fd, &m, &payload) || m.type != MSG_HELLO || m.status <= 0) {
+    error(0, 0, "%s:%s: not a timetrash worker, or it has another key", host, port);
+    free(payload);
+    close(fd);
+    return -1;
+  }
+  free(payload);
+  *slots = m.status;
+  return fd;
+}
+
+// Connects to every HOST:PORT in the comma separated SPEC.  Each worker
+// that accepts our key greets us with MSG_HELLO carrying its slot count.
+bool connect_workers(char const* spec, char const* key_file)
+{
+  size_t keyLen;
+  char* key = read_worker_key(key_file, &keyLen);
+  if (key == NULL)
+    return false;
+  char* list = strdup(spec);
+  char* save;
+  char* item = strtok_r(list, ",", &save);
+  bool ok = true;
+  for (; ok && item != NULL; item = strtok_r(NULL, ",", &save)) {
+    char* colon = strrchr(item, ':');
+    if (colon == NULL) {
+      error(0, 0, "%s: expected HOST:PORT", item);
+      ok = false;
+      break;
+    }
+    *colon = '\0';
+    int slots;
+    int fd = connect_worker(item, colon + 1, key, keyLen, &slots);
+    if (fd < 0) {
+      ok = false;
+      break;
+    }
+    char* name = checked_malloc(strlen(item) + strlen(colon + 1) + 2);
+    sprintf(name, "%s:%s", item, colon + 1);
+    add_endpoint(fd, 0, name, slots);
+  }
+  free(list);
+  free(key);
+  return ok;
+}
+
+bool worker_pool_active(void)
+{
+  return pool && pool->numEndpoints > 0;
+}
+
+// Endpoint with the most free slots, or NULL if all are full
+static struct endpoint* pick_endpoint(void)
+{
+  struct endpoint* best = NULL;
+  int bestFree = 0;
+  int i = 0;
+  for (; i < pool->numEndpoints; i++) {
+    struct endpoint* e = &pool->endpoints[i];
+    if (e->dead)
+      continue;
+    int avail = e->slots ? e->slots - e->load : INT_MAX / 2 - e->load;
+    if (avail > bestFree) {
+      best = e;
+      bestFree = avail;
+    }
+  }
+  return best;
+}
+
+bool pool_has_free_slot(void)
+{
+  return pick_endpoint() != NULL;
+}
+
+// Marks E dead and queues its trees to be reported lost
+static void lose_endpoint(struct endpoint* e)
+{
+  error(0, 0, "lost %s; re-queuing %d command tree(s)", e->name, e->load);
+  close(e->fd);
+  e->dead = true;
+  pool->numLive--;
+  pool->lost = checked_realloc(pool->lost, (pool->numLost + e->load) * sizeof(int));
+  int i = 0;
+  for (; i < e->load; i++)
+    pool->lost[pool->numLost++] = e->inflight[i];
+  e->load = 0;
+  if (pool->numLive == 0)
+    error(0, 0, "no workers left");
+}
+
+// Sends tree C, identified by INDEX, to the endpoint with the most free
+// slots.  Returns false if every endpoint is full.
+bool pool_submit(int index, command_t c, char** read_list, char** write_list)
+{
+  for (;;) {
+    struct endpoint* e = pick_endpoint();
+    if (e == NULL)
+      return false;
+    size_t len;
+    char* buf = serialize_job(c, read_list, write_list, &len);
+    bool sent = send_message(e->fd, MSG_RUN, index, 0, buf, len);
+    free(buf);
+    if (!sent) {
+      lose_endpoint(e);
+      continue;
+    }
+    if (e->slots == 0 && (e->load & (e->load - 1)) == 0 && e->load > 0)
+      e->inflight = checked_realloc(e->inflight, 2 * e->load * sizeof(int));
+    e->inflight[e->load++] = index;
+    return true;
+  }
+}
+
+static void finish_inflight(struct endpoint* e, int index)
+{
+  int i = 0;
+  for (; i < e->load; i++) {
+    if (e->inflight[i] == index) {
+      e->inflight[i] = e->inflight[--e->load];
+      return;
+    }
+  }
+}
+
+// Blocks until some submitted tree finishes.  Returns its index and
+// stores its exit status in *STATUS, or POOL_LOST if the endpoint
+// running it went away and the tree must be submitted again, or
+// POOL_FAILED with an index of -1 if every endpoint has gone.
+int pool_wait(int* status, struct rusage* usage)
+{
+  struct pollfd* fds = checked_malloc(pool->numEndpoints * sizeof(struct pollfd));
+  for (;;) {
+    if (pool->numLive == 0) {
+      free(fds);
+      pool->numLost = 0;
+      *status = POOL_FAILED;
+      return -1;
+    }
+    if (pool->numLost > 0) {
+      free(fds);
+      *status = POOL_LOST;
+      return pool->lost[--pool->numLost];
+    }
+    int i;
+    for (i = 0; i < pool->numEndpoints; i++) {
+      fds[i].fd = pool->endpoints[i].dead ? -1 : pool->endpoints[i].fd;
+      fds[i].events = POLLIN;
+      fds[i].revents = 0;
+    }
+    if (poll(fds, pool->numEndpoints, -1) < 0) {
+      if (errno == EINTR)
+	continue;
+      error(1, errno, "poll");
+    }
+    STAT_INC(STAT_WAKEUPS);
+    for (i = 0; i < pool->numEndpoints; i++) {
+      struct endpoint* e = &pool->endpoints[i];
+      if (e->dead || !fds[i].revents)
+	continue;
+      struct message m;
+      char* payload;
+      if (!recv_message(e->fd, &m, &payload)) {
+	lose_endpoint(e);
+	break;
+      }
+      if (m.type != MSG_DONE) {
+	free(payload);
+	continue;
+      }
+      if (usage) {
+	memset(usage, 0, sizeof *usage);
+	if (m.len == sizeof *usage)
+	  memcpy(usage, payload, sizeof *usage);
+      }
+      free(payload);
+      finish_inflight(e, m.index);
+      free(fds);
+      *status = m.status;
+      return m.index;
+    }
+  }
+}
+
+// Runs C on an endpoint and waits for it, as execute_command would
+bool pool_execute(command_t c)
+{
+  char* none = NULL;
+  int status;
+  struct rusage ru;
+  double start = accounting_now();
+  do {
+    pool_submit(0, c, &none, &none);
+    pool_wait(&status, &ru);
+  } while (status == POOL_LOST);
+  if (status == POOL_FAILED)
+    return false;
+  c->status = status;
+  account_command(c, &ru, start);
+  return true;
+}
+
+void stop_worker_pool(void)
+{
+  int i = 0;
+  for (; i < pool->numEndpoints; i++) {
+    if (!pool->endpoints[i].dead)
+      close(pool->endpoints[i].fd);
+  }
+  for (i = 0; i < pool->numEndpoints; i++) {
+    if (pool->endpoints[i].pid)
+      waitpid(pool->endpoints[i].pid, NULL, 0);
+    free(pool->endpoints[i].inflight);
+    free(pool->endpoints[i].name);
+  }
+  free(pool->endpoints);
+  free(pool->lost);
+  free(pool);
+  pool = NULL;
+}